@@ -26,6 +26,8 @@ ENUM(action_id_t,
   FILE_CLOSE,
   FILE_SAVE,
   FILE_SAVE_AS,
+  FILE_SAVE_ALL,
+  FILE_RESTORE_BACKUP,
   FILE_REPAINT,
   FILE_SUSPEND,
   FILE_EXIT,
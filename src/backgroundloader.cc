@@ -0,0 +1,367 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <system_error>
+#include <unistd.h>
+
+#include "tilde/backgroundloader.h"
+#include "tilde/filebuffer.h"
+#include "tilde/fileline.h"
+#include "tilde/log.h"
+#include "tilde/main.h"
+#include "tilde/option.h"
+
+/* Maximum number of converted blocks waiting to be appended. */
+#define MAX_QUEUED_BLOCKS 4
+/* Maximum time spent appending text, before giving the main loop a chance to handle input. */
+#define APPEND_SLICE_DURATION std::chrono::milliseconds(50)
+/* Estimate of the memory used per line in addition to its text: the line itself, the pointer to it
+   in the buffer, and the allocation overhead of the line and its text. */
+#define LINE_MEMORY_OVERHEAD (sizeof(file_line_t) + sizeof(void *) + 32)
+
+static size_t get_memory_limit() {
+  if (option.max_load_memory != 0) {
+    return option.max_load_memory;
+  }
+#ifdef _SC_PHYS_PAGES
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  if (pages > 0 && page_size > 0) {
+    uintmax_t physical_memory = static_cast<uintmax_t>(pages) * static_cast<uintmax_t>(page_size);
+    return std::min<uintmax_t>(physical_memory / 4 * 3, std::numeric_limits<size_t>::max());
+  }
+#endif
+  return std::numeric_limits<size_t>::max();
+}
+
+background_loader_t::background_loader_t(file_buffer_t *_file, int _fd,
+                                         file_read_wrapper_t *_wrapper, size_t _wrapper_used,
+                                         file_map_t *_map, size_t _map_offset,
+                                         std::chrono::steady_clock::time_point _start_time)
+    : file(_file),
+      fd(_fd),
+      wrapper(_wrapper),
+      wrapper_used(_wrapper_used),
+      map(_map),
+      map_offset(_map_offset),
+      start_time(_start_time),
+      memory_used(_map_offset),
+      memory_limit(get_memory_limit()) {
+  update_connection = connect_update_notification([this] { append_pending(); });
+  if (wrapper != nullptr) {
+    try {
+      thread = std::thread(&background_loader_t::read_converted, this);
+    } catch (...) {
+      update_connection.disconnect();
+      throw;
+    }
+  }
+  signal_update();
+}
+
+background_loader_t::~background_loader_t() {
+  if (!done) {
+    update_connection.disconnect();
+    stop();
+  }
+}
+
+void background_loader_t::cancel() {
+  if (done) {
+    return;
+  }
+  lprintf("Loading of %s canceled\n", file->get_name().c_str());
+  incomplete = true;
+  finish(rw_result_t(rw_result_t::SUCCESS));
+}
+
+void background_loader_t::read_converted() {
+  rw_result_t result(rw_result_t::SUCCESS), conversion_result(rw_result_t::SUCCESS);
+  size_t used = wrapper_used;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      queue_space.wait(lock, [this] { return cancelled || queue.size() < MAX_QUEUED_BLOCKS; });
+      if (cancelled) {
+        break;
+      }
+    }
+
+    try {
+      if (!wrapper->fill_buffer(used)) {
+        break;
+      }
+    } catch (rw_result_t &error) {
+      if (error != rw_result_t::CONVERSION_IMPRECISE && error != rw_result_t::CONVERSION_ILLEGAL) {
+        result = error;
+        break;
+      }
+      /* The converter substitutes the offending characters from here on, as it does when the user
+         chooses to continue during a synchronous load. Report this when loading is done. */
+      if (conversion_result == rw_result_t::SUCCESS) {
+        conversion_result = error;
+      }
+    }
+
+    used = wrapper->get_fill();
+    if (used == 0) {
+      continue;
+    }
+    try {
+      std::string block(wrapper->get_buffer(), used);
+      std::unique_lock<std::mutex> lock(mutex);
+      queue.push_back(std::move(block));
+    } catch (std::bad_alloc &) {
+      result = rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+      break;
+    }
+    signal_update();
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    thread_done = true;
+    thread_result = result == rw_result_t::SUCCESS ? conversion_result : result;
+  }
+  signal_update();
+}
+
+void background_loader_t::append_pending() {
+  std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + APPEND_SLICE_DURATION;
+
+  if (done) {
+    return;
+  }
+
+  try {
+    if (map != nullptr) {
+      while (map_offset < map->size()) {
+        bool valid;
+        size_t block_size = file->process_map_block(
+            *map, map_offset, &valid, [this](string_view block) { insert_lines(block); });
+        map_offset += block_size;
+        apply_pending_position();
+        if (exceeds_memory_limit(block_size)) {
+          incomplete = true;
+          finish(rw_result_t(rw_result_t::LOAD_MEMORY_LIMIT));
+          return;
+        }
+        if (!valid) {
+          read_remainder_converted();
+          return;
+        }
+        if (std::chrono::steady_clock::now() >= deadline) {
+          signal_update();
+          return;
+        }
+      }
+      insert_partial_line();
+      // Edits made while loading are not tracked precisely enough to allow incremental saves.
+      if (!file->is_modified()) {
+        file->mark_unmodified_on_disk(fd);
+      }
+      finish(rw_result_t(rw_result_t::SUCCESS));
+      return;
+    }
+
+    while (true) {
+      std::string block;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (queue.empty()) {
+          if (thread_done) {
+            lock.unlock();
+            finish(thread_result);
+          }
+          return;
+        }
+        block = std::move(queue.front());
+        queue.pop_front();
+      }
+      queue_space.notify_one();
+      insert_lines(block);
+      apply_pending_position();
+      if (exceeds_memory_limit(block.size())) {
+        incomplete = true;
+        finish(rw_result_t(rw_result_t::LOAD_MEMORY_LIMIT));
+        return;
+      }
+      if (std::chrono::steady_clock::now() >= deadline) {
+        signal_update();
+        return;
+      }
+    }
+  } catch (std::bad_alloc &) {
+    incomplete = true;
+    finish(rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM));
+  } catch (rw_result_t &error) {
+    // The file was truncated while it was mapped.
+    incomplete = true;
+    finish(error);
+  }
+}
+
+void background_loader_t::insert_lines(string_view text) {
+  size_t lines_end = text.rfind('\n') + 1;
+  if (lines_end == 0) {
+    partial_line.append(text.data(), text.size());
+    return;
+  }
+  if (partial_line.empty()) {
+    file->insert_loaded_text(text.substr(0, lines_end));
+  } else {
+    partial_line.append(text.data(), lines_end);
+    file->insert_loaded_text(partial_line);
+  }
+  partial_line.assign(text.data() + lines_end, text.size() - lines_end);
+}
+
+void background_loader_t::insert_partial_line() {
+  if (!partial_line.empty()) {
+    file->insert_loaded_text(partial_line);
+    partial_line.clear();
+  }
+}
+
+bool background_loader_t::exceeds_memory_limit(size_t bytes) {
+  memory_used += bytes;
+  return memory_used + static_cast<size_t>(file->size()) * LINE_MEMORY_OVERHEAD > memory_limit;
+}
+
+void background_loader_t::read_remainder_converted() {
+  lprintf("Invalid UTF-8 in %s at offset %zd\n", file->get_name().c_str(), map_offset);
+  try {
+    wrapper = file_read_wrapper_t::open_validating(fd, map_offset, option.read_block_size);
+  } catch (rw_result_t &error) {
+    incomplete = true;
+    finish(error);
+    return;
+  }
+  delete map;
+  map = nullptr;
+  wrapper_used = 0;
+  try {
+    thread = std::thread(&background_loader_t::read_converted, this);
+  } catch (std::system_error &error) {
+    incomplete = true;
+    finish(rw_result_t(rw_result_t::ERRNO_ERROR, error.code().value()));
+  }
+}
+
+void background_loader_t::set_pending_position(text_pos_t line, text_pos_t pos,
+                                               optional<text_coordinate_t> top_left) {
+  pending_line = line;
+  pending_pos = pos;
+  pending_cursor = file->get_cursor();
+  pending_top_left = top_left;
+}
+
+void background_loader_t::apply_pending_position() {
+  // Lines are numbered from 1, and the last line may not be complete until the next one exists.
+  if (pending_line < 0 || (!done && pending_line >= file->size())) {
+    return;
+  }
+  if (file->get_cursor() == pending_cursor) {
+    file->goto_pos(pending_line, pending_pos);
+    if (pending_top_left.is_valid()) {
+      file->set_top_left_in_behavior_parameters(pending_top_left.value());
+    }
+  }
+  pending_line = -1;
+}
+
+void background_loader_t::stop() {
+  if (thread.joinable()) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cancelled = true;
+    }
+    queue_space.notify_all();
+    thread.join();
+  }
+  delete wrapper;
+  wrapper = nullptr;
+  delete map;
+  map = nullptr;
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+void background_loader_t::finish(rw_result_t result) {
+  std::string message;
+
+  done = true;
+  update_connection.disconnect();
+  stop();
+  try {
+    insert_partial_line();
+  } catch (std::bad_alloc &) {
+    incomplete = true;
+  }
+  file->load_line = -1;
+  apply_pending_position();
+
+#ifdef DEBUG
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  lprintf("Background load of %s finished in %.3f s with result %d\n", file->get_name().c_str(),
+          seconds, static_cast<int>(result));
+#endif
+
+  switch (result) {
+    case rw_result_t::SUCCESS:
+      break;
+    case rw_result_t::CONVERSION_IMPRECISE:
+      printf_into(&message,
+                  "Conversion from encoding %s is irreversible. The affected characters in '%s' "
+                  "have been replaced.",
+                  file->get_encoding(), file->get_name().c_str());
+      break;
+    case rw_result_t::CONVERSION_ILLEGAL:
+      printf_into(&message,
+                  "Conversion from encoding %s encountered illegal characters. The illegal "
+                  "characters in '%s' have been replaced.",
+                  file->get_encoding(), file->get_name().c_str());
+      break;
+    case rw_result_t::CONVERSION_TRUNCATED:
+      printf_into(&message, "File '%s' appears to be truncated", file->get_name().c_str());
+      break;
+    case rw_result_t::CONVERSION_ERROR:
+      incomplete = true;
+      printf_into(&message, "Could not load all of file '%s' in encoding %s: %s",
+                  file->get_name().c_str(), file->get_encoding(),
+                  transcript_strerror(result.get_transcript_error()));
+      break;
+    case rw_result_t::LOAD_MEMORY_LIMIT:
+      printf_into(&message, "File '%s' is too large to load completely in the available memory",
+                  file->get_name().c_str());
+      break;
+    case rw_result_t::ERRNO_ERROR:
+    default:
+      incomplete = true;
+      printf_into(&message, "Could not load all of file '%s': %s", file->get_name().c_str(),
+                  strerror(result.get_errno_error()));
+      break;
+  }
+
+  if (!incomplete && file->get_highlight() == nullptr) {
+    // The last lines of the file may contain a mode line.
+    file->detect_highlight();
+  }
+
+  if (!message.empty()) {
+    if (incomplete) {
+      message.append(
+          "\n\nOnly part of the file has been loaded. Saving it under the same name is not "
+          "possible.");
+    }
+    error_dialog->set_message(message);
+    error_dialog->show();
+  }
+}
@@ -0,0 +1,101 @@
+#ifndef BACKGROUNDLOADER_H
+#define BACKGROUNDLOADER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <t3widget/signals.h>
+#include <thread>
+
+#include "tilde/filestate.h"
+#include "tilde/filewrapper.h"
+
+using namespace t3widget;
+
+class file_buffer_t;
+
+/** Loads the remainder of a file, after file_buffer_t::load has loaded the first part.
+
+    For converted files, a worker thread reads and converts the file and queues the result. Mapped
+    files need no worker, as the data is already available. In both cases the text is inserted into
+    the file_buffer_t from the update notification of the main loop, in time-limited slices such
+    that the user interface remains responsive. The buffer can be edited while it is loading, so
+    only complete lines are inserted, before the text the user may have added at the end.
+
+    As every line is stored separately, a very large file may need more memory than is available.
+    Loading therefore stops once the estimated memory use reaches the max_load_memory option, or
+    three quarters of the physical memory if that is not set.
+*/
+class background_loader_t {
+ private:
+  file_buffer_t *file;
+  int fd;
+  file_read_wrapper_t *wrapper;
+  size_t wrapper_used;
+  file_map_t *map;
+  size_t map_offset;
+  std::chrono::steady_clock::time_point start_time;
+
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable queue_space;
+  std::deque<std::string> queue;
+  bool cancelled = false;
+  bool thread_done = false;
+  rw_result_t thread_result;
+
+  // Estimate of the memory used by the text appended so far, and the limit for it.
+  size_t memory_used;
+  size_t memory_limit;
+
+  // Loaded text after the last newline, which is held back until the rest of its line is loaded.
+  // Otherwise the user could edit the line, and the rest of it would be added to the user's text.
+  std::string partial_line;
+
+  // Position to move the cursor to once it has been loaded, see set_pending_position.
+  text_pos_t pending_line = -1, pending_pos = -1;
+  text_coordinate_t pending_cursor;
+  optional<text_coordinate_t> pending_top_left;
+
+  bool done = false;
+  bool incomplete = false;
+  connection_t update_connection;
+
+  void read_converted();
+  /** Account for appending @p bytes of text, and return whether the memory limit is reached. */
+  bool exceeds_memory_limit(size_t bytes);
+  /** Switch from the mapped file to reading through a converter, after finding invalid UTF-8. */
+  void read_remainder_converted();
+  void append_pending();
+  /** Insert the complete lines in @p text, and hold back the partial line at its end. */
+  void insert_lines(string_view text);
+  /** Insert the held back partial line, once no more text follows. */
+  void insert_partial_line();
+  void apply_pending_position();
+  void stop();
+  void finish(rw_result_t result);
+
+ public:
+  /** Create a new background_loader_t, which takes ownership of @p fd, @p wrapper and @p map.
+      @param wrapper_used The number of bytes in the current block of @p wrapper that have already
+          been appended to @p file.
+      @param map_offset The number of bytes of @p map that have already been appended to @p file.
+  */
+  background_loader_t(file_buffer_t *file, int fd, file_read_wrapper_t *wrapper,
+                      size_t wrapper_used, file_map_t *map, size_t map_offset,
+                      std::chrono::steady_clock::time_point start_time);
+  ~background_loader_t();
+
+  /** Stop loading. The text loaded so far remains in the buffer. */
+  void cancel();
+  /** Move the cursor to @p line and @p pos once @p line has been loaded, unless the cursor has
+      been moved by then. If valid, @p top_left is set as the top-left position along with it. */
+  void set_pending_position(text_pos_t line, text_pos_t pos, optional<text_coordinate_t> top_left);
+  bool is_done() const { return done; }
+  /** Returns whether loading stopped before the end of the file was reached. */
+  bool is_incomplete() const { return incomplete; }
+};
+
+#endif
@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fcntl.h>
+#include <memory>
+#include <unistd.h>
+
+#include "tilde/backgroundsaver.h"
+#include "tilde/backupstore.h"
+#include "tilde/copy_file.h"
+#include "tilde/log.h"
+
+/* Size of the blocks in which the spill file is copied, between progress updates. */
+#define COPY_BLOCK_SIZE (1024 * 1024)
+/* Minimum time between progress updates sent to the main loop. */
+#define PROGRESS_INTERVAL std::chrono::milliseconds(100)
+
+/** Copy @p size bytes at @p offset from @p src_fd to the same offset in @p dest_fd.
+    @return The number of bytes copied, or -1 on error. */
+static ssize_t copy_block(int src_fd, int dest_fd, off_t offset, size_t size,
+                          std::unique_ptr<char[]> *buffer) {
+  ssize_t result;
+#ifdef HAS_COPY_FILE_RANGE
+  if (*buffer == nullptr) {
+    loff_t src_offset = offset, dest_offset = offset;
+    while ((result = copy_file_range(src_fd, &src_offset, dest_fd, &dest_offset, size, 0)) < 0 &&
+           (errno == EINTR || errno == EAGAIN)) {
+    }
+    if (result > 0 || (result < 0 && errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+                       errno != EOPNOTSUPP)) {
+      return result;
+    }
+    // Fall back to reading and writing, also when nothing was copied at all.
+  }
+#endif
+  if (*buffer == nullptr) {
+    buffer->reset(new char[COPY_BLOCK_SIZE]);
+  }
+  while ((result = pread(src_fd, buffer->get(), size, offset)) < 0 && errno == EINTR) {
+  }
+  if (result <= 0) {
+    if (result == 0) {
+      errno = EIO;
+    }
+    return -1;
+  }
+  size_t read_bytes = result;
+  for (size_t written = 0; written < read_bytes; written += result) {
+    while ((result = pwrite(dest_fd, buffer->get() + written, read_bytes - written,
+                            offset + written)) < 0 &&
+           errno == EINTR) {
+    }
+    if (result < 0) {
+      return -1;
+    }
+  }
+  return read_bytes;
+}
+
+rw_result_t write_spill_file(const spill_target_t &target,
+                             const std::function<void(off_t)> &progress) {
+  if (target.replace) {
+    if (fsync(target.spill_fd) < 0) {
+      return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, errno);
+    }
+    if (rename(target.spill_name.c_str(), target.real_name.c_str()) < 0) {
+      return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, errno);
+    }
+    // Make the rename durable. Failure is not reported, as the file itself has been written.
+    size_t idx = target.real_name.rfind('/');
+    std::string dir_name = idx == std::string::npos ? "." : target.real_name.substr(0, idx + 1);
+    int dir_fd = open(dir_name.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+    if (progress) {
+      progress(target.size);
+    }
+    return rw_result_t(rw_result_t::SUCCESS);
+  }
+
+#ifdef HAS_POSIX_FALLOCATE
+  // Pre-allocate the required size of the file, such that running out of space is detected before
+  // anything is changed. All errors other than ENOSPC and EFBIG are ignored.
+  int allocate_error = posix_fallocate(target.fd, 0, target.size);
+  if (allocate_error == ENOSPC || allocate_error == EFBIG) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED, allocate_error);
+  }
+#endif
+
+  if (copy_file_by_ficlone(target.spill_fd, target.fd) != 0) {
+    // io_uring also truncates and syncs the file, so nothing remains to be done if it succeeds.
+    int error = copy_file_by_io_uring(target.spill_fd, target.fd, target.size, true,
+                                      [&progress](size_t copied) {
+                                        if (progress) {
+                                          progress(copied);
+                                        }
+                                      });
+    if (error == 0) {
+      return rw_result_t(rw_result_t::SUCCESS);
+    } else if (error != ENOTSUP && error != ENOSYS) {
+      return rw_result_t(rw_result_t::ERRNO_ERROR, error);
+    }
+
+    std::unique_ptr<char[]> buffer;
+    for (off_t offset = 0; offset < target.size;) {
+      size_t size = std::min<off_t>(target.size - offset, COPY_BLOCK_SIZE);
+      ssize_t result = copy_block(target.spill_fd, target.fd, offset, size, &buffer);
+      if (result < 0) {
+        return rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+      }
+      offset += result;
+      if (progress) {
+        progress(offset);
+      }
+    }
+  }
+
+  int result;
+  while ((result = ftruncate(target.fd, target.size)) < 0 && errno == EINTR) {
+  }
+  if (result < 0 || fsync(target.fd) < 0) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+  }
+  if (progress) {
+    progress(target.size);
+  }
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+background_saver_t::background_saver_t(const spill_target_t &_target, std::string _backup_dir,
+                                       int _backup_versions, std::function<void()> _done_cb)
+    : target(_target),
+      backup_dir(std::move(_backup_dir)),
+      backup_versions(_backup_versions),
+      done_cb(std::move(_done_cb)),
+      progress(0) {
+  update_connection = connect_update_notification([this] { check_done(); });
+  try {
+    thread = std::thread(&background_saver_t::write, this);
+  } catch (...) {
+    update_connection.disconnect();
+    throw;
+  }
+}
+
+background_saver_t::~background_saver_t() {
+  update_connection.disconnect();
+  if (thread.joinable()) {
+    thread.join();
+  }
+}
+
+void background_saver_t::write() {
+  rw_result_t result(rw_result_t::SUCCESS);
+
+  if (!backup_dir.empty()) {
+    int error = backup_store_t(backup_dir).store(target.real_name, target.fd, backup_versions);
+    if (error != 0) {
+      result = rw_result_t(rw_result_t::BACKUP_FAILED, error);
+    } else {
+      backup_stored = true;
+    }
+  }
+
+  if (result == rw_result_t::SUCCESS) {
+    // Wake up the main loop at a limited rate to redraw the progress.
+    std::chrono::steady_clock::time_point last_update = std::chrono::steady_clock::now();
+    result = write_spill_file(target, [this, &last_update](off_t written) {
+      progress = written;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (now - last_update >= PROGRESS_INTERVAL) {
+        last_update = now;
+        signal_update();
+      }
+    });
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    thread_done = true;
+    thread_result = result;
+  }
+  signal_update();
+}
+
+void background_saver_t::check_done() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!thread_done) {
+      return;
+    }
+  }
+  thread.join();
+  done = true;
+  update_connection.disconnect();
+  lprintf("Background save of %s finished with result %d\n", target.real_name.c_str(),
+          static_cast<int>(thread_result));
+  done_cb();
+}
+
+int background_saver_t::get_progress() const {
+  if (target.size == 0) {
+    return 0;
+  }
+  return static_cast<int>(progress * 100 / target.size);
+}
@@ -0,0 +1,83 @@
+#ifndef BACKGROUNDSAVER_H
+#define BACKGROUNDSAVER_H
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <t3widget/signals.h>
+#include <thread>
+
+#include "tilde/filestate.h"
+
+using namespace t3widget;
+
+/** The last step of saving through a spill file: putting the converted text in place. */
+struct spill_target_t {
+  int spill_fd;
+  int fd;
+  // Size of the converted text in the spill file.
+  off_t size;
+  // If set, the spill file is renamed from spill_name to real_name, instead of being copied to fd.
+  bool replace;
+  std::string spill_name;
+  std::string real_name;
+};
+
+/** Copy or rename the spill file described by @p target into place, and make the result durable.
+    File descriptors are not closed. On failure before the target file is modified, the result is
+    ERRNO_ERROR_FILE_UNTOUCHED.
+    @param progress If set, called with the number of bytes copied so far.
+*/
+rw_result_t write_spill_file(const spill_target_t &target,
+                             const std::function<void(off_t)> &progress);
+
+/** Runs write_spill_file on a worker thread, such that a slow disk does not block the user
+    interface. Storing the original contents in the backup store can be done on the same thread,
+    as hashing the chunks of a large file takes a noticeable amount of time.
+
+    The callback passed to the constructor is called from the update notification of the main loop
+    once writing is done. It may start a new save, but must not destroy the background_saver_t.
+*/
+class background_saver_t {
+ private:
+  spill_target_t target;
+  std::string backup_dir;
+  int backup_versions;
+  std::function<void()> done_cb;
+
+  std::thread thread;
+  std::mutex mutex;
+  bool thread_done = false;
+  rw_result_t thread_result;
+  bool backup_stored = false;
+  std::atomic<off_t> progress;
+
+  bool done = false;
+  connection_t update_connection;
+
+  void write();
+  void check_done();
+
+ public:
+  /** Create a new background_saver_t, which starts writing @p target.
+      @param backup_dir If not empty, the original contents of target.fd are first stored in the
+          backup store in this directory, keeping @p backup_versions versions. If that fails, the
+          result is BACKUP_FAILED and the file is not written.
+  */
+  background_saver_t(const spill_target_t &target, std::string backup_dir, int backup_versions,
+                     std::function<void()> done_cb);
+  ~background_saver_t();
+
+  bool is_done() const { return done; }
+  /** Returns the result of writing. Only valid once is_done returns @c true. */
+  rw_result_t get_result() const { return thread_result; }
+  /** Returns whether the original contents were stored in the backup store. Only valid once
+      is_done returns @c true. */
+  bool is_backup_stored() const { return backup_stored; }
+  /** Returns the percentage of the file written so far. */
+  int get_progress() const;
+};
+
+#endif
@@ -0,0 +1,633 @@
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <set>
+#include <sys/stat.h>
+#include <t3config/config.h>
+#include <unistd.h>
+
+#include "tilde/backupstore.h"
+#include "tilde/copy_file.h"
+#include "tilde/log.h"
+
+/* Chunk boundaries are placed where the top 13 bits of the gear hash are zero. */
+#define CHUNK_MASK UINT64_C(0xfff8000000000000)
+/* Size of the buffer from which chunks are cut. */
+#define CHUNK_BUFFER_SIZE (4 * BACKUP_MAX_CHUNK_SIZE)
+/* Unused chunks are only removed if they have not been used for this many seconds. This prevents
+   removal of chunks that a concurrent store found to be present, but has not listed yet. */
+#define CHUNK_GRACE_PERIOD (60 * 60)
+
+#define MANIFEST_MAGIC "tilde-backup 1\n"
+#define MANIFEST_SUFFIX ".manifest"
+#define CLONE_SUFFIX ".data"
+
+namespace {
+
+struct gear_table_t {
+  uint64_t values[256];
+
+  // The table must be the same for every run, so it is generated by splitmix64 from a fixed seed.
+  gear_table_t() {
+    uint64_t state = 0;
+    for (uint64_t &value : values) {
+      state += UINT64_C(0x9e3779b97f4a7c15);
+      uint64_t z = state;
+      z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+      z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+      value = z ^ (z >> 31);
+    }
+  }
+};
+
+class sha256_t {
+ private:
+  uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                       0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+  unsigned char block[64];
+  size_t block_fill = 0;
+  uint64_t length = 0;
+
+  static uint32_t rotate(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+  void process_block() {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+        0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+        0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+        0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+        0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+        0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+        0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+        0xc67178f2};
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = static_cast<uint32_t>(block[i * 4]) << 24 |
+             static_cast<uint32_t>(block[i * 4 + 1]) << 16 |
+             static_cast<uint32_t>(block[i * 4 + 2]) << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5],
+             g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) +
+                    k[i] + w[i];
+      uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+
+ public:
+  void update(const char *data, size_t size) {
+    length += size;
+    while (size > 0) {
+      size_t bytes = std::min(size, sizeof(block) - block_fill);
+      memcpy(block + block_fill, data, bytes);
+      block_fill += bytes;
+      data += bytes;
+      size -= bytes;
+      if (block_fill == sizeof(block)) {
+        process_block();
+        block_fill = 0;
+      }
+    }
+  }
+
+  std::string hex_digest() {
+    uint64_t bit_length = length * 8;
+    block[block_fill++] = 0x80;
+    if (block_fill > 56) {
+      memset(block + block_fill, 0, sizeof(block) - block_fill);
+      process_block();
+      block_fill = 0;
+    }
+    memset(block + block_fill, 0, 56 - block_fill);
+    for (int i = 0; i < 8; ++i) {
+      block[56 + i] = static_cast<unsigned char>(bit_length >> (56 - i * 8));
+    }
+    process_block();
+
+    std::string result;
+    char digits[9];
+    for (uint32_t value : state) {
+      snprintf(digits, sizeof(digits), "%08" PRIx32, value);
+      result.append(digits);
+    }
+    return result;
+  }
+};
+
+int make_dirs(const std::string &dir) {
+  for (size_t slash = dir.find('/', 1); slash != std::string::npos;
+       slash = dir.find('/', slash + 1)) {
+    if (mkdir(dir.substr(0, slash).c_str(), 0700) < 0 && errno != EEXIST) {
+      return errno;
+    }
+  }
+  if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+    return errno;
+  }
+  return 0;
+}
+
+int write_all(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    ssize_t result = write(fd, data, size);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    data += result;
+    size -= result;
+  }
+  return 0;
+}
+
+/** Write @p data to a temporary file next to @p name, and rename it to @p name. If @p sync is
+    @c true, the file is synced before it is renamed. */
+int write_file(const std::string &name, const char *data, size_t size, bool sync = true) {
+  std::string temp_name = name + ".XXXXXX";
+  int fd = mkstemp(&temp_name[0]);
+  if (fd < 0) {
+    return errno;
+  }
+  int error = write_all(fd, data, size);
+  if (error == 0 && sync && fsync(fd) < 0) {
+    error = errno;
+  }
+  if (close(fd) < 0 && error == 0) {
+    error = errno;
+  }
+  if (error == 0 && rename(temp_name.c_str(), name.c_str()) < 0) {
+    error = errno;
+  }
+  if (error != 0) {
+    unlink(temp_name.c_str());
+  }
+  return error;
+}
+
+int read_file(const std::string &name, std::string *contents) {
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return errno;
+  }
+  contents->clear();
+  char buffer[4096];
+  ssize_t result;
+  while ((result = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      int error = errno;
+      close(fd);
+      return error;
+    }
+    contents->append(buffer, result);
+  }
+  close(fd);
+  return 0;
+}
+
+void sync_dir(const std::string &dir) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/** Returns the names of the entries in @p dir ending in @p suffix, sorted. */
+std::vector<std::string> list_dir(const std::string &dir, const char *suffix) {
+  std::vector<std::string> result;
+  std::unique_ptr<DIR, int (*)(DIR *)> handle(opendir(dir.c_str()), closedir);
+  if (handle == nullptr) {
+    return result;
+  }
+  size_t suffix_length = strlen(suffix);
+  struct dirent *entry;
+  while ((entry = readdir(handle.get())) != nullptr) {
+    size_t length = strlen(entry->d_name);
+    if (entry->d_name[0] != '.' && length >= suffix_length &&
+        strcmp(entry->d_name + length - suffix_length, suffix) == 0) {
+      result.push_back(entry->d_name);
+    }
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+struct manifest_t {
+  off_t size = 0;
+  bool clone = false;
+  std::vector<std::pair<std::string, size_t>> chunks;
+};
+
+int parse_manifest(const std::string &name, manifest_t *manifest) {
+  std::string contents;
+  int error = read_file(name, &contents);
+  if (error != 0) {
+    return error;
+  }
+  if (contents.compare(0, strlen(MANIFEST_MAGIC), MANIFEST_MAGIC) != 0) {
+    return EINVAL;
+  }
+  for (size_t start = strlen(MANIFEST_MAGIC); start < contents.size();) {
+    size_t end = contents.find('\n', start);
+    if (end == std::string::npos) {
+      return EINVAL;
+    }
+    std::string line = contents.substr(start, end - start);
+    start = end + 1;
+
+    char hash[65];
+    size_t size;
+    intmax_t file_size;
+    if (line == "clone") {
+      manifest->clone = true;
+    } else if (sscanf(line.c_str(), "size %jd", &file_size) == 1) {
+      manifest->size = file_size;
+    } else if (sscanf(line.c_str(), "chunk %64s %zu", hash, &size) == 2) {
+      manifest->chunks.emplace_back(hash, size);
+    } else {
+      return EINVAL;
+    }
+  }
+  return 0;
+}
+
+std::string clone_name(const std::string &manifest) {
+  return manifest.substr(0, manifest.size() - strlen(MANIFEST_SUFFIX)) + CLONE_SUFFIX;
+}
+
+}  // namespace
+
+size_t find_chunk_boundary(const char *data, size_t size) {
+  if (size <= BACKUP_MIN_CHUNK_SIZE) {
+    return size;
+  }
+  size_t limit = std::min<size_t>(size, BACKUP_MAX_CHUNK_SIZE);
+  static const gear_table_t gear_table;
+  const uint64_t *gear = gear_table.values;
+  uint64_t hash = 0;
+  // The top bits of the hash only depend on the last 64 bytes, so hashing can start there.
+  for (size_t i = BACKUP_MIN_CHUNK_SIZE - 64; i < limit; ++i) {
+    hash = (hash << 1) + gear[static_cast<unsigned char>(data[i])];
+    if (i >= BACKUP_MIN_CHUNK_SIZE && (hash & CHUNK_MASK) == 0) {
+      return i + 1;
+    }
+  }
+  return limit;
+}
+
+std::string sha256_hex(const char *data, size_t size) {
+  sha256_t hash;
+  hash.update(data, size);
+  return hash.hex_digest();
+}
+
+backup_store_t::backup_store_t(std::string _dir) : dir(std::move(_dir)) {}
+
+std::string backup_store_t::default_dir() {
+  std::unique_ptr<char, decltype(&free)> xdg_path(
+      t3_config_xdg_get_path(T3_CONFIG_XDG_CACHE_HOME, "tilde", 0), free);
+  if (xdg_path == nullptr) {
+    return std::string();
+  }
+  return std::string(xdg_path.get()) + "/backups";
+}
+
+std::string backup_store_t::version_dir(const std::string &name) const {
+  return dir + "/versions/" + sha256_hex(name.data(), name.size());
+}
+
+int backup_store_t::store(const std::string &name, int fd, int max_versions) {
+  struct stat file_info;
+  if (fstat(fd, &file_info) < 0) {
+    return errno;
+  }
+  if (file_info.st_size == 0) {
+    return 0;
+  }
+
+  std::string versions = version_dir(name);
+  int error = make_dirs(versions);
+  if (error != 0) {
+    return error;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  int64_t time = static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+  std::string prefix;
+  int clone_fd;
+  // The clone file is created first, to claim the name of the version.
+  do {
+    char base_name[32];
+    snprintf(base_name, sizeof(base_name), "%019" PRId64, time++);
+    prefix = versions + "/" + base_name;
+  } while ((clone_fd = open((prefix + CLONE_SUFFIX).c_str(), O_CREAT | O_EXCL | O_WRONLY, 0600)) <
+               0 &&
+           errno == EEXIST);
+  if (clone_fd < 0) {
+    return errno;
+  }
+
+  std::string manifest(MANIFEST_MAGIC);
+  if (copy_file_by_ficlone(fd, clone_fd) == 0 && fsync(clone_fd) == 0) {
+    close(clone_fd);
+    manifest.append("clone\n");
+    char size_line[48];
+    snprintf(size_line, sizeof(size_line), "size %jd\n", static_cast<intmax_t>(file_info.st_size));
+    manifest.append(size_line);
+  } else {
+    close(clone_fd);
+    unlink((prefix + CLONE_SUFFIX).c_str());
+    if ((error = store_chunks(fd, file_info.st_size, &manifest)) != 0) {
+      return error;
+    }
+  }
+
+  if ((error = write_file(prefix + MANIFEST_SUFFIX, manifest.data(), manifest.size())) != 0) {
+    unlink((prefix + CLONE_SUFFIX).c_str());
+    return error;
+  }
+  sync_dir(versions);
+  remove_old_versions(versions, max_versions);
+  return 0;
+}
+
+int backup_store_t::store_chunks(int fd, off_t size, std::string *manifest) {
+  std::unique_ptr<char[]> buffer(new char[CHUNK_BUFFER_SIZE]);
+  size_t start = 0, fill = 0;
+  off_t offset = 0;
+  std::string chunk_lines;
+  size_t chunk_count = 0, new_chunks = 0;
+
+  while (true) {
+    // Only refill the buffer when it no longer holds a chunk of the maximum size, to limit moving
+    // the data around.
+    if (fill - start < BACKUP_MAX_CHUNK_SIZE && offset < size) {
+      memmove(buffer.get(), buffer.get() + start, fill - start);
+      fill -= start;
+      start = 0;
+      while (fill < CHUNK_BUFFER_SIZE && offset < size) {
+        ssize_t result = pread(fd, buffer.get() + fill, CHUNK_BUFFER_SIZE - fill, offset);
+        if (result < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return errno;
+        } else if (result == 0) {
+          // The file was truncated while reading.
+          return EIO;
+        }
+        fill += result;
+        offset += result;
+      }
+    }
+    if (start == fill) {
+      break;
+    }
+
+    size_t length = find_chunk_boundary(buffer.get() + start, fill - start);
+    std::string hash;
+    int error = store_chunk(buffer.get() + start, length, &hash);
+    if (error > 0) {
+      return error;
+    }
+    new_chunks += error < 0;
+    ++chunk_count;
+    chunk_lines.append("chunk ").append(hash).append(" ").append(std::to_string(length));
+    chunk_lines.push_back('\n');
+    start += length;
+  }
+  lprintf("Stored %zd bytes in %zd chunks, of which %zd new\n", static_cast<size_t>(size),
+          chunk_count, new_chunks);
+  /* New chunks are written without syncing each of them, as that would take one fsync per 8 KiB.
+     Instead, the file system is synced once, before the manifest that refers to them is written. */
+  if (new_chunks > 0) {
+    int dir_fd = open((dir + "/chunks").c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd < 0) {
+      return errno;
+    }
+    int error = syncfs(dir_fd) < 0 ? errno : 0;
+    close(dir_fd);
+    if (error != 0) {
+      return error;
+    }
+  }
+
+  char size_line[48];
+  snprintf(size_line, sizeof(size_line), "size %jd\n", static_cast<intmax_t>(size));
+  manifest->append(size_line);
+  manifest->append(chunk_lines);
+  return 0;
+}
+
+/* Returns 0 if the chunk was already present, -1 if it was written, or an errno value. */
+int backup_store_t::store_chunk(const char *data, size_t size, std::string *hash) {
+  *hash = sha256_hex(data, size);
+  std::string chunk_dir = dir + "/chunks/" + hash->substr(0, 2);
+  std::string name = chunk_dir + "/" + hash->substr(2);
+
+  /* Chunks which are already present only get a new time stamp, which protects them against
+     removal by a concurrent clean-up. As chunks are not synced individually, a crash may leave a
+     chunk without its data. Such a chunk is written again. */
+  struct stat chunk_info;
+  if (stat(name.c_str(), &chunk_info) == 0) {
+    if (static_cast<size_t>(chunk_info.st_size) == size) {
+      return utimensat(AT_FDCWD, name.c_str(), nullptr, 0) == 0 ? 0 : errno;
+    }
+  } else if (errno != ENOENT) {
+    return errno;
+  }
+  int error = make_dirs(chunk_dir);
+  if (error == 0) {
+    error = write_file(name, data, size, false);
+  }
+  return error == 0 ? -1 : error;
+}
+
+void backup_store_t::remove_old_versions(const std::string &versions, int max_versions) {
+  std::vector<std::string> manifests = list_dir(versions, MANIFEST_SUFFIX);
+  if (max_versions < 1) {
+    max_versions = 1;
+  }
+  if (manifests.size() <= static_cast<size_t>(max_versions)) {
+    return;
+  }
+  for (size_t i = 0; i < manifests.size() - max_versions; ++i) {
+    std::string name = versions + "/" + manifests[i];
+    unlink(clone_name(name).c_str());
+    unlink(name.c_str());
+  }
+  remove_unused_chunks();
+}
+
+void backup_store_t::remove_unused_chunks() {
+  std::set<std::string> used;
+  std::string versions = dir + "/versions";
+  std::unique_ptr<DIR, int (*)(DIR *)> handle(opendir(versions.c_str()), closedir);
+  if (handle == nullptr) {
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(handle.get())) != nullptr) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    std::string version_dir = versions + "/" + entry->d_name;
+    for (const std::string &name : list_dir(version_dir, MANIFEST_SUFFIX)) {
+      manifest_t manifest;
+      if (parse_manifest(version_dir + "/" + name, &manifest) != 0) {
+        // Without knowing which chunks the manifest uses, none can be removed safely.
+        lprintf("Could not parse backup manifest %s/%s\n", version_dir.c_str(), name.c_str());
+        return;
+      }
+      for (const auto &chunk : manifest.chunks) {
+        used.insert(chunk.first);
+      }
+    }
+  }
+
+  time_t limit = time(nullptr) - CHUNK_GRACE_PERIOD;
+  std::string chunks = dir + "/chunks";
+  handle.reset(opendir(chunks.c_str()));
+  if (handle == nullptr) {
+    return;
+  }
+  while ((entry = readdir(handle.get())) != nullptr) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    std::string prefix = entry->d_name;
+    std::string chunk_dir = chunks + "/" + prefix;
+    for (const std::string &name : list_dir(chunk_dir, "")) {
+      std::string path = chunk_dir + "/" + name;
+      struct stat chunk_info;
+      if (used.count(prefix + name) == 0 && stat(path.c_str(), &chunk_info) == 0 &&
+          chunk_info.st_mtime < limit) {
+        unlink(path.c_str());
+      }
+    }
+  }
+}
+
+std::vector<backup_version_t> backup_store_t::list(const std::string &name) const {
+  std::vector<backup_version_t> result;
+  std::string versions = version_dir(name);
+  for (const std::string &manifest_name : list_dir(versions, MANIFEST_SUFFIX)) {
+    backup_version_t version;
+    manifest_t manifest;
+    version.manifest = versions + "/" + manifest_name;
+    if (parse_manifest(version.manifest, &manifest) != 0) {
+      continue;
+    }
+    version.time = strtoll(manifest_name.c_str(), nullptr, 10);
+    version.size = manifest.size;
+    result.push_back(version);
+  }
+  std::reverse(result.begin(), result.end());
+  return result;
+}
+
+int backup_store_t::restore(const backup_version_t &version, int fd) const {
+  manifest_t manifest;
+  int error = parse_manifest(version.manifest, &manifest);
+  if (error != 0) {
+    return error;
+  }
+
+  if (manifest.clone) {
+    int clone_fd = open(clone_name(version.manifest).c_str(), O_RDONLY);
+    if (clone_fd < 0) {
+      return errno;
+    }
+    error = copy_file_and_sync(clone_fd, fd);
+    close(clone_fd);
+    return error;
+  }
+
+  for (const auto &chunk : manifest.chunks) {
+    const std::string &hash = chunk.first;
+    if (hash.size() != 64 || chunk.second > BACKUP_MAX_CHUNK_SIZE) {
+      return EINVAL;
+    }
+    std::string data;
+    if ((error = read_file(dir + "/chunks/" + hash.substr(0, 2) + "/" + hash.substr(2), &data)) !=
+        0) {
+      return error;
+    }
+    // Damaged chunks are reported, rather than silently restoring the wrong contents.
+    if (data.size() != chunk.second || sha256_hex(data.data(), data.size()) != hash) {
+      return EIO;
+    }
+    if ((error = write_all(fd, data.data(), data.size())) != 0) {
+      return error;
+    }
+  }
+  if (fsync(fd) < 0) {
+    return errno;
+  }
+  return 0;
+}
+
+int backup_store_t::restore_copy(const std::string &name, const backup_version_t &version,
+                                 std::string *copy_name) const {
+  std::string restore_dir = dir + "/restored";
+  int error = make_dirs(restore_dir);
+  if (error != 0) {
+    return error;
+  }
+
+  time_t seconds = version.time / 1000000000;
+  struct tm local_time;
+  char time_str[32];
+  localtime_r(&seconds, &local_time);
+  strftime(time_str, sizeof(time_str), "%Y%m%d-%H%M%S", &local_time);
+  size_t idx = name.rfind('/');
+  *copy_name = restore_dir + "/" + (idx == std::string::npos ? name : name.substr(idx + 1)) + "." +
+               time_str;
+
+  int fd = open(copy_name->c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+  if (fd < 0) {
+    return errno;
+  }
+  error = restore(version, fd);
+  if (close(fd) < 0 && error == 0) {
+    error = errno;
+  }
+  return error;
+}
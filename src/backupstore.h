@@ -0,0 +1,70 @@
+#ifndef BACKUPSTORE_H
+#define BACKUPSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+/* Limits on the size of the content-defined chunks. The average size is about 8 KiB. */
+#define BACKUP_MIN_CHUNK_SIZE (2 * 1024)
+#define BACKUP_MAX_CHUNK_SIZE (64 * 1024)
+
+/** Returns the length of the chunk starting at @p data. Boundaries only depend on the bytes right
+    before them, such that an edit only changes the chunks around it. If no boundary is found, the
+    result is @p size or BACKUP_MAX_CHUNK_SIZE, whichever is smaller. */
+size_t find_chunk_boundary(const char *data, size_t size);
+
+/** Returns the SHA-256 hash of @p data as a hexadecimal string. */
+std::string sha256_hex(const char *data, size_t size);
+
+struct backup_version_t {
+  // Time the version was stored, in nanoseconds since the epoch.
+  int64_t time;
+  off_t size;
+  // Path of the manifest describing the version.
+  std::string manifest;
+};
+
+/** Stores versions of files as content-defined chunks, such that data which is already present in
+    the store is not written again.
+
+    Chunks are stored in chunks/<hash>, and each stored version of a file is described by a manifest
+    in versions/<hash of the file name>/. If the file can be cloned into the store with a reflink,
+    the clone is stored next to the manifest instead, as the file system then shares the data.
+*/
+class backup_store_t {
+ private:
+  std::string dir;
+
+  std::string version_dir(const std::string &name) const;
+  int store_chunks(int fd, off_t size, std::string *manifest);
+  int store_chunk(const char *data, size_t size, std::string *hash);
+  void remove_old_versions(const std::string &version_dir, int max_versions);
+  void remove_unused_chunks();
+
+ public:
+  explicit backup_store_t(std::string _dir);
+
+  /** Returns the default location of the store, in the XDG cache directory, or an empty string if
+      the XDG cache directory can not be determined. */
+  static std::string default_dir();
+
+  /** Stores the contents of @p fd as a new version of the file @p name, and removes all but the
+      newest @p max_versions versions. Empty files are not stored.
+      @return 0 on success, or an errno value. */
+  int store(const std::string &name, int fd, int max_versions);
+  /** Returns the stored versions of @p name, newest first. */
+  std::vector<backup_version_t> list(const std::string &name) const;
+  /** Writes the contents of @p version to @p fd, and syncs it.
+      @return 0 on success, or an errno value. */
+  int restore(const backup_version_t &version, int fd) const;
+  /** Writes the contents of @p version of the file @p name to a new file in the store.
+      @param copy_name Set to the name of the written file.
+      @return 0 on success, or an errno value. */
+  int restore_copy(const std::string &name, const backup_version_t &version,
+                   std::string *copy_name) const;
+};
+
+#endif
@@ -4,11 +4,20 @@
 
 #include "tilde/copy_file.h"
 
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
 #include <limits>
+#include <map>
+#include <mutex>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <t3widget/util.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/statfs.h>
+#endif
 
 using namespace t3widget;
 
@@ -97,6 +106,202 @@ int copy_file_by_ficlone(int src_fd, int dest_fd) {
 int copy_file_by_ficlone(int, int) { return ENOTSUP; }
 #endif
 
+#if defined(HAS_LIBURING)
+#include <cerrno>
+#include <liburing.h>
+#include <memory>
+
+#if defined(IO_URING_CHECK_VERSION) && !IO_URING_CHECK_VERSION(2, 6)
+#define USE_URING_FTRUNCATE
+#endif
+
+// Number of blocks copied at the same time, and their size.
+#define URING_BLOCKS 8
+#define URING_BLOCK_SIZE (256 * 1024)
+
+static bool uring_opcodes_supported(struct io_uring *ring, bool *ftruncate_supported) {
+  struct io_uring_probe *probe = io_uring_get_probe_ring(ring);
+  if (probe == nullptr) {
+    return false;
+  }
+  bool result = io_uring_opcode_supported(probe, IORING_OP_READ) &&
+                io_uring_opcode_supported(probe, IORING_OP_WRITE) &&
+                io_uring_opcode_supported(probe, IORING_OP_FSYNC);
+#ifdef USE_URING_FTRUNCATE
+  *ftruncate_supported = io_uring_opcode_supported(probe, IORING_OP_FTRUNCATE);
+#else
+  *ftruncate_supported = false;
+#endif
+  io_uring_free_probe(probe);
+  return result;
+}
+
+// Submit the queued requests, and wait until at least one has completed.
+static int uring_submit(struct io_uring *ring, int *pending) {
+  int result;
+  while ((result = io_uring_submit_and_wait(ring, 1)) == -EINTR) {
+  }
+  if (result < 0) {
+    return -result;
+  }
+  *pending += result;
+  return 0;
+}
+
+// Wait for all submitted requests, such that the buffers they use can be released.
+static void uring_drain(struct io_uring *ring, int pending) {
+  struct io_uring_cqe *cqe;
+  while (pending > 0) {
+    int result = io_uring_wait_cqe(ring, &cqe);
+    if (result == -EINTR) {
+      continue;
+    } else if (result < 0) {
+      return;
+    }
+    io_uring_cqe_seen(ring, cqe);
+    --pending;
+  }
+}
+
+/* Every block is copied by a read request, linked to a write request of the same buffer. The
+   user_data of the requests is twice the block index, plus one for the write. */
+static int uring_copy(struct io_uring *ring, char *buffers, int src_fd, int dest_fd,
+                      size_t bytes_to_copy, bool sync,
+                      const std::function<void(size_t)> &progress) {
+  bool ftruncate_supported;
+  if (!uring_opcodes_supported(ring, &ftruncate_supported)) {
+    return ENOTSUP;
+  }
+
+  size_t lengths[URING_BLOCKS] = {};
+  size_t offsets[URING_BLOCKS];
+  size_t offset = 0, copied = 0;
+  int in_flight = 0, pending = 0, error = 0;
+  struct io_uring_sqe *sqe;
+  struct io_uring_cqe *cqe;
+
+  while (in_flight > 0 || (offset < bytes_to_copy && error == 0)) {
+    for (int i = 0; i < URING_BLOCKS && offset < bytes_to_copy && error == 0; ++i) {
+      if (lengths[i] != 0) {
+        continue;
+      }
+      lengths[i] = std::min<size_t>(bytes_to_copy - offset, URING_BLOCK_SIZE);
+      offsets[i] = offset;
+      sqe = io_uring_get_sqe(ring);
+      io_uring_prep_read(sqe, src_fd, buffers + i * URING_BLOCK_SIZE, lengths[i], offset);
+      io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+      sqe->user_data = i * 2;
+      sqe = io_uring_get_sqe(ring);
+      io_uring_prep_write(sqe, dest_fd, buffers + i * URING_BLOCK_SIZE, lengths[i], offset);
+      sqe->user_data = i * 2 + 1;
+      offset += lengths[i];
+      ++in_flight;
+    }
+
+    if ((error = uring_submit(ring, &pending)) != 0) {
+      uring_drain(ring, pending);
+      return error;
+    }
+
+    while (io_uring_peek_cqe(ring, &cqe) == 0) {
+      int i = cqe->user_data / 2;
+      bool is_write = cqe->user_data & 1;
+      int result = cqe->res;
+      io_uring_cqe_seen(ring, cqe);
+      --pending;
+
+      if (!is_write) {
+        // A short read cancels the linked write. Report it as an I/O error.
+        if (result < 0 || static_cast<size_t>(result) < lengths[i]) {
+          error = error != 0 ? error : result < 0 ? -result : EIO;
+        }
+        continue;
+      }
+      if (result >= 0 && static_cast<size_t>(result) < lengths[i] && error == 0) {
+        // Complete a short write directly, which reports the cause as errno.
+        const char *buffer = buffers + i * URING_BLOCK_SIZE;
+        for (size_t written = result; written < lengths[i]; written += result) {
+          while ((result = pwrite(dest_fd, buffer + written, lengths[i] - written,
+                                  offsets[i] + written)) < 0 &&
+                 errno == EINTR) {
+          }
+          if (result < 0) {
+            error = errno;
+            break;
+          }
+        }
+      } else if (result < 0 && result != -ECANCELED && error == 0) {
+        error = -result;
+      }
+      copied += lengths[i];
+      lengths[i] = 0;
+      --in_flight;
+      if (progress && error == 0) {
+        progress(copied);
+      }
+    }
+  }
+  if (error != 0 || !sync) {
+    return error;
+  }
+
+  /* Truncate the destination to the copied size and sync it. The fsync is linked to the truncate,
+     such that it is canceled if the truncate fails. */
+  if (ftruncate_supported) {
+#ifdef USE_URING_FTRUNCATE
+    sqe = io_uring_get_sqe(ring);
+    io_uring_prep_ftruncate(sqe, dest_fd, bytes_to_copy);
+    io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+    sqe->user_data = 0;
+#endif
+  } else if (ftruncate(dest_fd, bytes_to_copy) < 0) {
+    return errno;
+  }
+  sqe = io_uring_get_sqe(ring);
+  io_uring_prep_fsync(sqe, dest_fd, 0);
+  sqe->user_data = 1;
+  if ((error = uring_submit(ring, &pending)) != 0) {
+    uring_drain(ring, pending);
+    return error;
+  }
+  int truncate_error = 0, fsync_error = 0;
+  while (pending > 0) {
+    int result;
+    while ((result = io_uring_wait_cqe(ring, &cqe)) == -EINTR) {
+    }
+    if (result < 0) {
+      return -result;
+    }
+    if (cqe->res < 0 && cqe->user_data == 0) {
+      truncate_error = -cqe->res;
+    } else if (cqe->res < 0) {
+      fsync_error = -cqe->res;
+    }
+    io_uring_cqe_seen(ring, cqe);
+    --pending;
+  }
+  return truncate_error != 0 ? truncate_error : fsync_error;
+}
+
+int copy_file_by_io_uring(int src_fd, int dest_fd, size_t bytes_to_copy, bool sync,
+                          const std::function<void(size_t)> &progress) {
+  std::unique_ptr<char[]> buffers(new char[URING_BLOCKS * URING_BLOCK_SIZE]);
+  struct io_uring ring;
+  // Failure to set up the ring, for example on older kernels or when io_uring has been disabled,
+  // is reported as ENOTSUP, such that the caller uses another method.
+  if (io_uring_queue_init(2 * URING_BLOCKS + 2, &ring, 0) < 0) {
+    return ENOTSUP;
+  }
+  int result = uring_copy(&ring, buffers.get(), src_fd, dest_fd, bytes_to_copy, sync, progress);
+  io_uring_queue_exit(&ring);
+  return result;
+}
+#else
+int copy_file_by_io_uring(int, int, size_t, bool, const std::function<void(size_t)> &) {
+  return ENOTSUP;
+}
+#endif
+
 int copy_file_by_read_write(int src_fd, int dest_fd) {
   if (!rewind_files(src_fd, dest_fd)) {
     return errno;
@@ -118,12 +323,82 @@ int copy_file_by_read_write(int src_fd, int dest_fd) {
   }
 }
 
-int copy_file(int src_fd, int dest_fd) {
+namespace {
+
+// The copy methods in the order in which they are tried.
+enum copy_method_t { METHOD_FICLONE, METHOD_COPY_FILE_RANGE, METHOD_SENDFILE, METHOD_READ_WRITE };
+
+const char *const method_names[] = {"ficlone", "copy_file_range", "sendfile", "read_write"};
+
+// File system IDs and types of the source and destination.
+using fs_pair_key_t = std::array<uint64_t, 4>;
+
+/* For every pair of file systems, the first method that did not fail as unsupported. This saves
+   the failing system calls of the earlier methods on every copy. */
+std::mutex method_cache_mutex;
+std::map<fs_pair_key_t, copy_method_t> method_cache;
+
+#ifdef __linux__
+bool get_fs_pair_key(int src_fd, int dest_fd, fs_pair_key_t *key) {
+  struct statfs src_info, dest_info;
+  uint64_t src_fsid = 0, dest_fsid = 0;
+  if (fstatfs(src_fd, &src_info) < 0 || fstatfs(dest_fd, &dest_info) < 0) {
+    return false;
+  }
+  static_assert(sizeof(src_info.f_fsid) <= sizeof(src_fsid), "fsid_t too large");
+  memcpy(&src_fsid, &src_info.f_fsid, sizeof(src_info.f_fsid));
+  memcpy(&dest_fsid, &dest_info.f_fsid, sizeof(dest_info.f_fsid));
+  *key = {{src_fsid, static_cast<uint64_t>(src_info.f_type), dest_fsid,
+           static_cast<uint64_t>(dest_info.f_type)}};
+  return true;
+}
+#else
+// Without a portable way to identify file systems, nothing is cached.
+bool get_fs_pair_key(int, int, fs_pair_key_t *) { return false; }
+#endif
+
+copy_method_t first_method(const fs_pair_key_t *key) {
+  if (key == nullptr) {
+    return METHOD_FICLONE;
+  }
+  std::lock_guard<std::mutex> lock(method_cache_mutex);
+  auto iter = method_cache.find(*key);
+  return iter == method_cache.end() ? METHOD_FICLONE : iter->second;
+}
+
+void skip_method(const fs_pair_key_t *key, copy_method_t method) {
+  if (key != nullptr) {
+    std::lock_guard<std::mutex> lock(method_cache_mutex);
+    copy_method_t &first = method_cache[*key];
+    first = std::max(first, static_cast<copy_method_t>(method + 1));
+  }
+}
+
+// Errors meaning that a method does not work between the file systems at all.
+bool is_unsupported(int error) {
+  return error == ENOTSUP || error == EOPNOTSUPP || error == ENOSYS || error == EXDEV;
+}
+
+/* Errors after which the next method is tried. These may also be caused by the particular files,
+   such as a swap file, or a destination opened with O_APPEND (EBADF for copy_file_range, EINVAL
+   for sendfile), so they are not cached. */
+bool try_next_method(int error) {
+  return is_unsupported(error) || error == EINVAL || error == ENOTTY || error == EBADF;
+}
+
+/* Copy the file with the methods from the first one cached for key. Methods that fail as
+   unsupported are skipped on later copies. */
+int copy_file_from_cached(int src_fd, int dest_fd, const fs_pair_key_t *key) {
+  copy_method_t method = first_method(key);
   int result;
 
-  result = copy_file_by_ficlone(src_fd, dest_fd);
-  if (result == 0) {
-    return result;
+  if (method <= METHOD_FICLONE) {
+    result = copy_file_by_ficlone(src_fd, dest_fd);
+    if (result == 0) {
+      return result;
+    } else if (is_unsupported(result)) {
+      skip_method(key, METHOD_FICLONE);
+    }
   }
 
   struct stat statbuf;
@@ -131,13 +406,65 @@ int copy_file(int src_fd, int dest_fd) {
     return errno;
   }
   // FIXME: these routines may fail if the file changed in between and are now shorter!
-  result = copy_file_by_copy_file_range(src_fd, dest_fd, statbuf.st_size);
-  if (result != ENOTSUP && result != ENOSYS) {
-    return result;
+  if (method <= METHOD_COPY_FILE_RANGE) {
+    result = copy_file_by_copy_file_range(src_fd, dest_fd, statbuf.st_size);
+    if (!try_next_method(result)) {
+      return result;
+    } else if (is_unsupported(result)) {
+      skip_method(key, METHOD_COPY_FILE_RANGE);
+    }
   }
-  result = copy_file_by_sendfile(src_fd, dest_fd, statbuf.st_size);
-  if (result != ENOTSUP && result != ENOSYS) {
-    return result;
+  if (method <= METHOD_SENDFILE) {
+    result = copy_file_by_sendfile(src_fd, dest_fd, statbuf.st_size);
+    if (!try_next_method(result)) {
+      return result;
+    } else if (is_unsupported(result)) {
+      skip_method(key, METHOD_SENDFILE);
+    }
   }
   return copy_file_by_read_write(src_fd, dest_fd);
 }
+
+}  // namespace
+
+int copy_file(int src_fd, int dest_fd) {
+  fs_pair_key_t key;
+  return copy_file_from_cached(src_fd, dest_fd,
+                               get_fs_pair_key(src_fd, dest_fd, &key) ? &key : nullptr);
+}
+
+int copy_file_and_sync(int src_fd, int dest_fd) {
+  fs_pair_key_t key;
+  const fs_pair_key_t *key_ptr = get_fs_pair_key(src_fd, dest_fd, &key) ? &key : nullptr;
+  int result = ENOTSUP;
+
+  if (first_method(key_ptr) <= METHOD_FICLONE) {
+    result = copy_file_by_ficlone(src_fd, dest_fd);
+    if (is_unsupported(result)) {
+      skip_method(key_ptr, METHOD_FICLONE);
+    }
+  }
+  if (result != 0) {
+    struct stat statbuf;
+    if (fstat(src_fd, &statbuf) < 0) {
+      return errno;
+    }
+    result = copy_file_by_io_uring(src_fd, dest_fd, statbuf.st_size, true);
+    if (result != ENOTSUP && result != ENOSYS) {
+      return result;
+    }
+    result = copy_file_from_cached(src_fd, dest_fd, key_ptr);
+    if (result != 0) {
+      return result;
+    }
+  }
+  return fsync(dest_fd) < 0 ? errno : 0;
+}
+
+const char *copy_file_first_method(int src_fd, int dest_fd) {
+  fs_pair_key_t key;
+  if (!get_fs_pair_key(src_fd, dest_fd, &key)) {
+    return method_names[METHOD_FICLONE];
+  }
+  return method_names[first_method(&key)];
+}
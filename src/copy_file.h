@@ -2,6 +2,7 @@
 #define COPY_FILE_H_
 
 #include <cstddef>
+#include <functional>
 
 // Copy file by different methods. The files need not be at the starting position. The postion
 // after copy is undefined.
@@ -9,8 +10,19 @@ int copy_file_by_sendfile(int src_fd, int dest_fd, size_t bytes_to_copy);
 int copy_file_by_copy_file_range(int src_fd, int dest_fd, size_t bytes_to_copy);
 int copy_file_by_ficlone(int src_fd, int dest_fd);
 int copy_file_by_read_write(int src_fd, int dest_fd);
+// Copy file through io_uring, with several blocks in flight. If sync is set, the destination is
+// also truncated to bytes_to_copy and synced, through linked requests. Returns ENOTSUP if io_uring
+// is not available in the kernel.
+int copy_file_by_io_uring(int src_fd, int dest_fd, size_t bytes_to_copy, bool sync,
+                          const std::function<void(size_t)> &progress = nullptr);
 
-// Generic copy routine which will try to copy the file using one of the methods above.
+// Generic copy routine which will try to copy the file using one of the methods above. Methods that
+// are not supported for a pair of file systems are not tried again for later copies between them.
+// Methods failing for other reasons, such as EINVAL, are only skipped for this copy.
 int copy_file(int src_fd, int dest_fd);
+// Copy the file like copy_file, and wait for the copy to reach the disk.
+int copy_file_and_sync(int src_fd, int dest_fd);
+// Name of the first method copy_file will try for these files.
+const char *copy_file_first_method(int src_fd, int dest_fd);
 
 #endif
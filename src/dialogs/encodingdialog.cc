@@ -19,6 +19,7 @@
 
 #include "tilde/dialogs/encodingdialog.h"
 #include "tilde/log.h"
+#include "tilde/singlebyte.h"
 #include "tilde/util.h"
 
 struct charset_desc_t {
@@ -60,6 +61,7 @@ static charset_desc_t friendly_charsets[] = {
     {"Korean (EUC-KR)", "EUC-KR"},
     {"Korean (ISO-2022-KR)", "ISO-2022-KR"},
     {"Northern Saami (Winsami2)", "WINSAMI2"},
+    {"Raw bytes (as ISO-8859-1)", "X-RAW"},
     {"South-Eastern European (ISO-8859-16)", "ISO-8859-16"},
     {"Tamil (TSCII)", "TSCII"},
     {"Thai (Windows-874)", "WINDOWS-874"},
@@ -93,7 +95,8 @@ void init_charsets() {
   transcript_init();
   available_charsets.push_back(utf8);
   for (charset_desc_t *ptr = &friendly_charsets[0]; ptr->name != nullptr; ptr++) {
-    if (!transcript_probe_converter(ptr->tag)) {
+    if (single_byte_converter_t::get(ptr->tag) == nullptr &&
+        !transcript_probe_converter(ptr->tag)) {
       lprintf("Unavailable: %s\n", ptr->name);
       continue;
     }
@@ -167,7 +170,8 @@ void encoding_dialog_t::ok_activated() {
     encoding = manual_entry->get_text();
 
     lprintf("Testing encoding name: %s\n", encoding.c_str());
-    if (!transcript_probe_converter(encoding.c_str())) {
+    if (single_byte_converter_t::get(encoding.c_str()) == nullptr &&
+        !transcript_probe_converter(encoding.c_str())) {
       std::string message = "Requested character set is not available";
       message_dialog->set_message(message);
       message_dialog->center_over(this);
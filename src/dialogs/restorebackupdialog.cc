@@ -0,0 +1,57 @@
+#include <ctime>
+
+#include "tilde/dialogs/restorebackupdialog.h"
+
+restore_backup_dialog_t::restore_backup_dialog_t(int height, int width)
+    : dialog_t(height, width, _("Restore Backup")) {
+  list = emplace_back<list_pane_t>(true);
+  list->set_size(height - 3, width - 2);
+  list->set_position(1, 1);
+  list->connect_activate([this] { ok_activated(); });
+
+  button_t *ok_button = emplace_back<button_t>("_OK", true);
+  button_t *cancel_button = emplace_back<button_t>("_Cancel", false);
+
+  cancel_button->set_anchor(this,
+                            T3_PARENT(T3_ANCHOR_BOTTOMRIGHT) | T3_CHILD(T3_ANCHOR_BOTTOMRIGHT));
+  cancel_button->set_position(-1, -2);
+  cancel_button->connect_activate([this] { close(); });
+  ok_button->set_anchor(cancel_button, T3_PARENT(T3_ANCHOR_TOPLEFT) | T3_CHILD(T3_ANCHOR_TOPRIGHT));
+  ok_button->set_position(0, -2);
+  ok_button->connect_activate([this] { ok_activated(); });
+}
+
+bool restore_backup_dialog_t::set_size(optint height, optint width) {
+  bool result = dialog_t::set_size(height, width);
+  result &= list->set_size(height.value() - 3, width.value() - 2);
+  return result;
+}
+
+void restore_backup_dialog_t::set_versions(std::vector<backup_version_t> _versions) {
+  versions = std::move(_versions);
+  while (!list->empty()) {
+    list->pop_back();
+  }
+
+  for (const backup_version_t &version : versions) {
+    time_t seconds = version.time / 1000000000;
+    struct tm local_time;
+    char time_str[64];
+    localtime_r(&seconds, &local_time);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &local_time);
+
+    std::string description;
+    printf_into(&description, "%s  %jd bytes", time_str, static_cast<intmax_t>(version.size));
+    std::unique_ptr<label_t> label(new label_t(description.c_str()));
+    label->set_align(label_t::ALIGN_LEFT_UNDERFLOW);
+    list->push_back(std::move(label));
+  }
+  list->reset();
+}
+
+void restore_backup_dialog_t::ok_activated() {
+  hide();
+  if (list->size() > 0) {
+    version_selected(&versions[list->get_current()]);
+  }
+}
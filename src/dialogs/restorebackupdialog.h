@@ -0,0 +1,26 @@
+#ifndef RESTOREBACKUPDIALOG_H
+#define RESTOREBACKUPDIALOG_H
+
+#include <t3widget/widget.h>
+#include <vector>
+using namespace t3widget;
+
+#include "tilde/backupstore.h"
+#include "tilde/util.h"
+
+/** Lists the versions of a file in the backup store, to select one to restore. */
+class restore_backup_dialog_t : public dialog_t {
+ private:
+  list_pane_t *list;
+  std::vector<backup_version_t> versions;
+
+ public:
+  restore_backup_dialog_t(int height, int width);
+  bool set_size(optint height, optint width) override;
+  void set_versions(std::vector<backup_version_t> _versions);
+  virtual void ok_activated();
+
+  DEFINE_SIGNAL(version_selected, const backup_version_t *);
+};
+
+#endif
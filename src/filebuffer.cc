@@ -11,19 +11,44 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
 
+#include "tilde/backgroundloader.h"
+#include "tilde/backgroundsaver.h"
+#include "tilde/backupstore.h"
 #include "tilde/copy_file.h"
 #include "tilde/filebuffer.h"
 #include "tilde/fileline.h"
 #include "tilde/filestate.h"
+#include "tilde/highlightcache.h"
+#include "tilde/highlightcheckpoints.h"
+#include "tilde/incrementalsave.h"
 #include "tilde/log.h"
 #include "tilde/openfiles.h"
 #include "tilde/option.h"
+#include "tilde/singlebyte.h"
+#include "tilde/utf8scan.h"
+#include "tilde/workerpool.h"
 
 #define CREATE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
+/* Files smaller than this are always loaded completely before they are shown. */
+#define BACKGROUND_LOAD_MIN_SIZE (8 * 1024 * 1024)
+/* Time spent highlighting before a line is painted without highlighting instead. */
+#define HIGHLIGHT_PAINT_TIME std::chrono::milliseconds(20)
+/* Time spent highlighting per iteration of the main loop, once painting stopped waiting for it. */
+#define HIGHLIGHT_SLICE_TIME std::chrono::milliseconds(10)
+/* Number of lines beyond the last painted line that are highlighted in the background. */
+#define HIGHLIGHT_LOOKAHEAD 1000
+/* Number of lines of which the highlight spans are kept, which covers a few screens. */
+#define HIGHLIGHT_SPAN_CACHE_LINES 512
+/* Minimum number of lines between highlighting checkpoints. */
+#define HIGHLIGHT_CHECKPOINT_INTERVAL 1000
+/* Number of files for which highlighting checkpoints are kept. */
+#define HIGHLIGHT_CHECKPOINT_FILES 64
 
 file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
     : text_buffer_t(new file_line_factory_t(this)),
@@ -50,6 +75,7 @@ file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
   }
 
   connect_rewrap_required(bind_front(&file_buffer_t::invalidate_highlight, this));
+  connect_rewrap_required(bind_front(&file_buffer_t::track_modification, this));
 
   behavior_parameters->set_tabsize(option.tabsize);
   behavior_parameters->set_wrap(option.wrap ? wrap_type_t::WORD : wrap_type_t::NONE);
@@ -61,18 +87,18 @@ file_buffer_t::file_buffer_t(string_view _name, string_view _encoding)
 }
 
 file_buffer_t::~file_buffer_t() {
+  background_loader.reset();
+  save_highlight_checkpoints();
+  // Closing the file is refused while it is being saved, so this only waits for a finished thread.
+  background_saver.reset();
+  highlight_connection.disconnect();
   open_files.erase(this);
-  t3_highlight_free(highlight_info);
   t3_highlight_free_match(last_match);
+  release_highlight(highlight_info);
   delete get_line_factory();
 }
 
 rw_result_t file_buffer_t::load(load_process_t *state) {
-  t3_highlight_t *highlight = nullptr;
-  t3_highlight_lang_t lang;
-  t3_bool success = t3_false;
-  text_pos_t i;
-
   if (state->file != this) {
     PANIC();
   }
@@ -83,6 +109,7 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
       transcript_t *handle;
       transcript_error_t error;
 
+      state->start_time = std::chrono::steady_clock::now();
       std::string _name = canonicalize_path(name.c_str());
       if (_name.empty()) {
         if (errno == ENOENT && state->state == load_process_t::INITIAL_MISSING_OK) {
@@ -103,15 +130,35 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
       }
 
       try {
-        lprintf("Using encoding %s to read %s\n", encoding.c_str(), name.c_str());
-
-        handle = transcript_open_converter(encoding.c_str(), TRANSCRIPT_UTF8, 0, &error);
-        if (handle == nullptr) {
-          return rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR, error);
+        if (transcript_equal(encoding.c_str(), "utf8") &&
+            (state->map = file_map_t::map(state->fd)) != nullptr) {
+          lprintf("Using mmap to read %s\n", name.c_str());
         }
-        // FIXME: if the new fails, the handle will remain open!
-        state->wrapper = new file_read_wrapper_t(state->fd, handle);
 
+        if (state->map == nullptr) {
+          lprintf("Using encoding %s to read %s\n", encoding.c_str(), name.c_str());
+
+          const single_byte_converter_t *converter = single_byte_converter_t::get(encoding.c_str());
+          if (converter != nullptr) {
+            size_t parallel_parts = 1;
+            try {
+              parallel_parts += get_worker_pool()->size();
+            } catch (std::system_error &) {
+              // No threads available, convert on this thread only.
+            }
+            lprintf("Converting %s with built-in converter on %zd threads\n", name.c_str(),
+                    parallel_parts);
+            state->wrapper = new file_read_wrapper_t(state->fd, converter, option.read_block_size,
+                                                     parallel_parts);
+          } else {
+            handle = transcript_open_converter(encoding.c_str(), TRANSCRIPT_UTF8, 0, &error);
+            if (handle == nullptr) {
+              return rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR, error);
+            }
+            // FIXME: if the new fails, the handle will remain open!
+            state->wrapper = new file_read_wrapper_t(state->fd, handle, option.read_block_size);
+          }
+        }
       } catch (std::bad_alloc &ba) {
         return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
       }
@@ -119,6 +166,16 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
     }
     case load_process_t::READING:
     case load_process_t::READING_FIRST:
+      if (state->map != nullptr) {
+        rw_result_t result = read_mapped(state);
+        if (result != rw_result_t::SUCCESS) {
+          return result;
+        }
+        // If invalid UTF-8 was found, the remainder is read through a converter.
+        if (state->wrapper == nullptr) {
+          break;
+        }
+      }
       try {
         while (!state->buffer_used || state->wrapper->fill_buffer(state->wrapper->get_fill())) {
           state->buffer_used = false;
@@ -149,9 +206,19 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
             state->state = load_process_t::READING;
           }
 
+          string_view block(state->wrapper->get_buffer(), state->wrapper->get_fill());
+          bool background = use_background_load(state->fd);
+          // A background loader continues with the partial line at the end of the block.
+          size_t lines_end = background ? block.rfind('\n') + 1 : block.size();
           try {
-            append_text(string_view(state->wrapper->get_buffer(), state->wrapper->get_fill()));
+            append_text(block.substr(0, lines_end));
             state->buffer_used = true;
+            if (background && start_background_load(state, lines_end)) {
+              break;
+            }
+            if (lines_end < block.size()) {
+              append_text(block.substr(lines_end));
+            }
           } catch (...) {
             return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
           }
@@ -166,6 +233,33 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
       PANIC();
   }
 
+#ifdef DEBUG
+  if (state->map != nullptr || state->wrapper != nullptr) {
+    double seconds =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - state->start_time).count();
+    off_t bytes = state->map != nullptr ? state->map->size() : state->wrapper->get_bytes_read();
+    lprintf("Read %jd bytes from %s in %.3f s (%.1f MB/s)\n", static_cast<intmax_t>(bytes),
+            name.c_str(), seconds, seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0);
+  }
+#endif
+
+  if (state->map != nullptr && !is_modified()) {
+    mark_unmodified_on_disk(state->fd);
+  }
+  detect_highlight();
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+void file_buffer_t::detect_highlight() {
+  t3_highlight_t *highlight = nullptr;
+  t3_highlight_lang_t lang;
+  t3_bool success = t3_false;
+  text_pos_t i;
+
+  if (restore_highlight()) {
+    return;
+  }
+
   /* Automatically load appropriate highlighting patterns if available.
      Try the following in order:
      - a vi(m) modeline/Emacs major mode spec in the first five lines
@@ -182,7 +276,7 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
     success =
         t3_highlight_detect(line.data(), line.size(), false, T3_HIGHLIGHT_UTF8, &lang, nullptr);
   }
-  for (i = size() - 1; i >= 5 && !success; i--) {
+  for (i = size() - 1; i >= std::max<text_pos_t>(5, size() - 5) && !success; i--) {
     const std::string &line = get_line_data(i).get_data();
     success =
         t3_highlight_detect(line.data(), line.size(), false, T3_HIGHLIGHT_UTF8, &lang, nullptr);
@@ -196,25 +290,260 @@ rw_result_t file_buffer_t::load(load_process_t *state) {
     success = t3_highlight_lang_by_filename(name.c_str(), T3_HIGHLIGHT_UTF8, &lang, nullptr);
   }
   if (success) {
-    highlight = t3_highlight_load(lang.lang_file, map_highlight, nullptr,
-                                  T3_HIGHLIGHT_UTF8 | T3_HIGHLIGHT_USE_PATH
-/* If T3_HIGHLIGHT_USE_SCOPE is not available, all the other code is still compatible, so we simply
-   omit the flag here. */
-#ifdef T3_HIGHLIGHT_USE_SCOPE
-                                      | T3_HIGHLIGHT_USE_SCOPE
-#endif
-                                  ,
-                                  nullptr);
-    set_highlight(highlight);
-    std::map<std::string, std::string>::iterator iter = option.line_comment_map.find(lang.name);
-    if (iter != option.line_comment_map.end()) {
-      set_line_comment(iter->second.c_str());
-    }
+    highlight = load_highlight(lang.lang_file);
+    set_highlight(highlight, lang.name);
     t3_highlight_free_lang(lang);
   }
+}
+
+bool file_buffer_t::restore_highlight() {
+  struct stat file_info;
+
+  auto iter = recent_files.find(name);
+  if (iter == recent_files.end() || (*iter)->get_highlight_lang_file().empty() ||
+      stat(name.c_str(), &file_info) < 0 || file_info.st_size != (*iter)->get_file_size() ||
+      file_info.st_mtime != (*iter)->get_file_mtime()) {
+    return false;
+  }
+
+  t3_highlight_t *highlight = load_highlight((*iter)->get_highlight_lang_file().c_str());
+  if (highlight == nullptr) {
+    return false;
+  }
+  lprintf("Using highlighting %s from recent files for %s\n",
+          (*iter)->get_highlight_name().c_str(), name.c_str());
+  set_highlight(highlight, (*iter)->get_highlight_name().c_str());
+  return true;
+}
+
+bool file_buffer_t::use_background_load(int fd) const {
+  struct stat file_info;
+
+  return option.background_load && fstat(fd, &file_info) == 0 &&
+         file_info.st_size >= BACKGROUND_LOAD_MIN_SIZE;
+}
+
+bool file_buffer_t::start_background_load(load_process_t *state, size_t wrapper_used) {
+  if (get_line_size(size() - 1) != 0 || !use_background_load(state->fd)) {
+    return false;
+  }
+  load_line = size() - 1;
+  tracked_size = size();
+  try {
+    background_loader = t3widget::make_unique<background_loader_t>(
+        this, state->fd, state->wrapper, wrapper_used, state->map, state->map_offset,
+        state->start_time);
+  } catch (std::exception &) {
+    load_line = -1;
+    return false;
+  }
+  lprintf("Loading remainder of %s in the background\n", name.c_str());
+  state->fd = -1;
+  state->wrapper = nullptr;
+  state->map = nullptr;
+  return true;
+}
+
+bool file_buffer_t::is_loading() const {
+  return background_loader != nullptr && !background_loader->is_done();
+}
+
+bool file_buffer_t::is_load_incomplete() const {
+  return background_loader != nullptr && background_loader->is_incomplete();
+}
+
+void file_buffer_t::cancel_load() {
+  if (background_loader != nullptr) {
+    background_loader->cancel();
+  }
+}
+
+rw_result_t file_buffer_t::read_mapped(load_process_t *state) {
+  size_t size = state->map->size();
+
+  if (state->state == load_process_t::READING_FIRST) {
+    char bom[3];
+    if (size >= 3 && state->map->read(0, 3, bom) && memcmp(bom, "\xef\xbb\xbf", 3) == 0) {
+      switch (state->bom_state) {
+        case load_process_t::UNKNOWN:
+          return rw_result_t(rw_result_t::BOM_FOUND);
+        case load_process_t::PRESERVE_BOM:
+          encoding = "X-UTF-8-BOM";
+        /* FALLTHROUGH */
+        case load_process_t::REMOVE_BOM:
+          state->map_offset = 3;
+          break;
+        default:
+          break;
+      }
+    }
+    state->state = load_process_t::READING;
+  }
+
+  try {
+    while (state->map_offset < size) {
+      bool valid;
+      state->map_offset += process_map_block(*state->map, state->map_offset, &valid,
+                                             [this](string_view block) { append_text(block); });
+      if (!valid) {
+        /* Read the remainder through the converter, such that the user is asked how to handle the
+           illegal sequences. */
+        lprintf("Invalid UTF-8 in %s at offset %zd\n", name.c_str(), state->map_offset);
+        state->wrapper = file_read_wrapper_t::open_validating(state->fd, state->map_offset,
+                                                              option.read_block_size);
+        state->buffer_used = false;
+        delete state->map;
+        state->map = nullptr;
+        return rw_result_t(rw_result_t::SUCCESS);
+      }
+      if (start_background_load(state)) {
+        break;
+      }
+    }
+  } catch (rw_result_t &result) {
+    return result;
+  } catch (...) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+  set_cursor({0, 0});
   return rw_result_t(rw_result_t::SUCCESS);
 }
 
+bool file_buffer_t::goto_pos_when_loaded(text_pos_t line, text_pos_t pos,
+                                         optional<text_coordinate_t> top_left) {
+  // Lines are numbered from 1, so line size() may still be incomplete while loading.
+  if (is_loading() && line >= size()) {
+    background_loader->set_pending_position(line, pos, top_left);
+    return false;
+  }
+  goto_pos(line, pos);
+  if (top_left.is_valid()) {
+    set_top_left_in_behavior_parameters(top_left.value());
+  }
+  return true;
+}
+
+size_t file_buffer_t::process_map_block(const file_map_t &map, size_t offset, bool *valid,
+                                        const std::function<void(string_view)> &process) {
+  // A few bytes more than the block are scanned, such that a character crossing its end is
+  // recognized.
+  size_t size = std::min<size_t>(map.size() - offset, MAP_CHUNK_SIZE + 4);
+  if (!map.access(offset, size, [&](const char *data, size_t data_size) {
+        size = utf8_block_size(data, data_size, MAP_CHUNK_SIZE, valid);
+        process(string_view(data, size));
+      })) {
+    // The interrupted insertion may not have reset this.
+    inserting_loaded_text = false;
+    lprintf("%s was truncated while loading, at offset %zu\n", name.c_str(), offset);
+    throw rw_result_t(rw_result_t::CONVERSION_TRUNCATED);
+  }
+  return size;
+}
+
+void file_buffer_t::insert_loaded_text(string_view text) {
+  text_pos_t old_size = size();
+
+  inserting_loaded_text = true;
+  if (load_line == size() - 1 && get_line_size(load_line) == 0) {
+    append_text(text);
+  } else {
+    /* The user has added text after the part of the file loaded so far. The loaded text is
+       inserted before it, as an undoable change such that the undo information of the user's
+       changes remains valid. */
+    text_coordinate_t saved_cursor = get_cursor();
+    set_cursor({load_line, 0});
+    if (!text.empty() && text.back() == '\n') {
+      insert_block(text);
+    } else {
+      // Keep the end of a file without trailing newline separate from the user's text.
+      insert_block(std::string(text.data(), text.size()) + '\n');
+    }
+    if (saved_cursor.line >= load_line) {
+      saved_cursor.line += size() - old_size;
+    }
+    set_cursor(saved_cursor);
+  }
+  inserting_loaded_text = false;
+  load_line += size() - old_size;
+  tracked_size = size();
+}
+
+/** Get the directory part of @p file_name, including the trailing slash. */
+static std::string directory_of(const std::string &file_name) {
+  size_t idx = file_name.rfind('/');
+  return idx == std::string::npos ? std::string("./") : file_name.substr(0, idx + 1);
+}
+
+/** Create a unique name in @p dir_name by creating a file with mkstemp.
+    @return The name of the created file, or an empty string on failure. */
+static std::string make_temp_file(const std::string &dir_name, int *fd) {
+  std::string temp_name_str = dir_name + "tilde-save-XXXXXX";
+  std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
+  temp_name.push_back(0);
+  if ((*fd = mkstemp(temp_name.data())) < 0) {
+    return std::string();
+  }
+  return temp_name.data();
+}
+
+/** Create an anonymous file next to @p file_name, to hold the converted text while saving.
+    @param name If not @c nullptr and the file can only be created with a name, the file is not
+        unlinked and its name is stored in @p name.
+    @return The file descriptor, or -1 if no such file can be created. */
+static int open_spill_file(const std::string &file_name, std::string *name) {
+  std::string dir_name = directory_of(file_name);
+
+  int fd;
+#ifdef O_TMPFILE
+  if ((fd = open(dir_name.c_str(), O_TMPFILE | O_RDWR, 0600)) >= 0) {
+    return fd;
+  }
+#endif
+  std::string temp_name = make_temp_file(dir_name, &fd);
+  if (fd >= 0) {
+    if (name != nullptr) {
+      *name = temp_name;
+    } else {
+      unlink(temp_name.c_str());
+    }
+  }
+  return fd;
+}
+
+bool file_buffer_t::prepare_replace(save_as_process_t *state) {
+  struct stat file_info;
+  if (state->spill_fd < 0 || state->original_mode.is_valid() || fstat(state->fd, &file_info) < 0 ||
+      !S_ISREG(file_info.st_mode) || file_info.st_nlink != 1) {
+    return false;
+  }
+  if (fchmod(state->spill_fd, file_info.st_mode & 07777) < 0) {
+    return false;
+  }
+  if ((file_info.st_uid != geteuid() || file_info.st_gid != getegid()) &&
+      fchown(state->spill_fd, file_info.st_uid, file_info.st_gid) < 0) {
+    return false;
+  }
+
+  if (state->spill_name.empty()) {
+    // The spill file was created with O_TMPFILE. Link it under a fresh name through /proc, as
+    // linkat with AT_EMPTY_PATH requires extra privileges.
+    int fd;
+    std::string link_name = make_temp_file(directory_of(state->real_name), &fd);
+    if (link_name.empty()) {
+      return false;
+    }
+    close(fd);
+    unlink(link_name.c_str());
+    std::string proc_name = "/proc/self/fd/" + std::to_string(state->spill_fd);
+    if (linkat(AT_FDCWD, proc_name.c_str(), AT_FDCWD, link_name.c_str(), AT_SYMLINK_FOLLOW) < 0) {
+      return false;
+    }
+    state->spill_name = link_name;
+  }
+  state->replace_file = true;
+  return true;
+}
+
 /* FIXME: try to prevent as many race conditions as possible here. */
 rw_result_t file_buffer_t::save(save_as_process_t *state) {
   size_t idx;
@@ -225,49 +554,33 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
 
   switch (state->state) {
     case save_as_process_t::INITIAL: {
+      if (is_loading()) {
+        return rw_result_t(rw_result_t::LOAD_IN_PROGRESS);
+      }
+      if (is_saving()) {
+        return rw_result_t(rw_result_t::SAVE_IN_PROGRESS);
+      }
       if (strip_spaces.is_valid() ? strip_spaces.value() : option.strip_spaces) {
         do_strip_spaces();
       }
 
       transcript_error_t error;
       if (!state->encoding.empty()) {
-        if ((state->conversion_handle = transcript_open_converter(
+        if ((state->converter = single_byte_converter_t::get(state->encoding.c_str())) == nullptr &&
+            (state->conversion_handle = transcript_open_converter(
                  state->encoding.c_str(), TRANSCRIPT_UTF8, 0, &error)) == nullptr) {
           return rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR);
         }
         encoding = state->encoding;
       } else if (encoding != "UTF-8") {
-        if ((state->conversion_handle = transcript_open_converter(encoding.c_str(), TRANSCRIPT_UTF8,
+        if ((state->converter = single_byte_converter_t::get(encoding.c_str())) == nullptr &&
+            (state->conversion_handle = transcript_open_converter(encoding.c_str(), TRANSCRIPT_UTF8,
                                                                   0, &error)) == nullptr) {
           return rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR);
         }
       } else {
         state->conversion_handle = nullptr;
       }
-      state->wrapper = t3widget::make_unique<file_write_wrapper_t>(-1, state->conversion_handle);
-      state->i = 0;
-      state->state = save_as_process_t::OPEN_FILE;
-    }
-      // FALLTHROUGH
-    case save_as_process_t::OPEN_FILE: {
-      if (state->conversion_handle) {
-        transcript_from_unicode_reset(state->conversion_handle);
-      }
-      try {
-        for (; state->i < size(); state->i++) {
-          if (state->i != 0) {
-            state->wrapper->write("\n", 1);
-          }
-          const std::string &data = get_line_data(state->i).get_data();
-          /* At this point the wrapper is initialized with -1 as fd, thus it is not writing
-             anything. However, it will catch conversion errors, and this will result in asking
-             the user what to do. */
-          state->wrapper->write(data.data(), data.size());
-        }
-      } catch (rw_result_t error) {
-        return error;
-      }
-      state->computed_length = state->wrapper->written_size();
 
       if (state->name.empty()) {
         if (name.empty()) {
@@ -287,6 +600,58 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
         state->real_name = state->save_name;
       }
 
+      // The tail written by an incremental save is converted again while writing, as it is
+      // usually short.
+      if (!prepare_incremental_save(state)) {
+        state->spill_fd =
+            open_spill_file(state->real_name, option.atomic_save ? &state->spill_name : nullptr);
+      }
+      state->wrapper = t3widget::make_unique<file_write_wrapper_t>(
+          state->spill_fd, state->conversion_handle, state->converter);
+      state->i = state->start_line;
+      state->state = save_as_process_t::OPEN_FILE;
+    }
+      // FALLTHROUGH
+    case save_as_process_t::OPEN_FILE: {
+      try {
+        for (; state->i < size(); state->i++) {
+          if (state->i != 0) {
+            state->wrapper->write("\n", 1);
+          }
+          const std::string &data = get_line_data(state->i).get_data();
+          /* The converted text goes to the spill file, from which it is copied once the target
+             file is opened. Without a spill file, the wrapper is initialized with -1 as fd and
+             does not write anything. In both cases it catches conversion errors, which results in
+             asking the user what to do before the target file is touched. */
+          state->wrapper->write(data.data(), data.size());
+        }
+        state->wrapper->flush();
+        state->modification_count = modification_count;
+      } catch (rw_result_t error) {
+        if (error == rw_result_t::ERRNO_ERROR && state->spill_fd >= 0) {
+          // Writing the spill file failed, e.g. for lack of space. Restart the conversion without
+          // it, and convert again while writing the target file.
+          close(state->spill_fd);
+          state->spill_fd = -1;
+          if (!state->spill_name.empty()) {
+            unlink(state->spill_name.c_str());
+            state->spill_name.clear();
+          }
+          int conversion_flags = state->wrapper->conversion_flags();
+          state->wrapper = t3widget::make_unique<file_write_wrapper_t>(
+              -1, state->conversion_handle, state->converter);
+          state->wrapper->add_conversion_flags(conversion_flags);
+          state->i = 0;
+          return save(state);
+        }
+        return error;
+      }
+      state->computed_length = state->wrapper->written_size();
+
+      if (is_load_incomplete() && state->real_name == name) {
+        return rw_result_t(rw_result_t::LOAD_INCOMPLETE);
+      }
+
       /* This attempts to avoid race conditions, by trying to open with O_CREAT|O_EXCL. This is
          known to have issues on NFSv3, but it's the best we can do. */
       if ((state->fd = open(state->real_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666)) < 0) {
@@ -340,72 +705,110 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
       // If the creation of the backup file fails, the user either aborts or allows continuation
       // without completing the backup. Thus the next state is always WRITING.
       state->state = save_as_process_t::WRITING;
-      std::string temp_name_str = state->real_name;
-
-      if (option.make_backup) {
-        temp_name_str += "~";
-        if ((state->backup_fd = open(temp_name_str.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600)) <
-            0) {
-          return rw_result_t(rw_result_t::BACKUP_FAILED, errno);
+      // When the file is replaced, the original file is not modified, so it only needs to be
+      // copied if a backup was requested. The same is done for incremental saves, as these only
+      // change the end of the file.
+      if (state->incremental) {
+        struct stat file_info;
+        if (fstat(state->fd, &file_info) < 0 || file_info.st_dev != disk_info.st_dev ||
+            file_info.st_ino != disk_info.st_ino) {
+          state->incremental = false;
         }
-      } else {
-        if ((idx = temp_name_str.rfind('/')) == std::string::npos) {
-          idx = 0;
-        } else {
-          idx++;
+      }
+      std::string backup_dir;
+      if (option.make_backup && option.backup_versions > 0) {
+        backup_dir = backup_store_t::default_dir();
+        if (backup_dir.empty()) {
+          lprintf("No directory for the backup store, making a backup file instead\n");
+        }
+      }
+      if (!backup_dir.empty()) {
+        // The version in the backup store also protects the contents if writing fails.
+        if (!state->incremental && option.atomic_save) {
+          prepare_replace(state);
+        }
+        state->backup_dir = backup_dir;
+        // With a spill file, the backup is stored right before the spill file is written, which
+        // may happen in the background.
+        if (state->spill_fd < 0) {
+          rw_result_t result = store_backup(state);
+          if (result != rw_result_t::SUCCESS) {
+            return result;
+          }
         }
+      } else if (!(state->incremental || (option.atomic_save && prepare_replace(state))) ||
+                 option.make_backup) {
+        std::string temp_name_str = state->real_name;
+
+        if (option.make_backup) {
+          temp_name_str += "~";
+          if ((state->backup_fd =
+                   open(temp_name_str.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600)) < 0) {
+            return rw_result_t(rw_result_t::BACKUP_FAILED, errno);
+          }
+        } else {
+          if ((idx = temp_name_str.rfind('/')) == std::string::npos) {
+            idx = 0;
+          } else {
+            idx++;
+          }
 
-        temp_name_str.erase(idx);
-        temp_name_str.append("tilde-backup-XXXXXX");
+          temp_name_str.erase(idx);
+          temp_name_str.append("tilde-backup-XXXXXX");
 
-        /* Unfortunately, we can't pass the c_str result to mkstemp as we are not allowed to change
-           that string. So we'll just have to copy it into a vector :-( */
-        std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
-        // Ensure nul termination.
-        temp_name.push_back(0);
-        if ((state->backup_fd = mkstemp(temp_name.data())) >= 0) {
-          state->temp_name = temp_name.data();
-        } else {
+          /* Unfortunately, we can't pass the c_str result to mkstemp as we are not allowed to
+             change that string. So we'll just have to copy it into a vector :-( */
+          std::vector<char> temp_name(temp_name_str.begin(), temp_name_str.end());
+          // Ensure nul termination.
+          temp_name.push_back(0);
+          if ((state->backup_fd = mkstemp(temp_name.data())) >= 0) {
+            state->temp_name = temp_name.data();
+          } else {
+            return rw_result_t(errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED
+                                               : rw_result_t::BACKUP_FAILED,
+                               errno);
+          }
+        }
+        int error = copy_file_and_sync(state->fd, state->backup_fd);
+        if (error != 0) {
+          return rw_result_t(error == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED
+                                             : rw_result_t::BACKUP_FAILED,
+                             error);
+        }
+        if (close(state->backup_fd) < 0) {
           return rw_result_t(errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED
                                              : rw_result_t::BACKUP_FAILED,
                              errno);
         }
+        state->backup_saved = true;
+        state->backup_fd = -1;
       }
-      int error = copy_file(state->fd, state->backup_fd);
-      if (error != 0) {
-        return rw_result_t(
-            errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
-            error);
-      }
-      if (fsync(state->backup_fd) < 0 || close(state->backup_fd) < 0) {
-        return rw_result_t(
-            errno == ENOSPC ? rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED : rw_result_t::BACKUP_FAILED,
-            errno);
-      }
-      state->backup_saved = true;
-      state->backup_fd = -1;
     }
       // FALLTHROUGH
     case save_as_process_t::WRITING: {
+      if (state->spill_fd >= 0) {
+        return write_spill(state);
+      }
 #ifdef HAS_POSIX_FALLOCATE
       // Use posix_fallocate to attempt to pre-allocate the required size of the file. If the call
       // fails with ENOSPC or EFBIG, stop writing and report an error to the user. All other error
       // codes are ignored.
-      if (posix_fallocate(state->fd, 0, state->computed_length) < 0 &&
+      if (posix_fallocate(state->fd, state->write_offset, state->computed_length) < 0 &&
           (errno == ENOSPC || errno == EFBIG)) {
-        // We want the backup to be removed (if it exists), and we didn't change anything, so we
-        // close the file here and set the fd to -1.
-        close(state->fd);
-        state->fd = -1;
-        return rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED);
+        return finish_save(state, rw_result_t(rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED));
       }
 #endif
       int conversion_flags = state->wrapper->conversion_flags();
-      state->wrapper =
-          t3widget::make_unique<file_write_wrapper_t>(state->fd, state->conversion_handle);
+      state->wrapper = t3widget::make_unique<file_write_wrapper_t>(
+          state->fd, state->conversion_handle, state->converter);
       state->wrapper->add_conversion_flags(conversion_flags);
-      state->i = 0;
-      if (lseek(state->fd, 0, SEEK_SET) < 0) {
+      if (!state->incremental) {
+        state->start_line = 0;
+        state->write_offset = 0;
+      }
+      state->i = state->start_line;
+      state->modification_count = modification_count;
+      if (lseek(state->fd, state->write_offset, SEEK_SET) < 0) {
         return rw_result_t(rw_result_t::ERRNO_ERROR);
       }
       try {
@@ -416,10 +819,11 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
           const std::string &data = get_line_data(state->i).get_data();
           state->wrapper->write(data.data(), data.size());
         }
+        state->wrapper->flush();
       } catch (rw_result_t error) {
-        // Don't attempt to retry imprecise conversions, as they should have been caught earlier.
-        // Also, restarting the conversion may append the current line to an already partially
-        // written line.
+        // Don't attempt to retry imprecise conversions, as they should have been caught
+        // earlier. Also, restarting the conversion may append the current line to an already
+        // partially written line.
         if (error == rw_result_t::CONVERSION_IMPRECISE) {
           return rw_result_t(rw_result_t::CONVERSION_ERROR);
         }
@@ -427,9 +831,9 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
       }
 
       // Truncate it to the written size.
+      off_t written_size = state->write_offset + state->wrapper->written_size();
       int result;
-      while ((result = ftruncate(state->fd, state->wrapper->written_size())) < 0 &&
-             errno == EINTR) {
+      while ((result = ftruncate(state->fd, written_size)) < 0 && errno == EINTR) {
       }
       if (result < 0) {
         return rw_result_t(rw_result_t::ERRNO_ERROR);
@@ -437,37 +841,124 @@ rw_result_t file_buffer_t::save(save_as_process_t *state) {
       if (fsync(state->fd) < 0) {
         return rw_result_t(rw_result_t::ERRNO_ERROR);
       }
-      /* Perform fchmod instead of chmod on the file name, to ensure that we actually change the
-         mode on the file we are interested in. However, we only want to report a problem after
-         cleaning up the rest, as it is more of an advisory nature. */
-      int fchmod_errno = 0;
-      if (state->original_mode.is_valid() && fchmod(state->fd, state->original_mode.value()) < 0) {
-        fchmod_errno = errno;
-      }
-      state->original_mode.reset();
-
-      if (close(state->fd) < 0) {
-        return rw_result_t(rw_result_t::ERRNO_ERROR);
-      }
-      state->fd = -1;
-
-      if (!state->name.empty()) {
-        name = state->name;
-        std::string converted_name = convert_lang_codeset(name, true);
-        name_line.set_text(converted_name);
-      }
-      set_undo_mark();
-      if (fchmod_errno != 0) {
-        return rw_result_t(rw_result_t::MODE_RESET_FAILED, fchmod_errno);
-      }
-      break;
+      return finish_save(state, rw_result_t(rw_result_t::SUCCESS));
     }
+    case save_as_process_t::BACKGROUND_WRITING:
+      if (!state->backup_dir.empty()) {
+        state->backup_dir.clear();
+        if (background_saver->is_backup_stored()) {
+          state->backup_saved = true;
+          state->backup_in_store = true;
+        } else if (background_saver->get_result() == rw_result_t::BACKUP_FAILED) {
+          // If the user chooses to continue, the file is written without backup.
+          state->state = save_as_process_t::WRITING;
+          return background_saver->get_result();
+        }
+      }
+      return finish_save(state, background_saver->get_result());
     default:
       return rw_result_t(rw_result_t::INTERNAL_ERROR);
   }
   return rw_result_t(rw_result_t::SUCCESS);
 }
 
+rw_result_t file_buffer_t::write_spill(save_as_process_t *state) {
+  spill_target_t target{state->spill_fd,   state->fd,         state->computed_length,
+                        state->replace_file, state->spill_name, state->real_name};
+  if (option.background_save || state->background) {
+    try {
+      background_saver = t3widget::make_unique<background_saver_t>(
+          target, state->backup_dir, option.backup_versions, [state] { state->run(); });
+      lprintf("Writing %s in the background\n", state->real_name.c_str());
+      state->state = save_as_process_t::BACKGROUND_WRITING;
+      return rw_result_t(rw_result_t::SAVE_IN_BACKGROUND);
+    } catch (std::exception &) {
+      // Write the file directly if no thread can be started.
+    }
+  }
+  if (!state->backup_dir.empty()) {
+    rw_result_t result = store_backup(state);
+    if (result != rw_result_t::SUCCESS) {
+      return result;
+    }
+  }
+  return finish_save(state, write_spill_file(target, nullptr));
+}
+
+rw_result_t file_buffer_t::store_backup(save_as_process_t *state) {
+  // The backup is only attempted once. If it fails and the user chooses to continue, the file is
+  // written without it.
+  std::string backup_dir = std::move(state->backup_dir);
+  state->backup_dir.clear();
+  int error = backup_store_t(backup_dir).store(state->real_name, state->fd, option.backup_versions);
+  if (error != 0) {
+    return rw_result_t(rw_result_t::BACKUP_FAILED, error);
+  }
+  state->backup_saved = true;
+  state->backup_in_store = true;
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+rw_result_t file_buffer_t::finish_save(save_as_process_t *state, rw_result_t result) {
+  if (result == rw_result_t::ERRNO_ERROR_FILE_UNTOUCHED) {
+    // We want the backup to be removed (if it exists), and we didn't change anything, so we close
+    // the file here and set the fd to -1.
+    close(state->fd);
+    state->fd = -1;
+  }
+  if (result != rw_result_t::SUCCESS) {
+    return result;
+  }
+
+  // Changes made after the text was converted, i.e. during a background save, are not saved.
+  bool saved_all = state->modification_count == modification_count;
+  if (state->replace_file) {
+    state->spill_name.clear();
+  }
+  if (saved_all) {
+    mark_unmodified_on_disk(state->replace_file ? state->spill_fd : state->fd);
+  } else {
+    unmodified_lines = 0;
+  }
+
+  /* Perform fchmod instead of chmod on the file name, to ensure that we actually change the mode
+     on the file we are interested in. However, we only want to report a problem after cleaning up
+     the rest, as it is more of an advisory nature. */
+  int fchmod_errno = 0;
+  if (state->original_mode.is_valid() && fchmod(state->fd, state->original_mode.value()) < 0) {
+    fchmod_errno = errno;
+  }
+  state->original_mode.reset();
+
+  // When the file is replaced, state->fd refers to the old file, which was not modified.
+  int close_result = close(state->fd);
+  state->fd = -1;
+  if (close_result < 0 && !state->replace_file) {
+    return rw_result_t(rw_result_t::ERRNO_ERROR);
+  }
+
+  if (!state->name.empty()) {
+    name = state->name;
+    std::string converted_name = convert_lang_codeset(name, true);
+    name_line.set_text(converted_name);
+  }
+  if (saved_all) {
+    set_undo_mark();
+  }
+  if (fchmod_errno != 0) {
+    return rw_result_t(rw_result_t::MODE_RESET_FAILED, fchmod_errno);
+  }
+  return rw_result_t(rw_result_t::SUCCESS);
+}
+
+bool file_buffer_t::is_saving() const {
+  return background_saver != nullptr && !background_saver->is_done();
+}
+
+int file_buffer_t::get_save_progress() const {
+  return background_saver == nullptr ? 0 : background_saver->get_progress();
+}
+
 const std::string &file_buffer_t::get_name() const { return name; }
 
 const char *file_buffer_t::get_encoding() const { return encoding.c_str(); }
@@ -479,53 +970,333 @@ const edit_window_t::behavior_parameters_t *file_buffer_t::get_behavior_paramete
 }
 
 void file_buffer_t::prepare_paint_line(text_pos_t line) {
-  text_pos_t i;
+  paint_without_highlight = false;
+  if (highlight_info == nullptr || is_highlight_valid(line)) {
+    return;
+  }
 
-  if (highlight_info == nullptr || highlight_valid >= line) {
+  /* Painting only waits a short time for the highlighting, such that jumping far into a large file
+     does not block. Once that time has passed, the highlighting continues from the main loop, and
+     the lines it has not reached yet are painted without highlighting. A checkpoint close to the
+     line is always tried, as it only requires highlighting a limited number of lines. */
+  if ((highlight_target < 0 || find_highlight_checkpoint(line) > highlight_valid) &&
+      update_highlight(line, std::chrono::steady_clock::now() + HIGHLIGHT_PAINT_TIME)) {
     return;
   }
+  paint_without_highlight = true;
+  if (highlight_target < 0) {
+    highlight_connection = connect_update_notification([this] { continue_highlight(); });
+    signal_update();
+  }
+  highlight_target =
+      std::max(highlight_target, std::min<text_pos_t>(line + HIGHLIGHT_LOOKAHEAD, size() - 1));
+}
+
+int file_buffer_t::allocate_highlight_spans(const file_line_t *line) {
+  size_t index;
+  if (highlight_span_cache.size() < HIGHLIGHT_SPAN_CACHE_LINES) {
+    index = highlight_span_cache.size();
+    highlight_span_cache.emplace_back();
+  } else {
+    index = std::min_element(highlight_span_cache.begin(), highlight_span_cache.end(),
+                             [](const highlight_span_entry_t &a, const highlight_span_entry_t &b) {
+                               return a.last_use < b.last_use;
+                             }) -
+            highlight_span_cache.begin();
+  }
+  highlight_span_entry_t &entry = highlight_span_cache[index];
+  entry.line = line;
+  entry.last_use = ++highlight_span_clock;
+  entry.spans.clear();
+  return static_cast<int>(index);
+}
+
+bool file_buffer_t::update_highlight(text_pos_t line,
+                                     std::chrono::steady_clock::time_point deadline) {
+  if (highlight_info == nullptr || is_highlight_valid(line)) {
+    return true;
+  }
 
-  for (i = highlight_valid >= 0 ? highlight_valid + 1 : 1; i <= line; i++) {
-    int state = static_cast<file_line_t *>(get_mutable_line_data(i - 1))->get_highlight_end();
-    static_cast<file_line_t *>(get_mutable_line_data(i))->set_highlight_start(state);
+  /* Instead of computing all lines before the requested line, start from the last checkpoint if
+     that lies beyond the lines already computed. Once highlight_valid reaches the checkpoint, the
+     start state computed for it is normally the same, such that the lines highlighted from the
+     checkpoint are not computed again. */
+  text_pos_t checkpoint_line = find_highlight_checkpoint(line);
+  if (checkpoint_line > highlight_valid) {
+    if (checkpoint_line != checkpoint_range_start || checkpoint_range_valid < checkpoint_line) {
+      checkpoint_range_start = checkpoint_line;
+      checkpoint_range_valid = checkpoint_line;
+      file_line_t *checkpoint =
+          static_cast<file_line_t *>(get_mutable_line_data(checkpoint_line));
+      checkpoint->set_highlight_start(
+          highlight_checkpoints.states[checkpoint_line / highlight_checkpoints.interval]);
+      if (checkpoint->is_highlight_end_dirty()) {
+        highlight_dirty.mark(checkpoint_line, checkpoint_line);
+      }
+    }
+    return propagate_highlight(line, deadline, &checkpoint_range_valid);
   }
-  highlight_valid = line;
+  return propagate_highlight(line, deadline, &highlight_valid);
+}
+
+bool file_buffer_t::propagate_highlight(text_pos_t line,
+                                        std::chrono::steady_clock::time_point deadline,
+                                        text_pos_t *valid) {
+  // The start states may be set without reading the text, so the last match must not be reused.
   match_line = nullptr;
+  bool result = highlight_dirty.propagate(line, deadline, valid, [this](text_pos_t i) {
+    file_line_t *previous = static_cast<file_line_t *>(get_mutable_line_data(i - 1));
+    file_line_t *current = static_cast<file_line_t *>(get_mutable_line_data(i));
+    // If neither the previous line nor its start state changed, the stored start state is still
+    // correct. Thus propagation stops as soon as a recomputed state matches the stored state.
+    if (previous->is_highlight_end_dirty()) {
+      int state = previous->get_highlight_end();
+      previous->clear_highlight_end_dirty();
+      current->set_highlight_start(state);
+    }
+    return current->is_highlight_end_dirty();
+  });
+  match_line = nullptr;
+  return result;
+}
+
+bool file_buffer_t::is_highlight_valid(text_pos_t line) const {
+  return line <= highlight_valid || (checkpoint_range_start >= 0 &&
+                                     line >= checkpoint_range_start &&
+                                     line <= checkpoint_range_valid);
+}
+
+void file_buffer_t::continue_highlight() {
+  // Lines may have been deleted since the target was set.
+  highlight_target = std::min(highlight_target, size() - 1);
+  if (!update_highlight(highlight_target,
+                        std::chrono::steady_clock::now() + HIGHLIGHT_SLICE_TIME)) {
+    // Wake up the main loop again for the next slice, after it has processed pending input.
+    signal_update();
+    return;
+  }
+  highlight_target = -1;
+  highlight_connection.disconnect();
 }
 
-void file_buffer_t::set_has_window(bool _has_window) { has_window = _has_window; }
+bool file_buffer_t::is_highlight_pending() const { return highlight_target >= 0; }
+
+void file_buffer_t::set_has_window(bool _has_window) {
+  has_window = _has_window;
+  // Without a window, the behavior parameters hold the top-left position.
+  if (!has_window) {
+    pending_top_left = nullopt;
+  }
+}
 
 bool file_buffer_t::get_has_window() const { return has_window; }
 
 void file_buffer_t::invalidate_highlight(rewrap_type_t type, text_pos_t line, text_pos_t pos) {
-  (void)type;
   (void)pos;
+  highlight_dirty.lines_changed(type == rewrap_type_t::REWRAP_ALL ? 0 : line, size());
+  if (type == rewrap_type_t::REWRAP_ALL) {
+    mark_highlight_dirty();
+    line = 0;
+  } else {
+    // The changed lines are marked, which for inserted and deleted lines includes the line before
+    // them.
+    text_pos_t first = first_changed_line(type, line);
+    for (text_pos_t i = first; i <= line && i < size(); ++i) {
+      static_cast<file_line_t *>(get_mutable_line_data(i))->invalidate_highlight();
+    }
+    highlight_dirty.mark(first, std::min(line, size() - 1));
+  }
   if (line <= highlight_valid) {
     highlight_valid = line - 1;
   }
+  if (line <= checkpoint_range_valid) {
+    checkpoint_range_valid = line - 1;
+  }
+  // The states after a change are no longer known, which also applies to the checkpoints.
+  checkpoint_lines = std::min(checkpoint_lines, line);
+}
+
+text_pos_t file_buffer_t::find_highlight_checkpoint(text_pos_t line) const {
+  const char *lang_file = get_highlight_lang_file();
+  if (highlight_checkpoints.states.empty() || checkpoint_lines <= 0 || lang_file == nullptr ||
+      highlight_checkpoints.lang_file != lang_file) {
+    return -1;
+  }
+  text_pos_t index = std::min<text_pos_t>({line / highlight_checkpoints.interval,
+                                           (checkpoint_lines - 1) / highlight_checkpoints.interval,
+                                           static_cast<text_pos_t>(
+                                               highlight_checkpoints.states.size() - 1)});
+  // Only checkpoints in the initial state are stored, the others must be skipped.
+  while (index >= 0 && highlight_checkpoints.states[index] != 0) {
+    --index;
+  }
+  return index < 0 ? -1 : index * highlight_checkpoints.interval;
+}
+
+void file_buffer_t::load_highlight_checkpoints(int fd) {
+  highlight_checkpoints_t checkpoints;
+  if (fstat(fd, &checkpoint_disk_info) < 0) {
+    checkpoint_disk_info.st_ino = 0;
+    return;
+  }
+  if (option.highlight_checkpoints == 0 ||
+      !read_highlight_checkpoints(highlight_checkpoint_dir(), name, checkpoint_disk_info,
+                                  &checkpoints)) {
+    return;
+  }
+  if (checkpoints.states.size() > option.highlight_checkpoints) {
+    checkpoints.states.resize(option.highlight_checkpoints);
+  }
+  highlight_checkpoints = std::move(checkpoints);
+  checkpoint_lines = size();
+  checkpoint_range_start = -1;
+  checkpoint_range_valid = -1;
+}
+
+void file_buffer_t::save_highlight_checkpoints() {
+  const char *lang_file = get_highlight_lang_file();
+  if (option.highlight_checkpoints == 0 || lang_file == nullptr || name.empty() ||
+      is_modified() || is_loading() || checkpoint_disk_info.st_ino == 0) {
+    return;
+  }
+
+  highlight_checkpoints_t checkpoints;
+  checkpoints.lang_file = lang_file;
+  // Each file has at most option.highlight_checkpoints checkpoints, to limit their memory use.
+  checkpoints.interval = std::max<text_pos_t>(
+      HIGHLIGHT_CHECKPOINT_INTERVAL,
+      (size() + option.highlight_checkpoints - 1) / option.highlight_checkpoints);
+  bool keep_read_checkpoints = highlight_checkpoints.lang_file == lang_file &&
+                               highlight_checkpoints.interval == checkpoints.interval;
+  for (text_pos_t line = 0; line < size(); line += checkpoints.interval) {
+    size_t index = line / checkpoints.interval;
+    if (line <= highlight_valid) {
+      checkpoints.states.push_back(
+          static_cast<const file_line_t &>(get_line_data(line)).get_highlight_start());
+    } else if (keep_read_checkpoints && index < highlight_checkpoints.states.size() &&
+               line < checkpoint_lines) {
+      checkpoints.states.push_back(highlight_checkpoints.states[index]);
+    } else {
+      break;
+    }
+  }
+  /* States other than the initial state are not stored, as their numbers may differ the next time
+     the file is highlighted. The first checkpoint is always the initial state, so unless another
+     checkpoint is in the initial state, the checkpoints are not useful. */
+  for (int &state : checkpoints.states) {
+    if (state != 0) {
+      state = HIGHLIGHT_CHECKPOINT_NONE;
+    }
+  }
+  if (checkpoints.states.size() <= 1 ||
+      std::count(checkpoints.states.begin() + 1, checkpoints.states.end(), 0) == 0 ||
+      (keep_read_checkpoints && checkpoints.states.size() <= highlight_checkpoints.states.size())) {
+    return;
+  }
+  write_highlight_checkpoints(highlight_checkpoint_dir(), name, checkpoint_disk_info, checkpoints,
+                              HIGHLIGHT_CHECKPOINT_FILES);
+}
+
+void file_buffer_t::track_modification(rewrap_type_t type, text_pos_t line, text_pos_t pos) {
+  (void)pos;
+  if (type == rewrap_type_t::REWRAP_ALL) {
+    line = 0;
+  }
+  unmodified_lines = std::min(unmodified_lines, first_changed_line(type, line));
+  ++modification_count;
+  // Lines added or removed by the user before load_line move it.
+  if (load_line >= 0 && !inserting_loaded_text && line < load_line) {
+    load_line = std::max(line, load_line + size() - tracked_size);
+  }
+  tracked_size = size();
+}
+
+void file_buffer_t::mark_unmodified_on_disk(int fd) {
+  char bom[3];
+  load_highlight_checkpoints(fd);
+  unmodified_lines = 0;
+  // After loading, the file may still contain a byte order mark that was removed from the buffer.
+  if (encoding != "UTF-8" || fstat(fd, &disk_info) < 0 ||
+      (pread(fd, bom, sizeof(bom), 0) == sizeof(bom) && memcmp(bom, "\xef\xbb\xbf", 3) == 0)) {
+    return;
+  }
+  unmodified_lines = size();
+}
+
+bool file_buffer_t::prepare_incremental_save(save_as_process_t *state) {
+  struct stat file_info;
+
+  if (!option.incremental_save || option.atomic_save || !state->name.empty() ||
+      encoding != "UTF-8" || unmodified_lines == 0 ||
+      stat(state->real_name.c_str(), &file_info) < 0 || file_info.st_dev != disk_info.st_dev ||
+      file_info.st_ino != disk_info.st_ino || file_info.st_size != disk_info.st_size ||
+      file_info.st_mtim.tv_sec != disk_info.st_mtim.tv_sec ||
+      file_info.st_mtim.tv_nsec != disk_info.st_mtim.tv_nsec) {
+    return false;
+  }
+
+  text_pos_t start_line = std::min(unmodified_lines, size());
+  off_t offset;
+  if (!incremental_save_offset(
+          [this](text_pos_t i) -> const std::string & { return get_line_data(i).get_data(); },
+          start_line, file_info.st_size, &offset)) {
+    return false;
+  }
+  lprintf("Saving %s incrementally from line %jd, offset %jd\n", name.c_str(),
+          static_cast<intmax_t>(start_line), static_cast<intmax_t>(offset));
+  state->incremental = true;
+  state->start_line = start_line;
+  state->write_offset = offset;
+  return true;
 }
 
 t3_highlight_t *file_buffer_t::get_highlight() { return highlight_info; }
 
-void file_buffer_t::set_highlight(t3_highlight_t *highlight) {
-  if (highlight_info != nullptr) {
-    t3_highlight_free(highlight_info);
+void file_buffer_t::set_highlight(t3_highlight_t *highlight, const char *lang_name) {
+  set_highlight(highlight);
+  if (lang_name == nullptr) {
+    set_line_comment(nullptr);
+    return;
   }
-  highlight_info = highlight;
+  highlight_name = lang_name;
+  std::map<std::string, std::string>::iterator iter = option.line_comment_map.find(lang_name);
+  set_line_comment(iter == option.line_comment_map.end() ? nullptr : iter->second.c_str());
+}
 
+const char *file_buffer_t::get_highlight_lang_file() const {
+  return highlight_info == nullptr ? nullptr : t3_highlight_get_langfile(highlight_info);
+}
+
+const std::string &file_buffer_t::get_highlight_name() const { return highlight_name; }
+
+void file_buffer_t::set_highlight(t3_highlight_t *highlight) {
+  highlight_name.clear();
+  // The match refers to the highlighting definition, so it is freed first.
   if (last_match != nullptr) {
     t3_highlight_free_match(last_match);
     last_match = nullptr;
   }
+  release_highlight(highlight_info);
+  highlight_info = highlight;
 
   match_line = nullptr;
   highlight_valid = 0;
+  checkpoint_range_start = -1;
+  checkpoint_range_valid = -1;
+  mark_highlight_dirty();
 
   if (highlight_info != nullptr) {
     last_match = t3_highlight_new_match(highlight_info);
   }
 }
 
+void file_buffer_t::mark_highlight_dirty() {
+  for (text_pos_t i = 0; i < size(); ++i) {
+    static_cast<file_line_t *>(get_mutable_line_data(i))->invalidate_highlight();
+  }
+  highlight_dirty.mark(0, size() - 1);
+}
+
 bool file_buffer_t::get_strip_spaces() const {
   if (strip_spaces.is_valid()) {
     return strip_spaces.value();
@@ -624,7 +1395,8 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
       return false;
   }
 
-  prepare_paint_line(cursor.line);
+  update_highlight(cursor.line);
+  paint_without_highlight = false;
   /* If the current character is highlighted, it is not considered for brace matching. */
   if (line->get_highlight_idx(cursor.pos) > 0) {
     return false;
@@ -641,7 +1413,7 @@ bool file_buffer_t::find_matching_brace(text_coordinate_t &match_location) {
 
     for (; current_line < size(); current_line++) {
       line = static_cast<file_line_t *>(get_mutable_line_data(current_line));
-      prepare_paint_line(current_line);
+      update_highlight(current_line);
       for (i = 0; i < line->size(); i = line->adjust_position(i, 1)) {
       start_search:
         check_c = line->get_data()[i];
@@ -791,7 +1563,11 @@ bool file_buffer_t::update_matching_brace() {
   bool old_valid = matching_brace_valid;
   text_coordinate_t old_coordinate = matching_brace_coordinate;
 
-  matching_brace_valid = find_matching_brace(matching_brace_coordinate);
+  // The brace is not matched while the highlighting is computed in the background, as matching
+  // would have to wait for it.
+  matching_brace_valid =
+      !(is_highlight_pending() && !is_highlight_valid(get_cursor().line)) &&
+      find_matching_brace(matching_brace_coordinate);
 
   return old_valid != matching_brace_valid ||
          (old_valid && old_coordinate != matching_brace_coordinate);
@@ -913,4 +1689,7 @@ const char *file_buffer_t::get_char_under_cursor(size_t *size) const {
 
 void file_buffer_t::set_top_left_in_behavior_parameters(text_coordinate_t pos) {
   behavior_parameters->set_top_left(pos);
+  if (has_window) {
+    pending_top_left = pos;
+  }
 }
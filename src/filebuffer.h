@@ -14,7 +14,11 @@
 #ifndef FILE_BUFFER_H
 #define FILE_BUFFER_H
 
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <sys/stat.h>
+#include <vector>
 
 #include <t3highlight/highlight.h>
 #include <t3widget/widget.h>
@@ -22,19 +26,48 @@
 using namespace t3widget;
 
 #include "tilde/filestate.h"
+#include "tilde/highlightcheckpoints.h"
+#include "tilde/highlightdirty.h"
 
 class file_edit_window_t;
+class file_line_t;
+class background_loader_t;
+class background_saver_t;
 
 class file_buffer_t : public text_buffer_t {
   friend class file_edit_window_t;  // Required to access behavior_parameters and set_has_window
   friend class file_line_t;
+  friend class background_loader_t;  // Required to access detect_highlight and load_line
 
  private:
   std::string name, encoding;
   text_line_t name_line;
   std::unique_ptr<edit_window_t::behavior_parameters_t> behavior_parameters;
   bool has_window;
+  // Top-left position set while shown in a window, which the window has yet to apply.
+  optional<text_coordinate_t> pending_top_left;
   text_pos_t highlight_valid;
+  // Lines of which the highlighting end state may be dirty, to skip the others when propagating.
+  highlight_dirty_range_t highlight_dirty;
+
+  /** A run of characters with the same highlight attribute, up to the start of the next span. */
+  struct highlight_span_t {
+    text_pos_t start;
+    int attribute_idx;
+  };
+  /** Highlight attributes of a line, computed when first needed after the line or its start state
+      changed. This prevents restarting the matching when lines are painted alternately. */
+  struct highlight_span_entry_t {
+    // The line the spans belong to, which is only compared and never dereferenced, as the line may
+    // have been deleted. @c nullptr if the entry is unused.
+    const file_line_t *line = nullptr;
+    unsigned long last_use = 0;
+    std::vector<highlight_span_t> spans;
+  };
+  // The spans of the most recently painted lines. Keeping them for all lines would use a lot of
+  // memory when paging through a large file.
+  std::vector<highlight_span_entry_t> highlight_span_cache;
+  unsigned long highlight_span_clock = 0;
   optional<bool> strip_spaces;
   t3_highlight_t *highlight_info;
   const text_line_t *match_line;
@@ -42,12 +75,101 @@ class file_buffer_t : public text_buffer_t {
   bool matching_brace_valid;
   text_coordinate_t matching_brace_coordinate;
   std::string line_comment;
+  // Name of the highlighting language, if known.
+  std::string highlight_name;
+  std::unique_ptr<background_loader_t> background_loader;
+  // While loading in the background, the loaded text is inserted before this line. It is the last
+  // line, unless the user has added text after the part of the file loaded so far.
+  text_pos_t load_line = -1;
+  // Number of lines at the last call to track_modification, to track load_line.
+  text_pos_t tracked_size = 0;
+  bool inserting_loaded_text = false;
+  // The lines before this line have not been modified since the file was last loaded or saved as
+  // UTF-8, and the file was in the state described by disk_info at that time.
+  text_pos_t unmodified_lines = 0;
+  struct stat disk_info;
+  // Incremented for every change to the text, to detect changes made during a background save.
+  unsigned long modification_count = 0;
+  // The saver of the last save that was written in the background, which may still be running.
+  std::unique_ptr<background_saver_t> background_saver;
+  // Line up to which the highlighting is computed in slices from the main loop, or -1 if none.
+  text_pos_t highlight_target = -1;
+  connection_t highlight_connection;
+  // Set if the line passed to the last prepare_paint_line call is painted without highlighting,
+  // because the highlighting has not reached it yet.
+  bool paint_without_highlight = false;
+  // Highlighting states read from the checkpoint file, which apply to the lines before
+  // checkpoint_lines. They allow highlighting to start close to the painted lines.
+  highlight_checkpoints_t highlight_checkpoints;
+  text_pos_t checkpoint_lines = 0;
+  // The file on disk the buffer was last loaded from or saved to. The st_ino field is 0 if unknown.
+  struct stat checkpoint_disk_info {};
+  // Lines highlighted starting from a checkpoint, in addition to the lines up to highlight_valid.
+  text_pos_t checkpoint_range_start = -1;
+  text_pos_t checkpoint_range_valid = -1;
 
  private:
   void prepare_paint_line(text_pos_t line) override;
+  /** Returns the index of an entry of highlight_span_cache for the spans of @p line, which reuses
+      the least recently used entry if the cache is full. */
+  int allocate_highlight_spans(const file_line_t *line);
+  /** Compute the highlighting start states of the lines up to @p line, stopping early when
+      @p deadline has passed.
+      @return @c true if the start states up to @p line are valid. */
+  bool update_highlight(text_pos_t line, std::chrono::steady_clock::time_point deadline =
+                                             std::chrono::steady_clock::time_point::max());
+  /** Compute the start states of the lines after @p *valid up to @p line, stopping early when
+      @p deadline has passed. @p valid is updated to the last line that was computed. */
+  bool propagate_highlight(text_pos_t line, std::chrono::steady_clock::time_point deadline,
+                           text_pos_t *valid);
+  /** Returns whether the highlighting start state of @p line is known. */
+  bool is_highlight_valid(text_pos_t line) const;
+  /** Compute the next slice of the highlighting up to highlight_target. */
+  void continue_highlight();
+  /** Returns the line of the last usable checkpoint at or before @p line, or -1 if none. */
+  text_pos_t find_highlight_checkpoint(text_pos_t line) const;
+  /** Read the highlighting checkpoints for the file opened as @p fd, which the buffer matches. */
+  void load_highlight_checkpoints(int fd);
+  /** Write the highlighting checkpoints of the file, if it is unmodified. */
+  void save_highlight_checkpoints();
   void set_has_window(bool _has_window);
   void invalidate_highlight(rewrap_type_t type, text_pos_t line, text_pos_t pos);
+  /** Mark the highlight end states of all lines as dirty, such that they are all recomputed. */
+  void mark_highlight_dirty();
+  void track_modification(rewrap_type_t type, text_pos_t line, text_pos_t pos);
+  /** Record that the buffer is stored unmodified as UTF-8 in the file opened as @p fd. */
+  void mark_unmodified_on_disk(int fd);
+  /** Check whether the save in @p state can write only the modified lines at the end of the
+      buffer, and set up @p state for it. */
+  bool prepare_incremental_save(save_as_process_t *state);
   bool find_matching_brace(text_coordinate_t &match_location);
+  /** Load the contents of the file mapped in @p state. */
+  rw_result_t read_mapped(load_process_t *state);
+  /** Returns whether the rest of the file opened as @p fd should be loaded in the background. */
+  bool use_background_load(int fd) const;
+  /** Hand the remainder of the load in @p state to a background_loader_t. The buffer must end in
+      an empty line, as the background_loader_t inserts complete lines before the last line.
+      @param wrapper_used The number of bytes in the current block of the wrapper in @p state that
+          have already been appended. */
+  bool start_background_load(load_process_t *state, size_t wrapper_used = 0);
+  /** Insert text loaded by the background_loader_t at load_line. Unless it is the final part of
+      the file, @p text must consist of complete lines. */
+  void insert_loaded_text(string_view text);
+  void detect_highlight();
+  /** Load the highlighting language used when the file was last closed, if the file has not
+      changed since. */
+  bool restore_highlight();
+  /** Prepare the spill file of @p state to replace the target file. This is only done for regular
+      files with a single link, of which the mode and ownership can be copied.
+      @return @c true if the spill file is linked into the target directory and can be renamed
+          over the target. */
+  bool prepare_replace(save_as_process_t *state);
+  /** Write the spill file of @p state to its destination, in the background if possible. */
+  rw_result_t write_spill(save_as_process_t *state);
+  /** Store the original contents of the file in @p state in the backup store state->backup_dir. */
+  rw_result_t store_backup(save_as_process_t *state);
+  /** Complete the save in @p state, after writing the file resulted in @p result. */
+  rw_result_t finish_save(save_as_process_t *state, rw_result_t result);
 
  public:
   explicit file_buffer_t(string_view _name = {"", 0}, string_view _encoding = {"", 0});
@@ -55,15 +177,49 @@ class file_buffer_t : public text_buffer_t {
   rw_result_t load(load_process_t *state);
   rw_result_t save(save_as_process_t *state);
 
+  /** Returns whether the file is still being loaded in the background. */
+  bool is_loading() const;
+  /** Returns whether loading the file stopped before its end was reached. */
+  bool is_load_incomplete() const;
+  void cancel_load();
+  /** Returns whether the file is still being written in the background. */
+  bool is_saving() const;
+  /** Returns the percentage of the file written by the background save. */
+  int get_save_progress() const;
+  /** Move the cursor to @p line and @p pos, like goto_pos. If that line has not been loaded yet,
+      the cursor is moved once it is, unless the user moves the cursor before that. If @p top_left
+      is valid, it is set as the top-left position of the window together with the cursor.
+      @return @c true if the cursor was moved immediately.
+  */
+  bool goto_pos_when_loaded(text_pos_t line, text_pos_t pos,
+                            optional<text_coordinate_t> top_left = nullopt);
+  /** Pass the next block of at most MAP_CHUNK_SIZE bytes of @p map, starting at @p offset, to
+      @p process, if it is valid UTF-8. Unless it reaches the end of the map, the block ends on a
+      line boundary where possible. The block points into the map, and @p process is called through
+      file_map_t::access, such that truncation of the file while it is loaded is detected.
+      @param valid Set to @c false if the block ends at an invalid UTF-8 sequence.
+      @throw rw_result_t CONVERSION_TRUNCATED if the file was truncated.
+      @return The size of the block. */
+  size_t process_map_block(const file_map_t &map, size_t offset, bool *valid,
+                           const std::function<void(string_view)> &process);
+
   const std::string &get_name() const;
   const char *get_encoding() const;
   const edit_window_t::behavior_parameters_t *get_behavior_parameters() const;
   text_line_t *get_name_line();
 
   bool get_has_window() const;
+  /** Returns whether painted lines are waiting for the highlighting to reach them. */
+  bool is_highlight_pending() const;
 
   t3_highlight_t *get_highlight();
   void set_highlight(t3_highlight_t *highlight);
+  /** Set the highlighting to @p highlight for language @p lang_name, and set the matching line
+      comment. */
+  void set_highlight(t3_highlight_t *highlight, const char *lang_name);
+  /** Get the language file of the current highlighting, or @c nullptr if there is none. */
+  const char *get_highlight_lang_file() const;
+  const std::string &get_highlight_name() const;
 
   bool get_strip_spaces() const;
   void set_strip_spaces(bool _strip_spaces);
@@ -82,6 +238,8 @@ class file_buffer_t : public text_buffer_t {
 
   const char *get_char_under_cursor(size_t *size) const;
 
+  /** Set the top-left position of the window. If the buffer is shown in a window, the window
+      applies it on its next update. */
   void set_top_left_in_behavior_parameters(text_coordinate_t pos);
 };
 
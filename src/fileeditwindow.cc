@@ -32,9 +32,8 @@ file_edit_window_t::file_edit_window_t(file_buffer_t *_text) {
 }
 
 file_edit_window_t::~file_edit_window_t() {
-  file_buffer_t *_text = static_cast<file_buffer_t *>(text);
-  _text->set_has_window(false);
-  save_behavior_parameters(_text->behavior_parameters.get());
+  save_behavior_parameters_in_buffer();
+  get_text()->set_has_window(false);
   rewrap_connection.disconnect();
 }
 
@@ -44,6 +43,17 @@ void file_edit_window_t::draw_info_window() {
   text_line_t::paint_info_t paint_info;
   int name_width = info_window.get_width();
   text_pos_t screen_width = name_line->calculate_screen_width(0, name_line->size(), 1);
+  std::string save_progress;
+
+  shown_save_progress = _text->is_saving() ? _text->get_save_progress() : -1;
+  if (shown_save_progress >= 0) {
+    printf_into(&save_progress, " Saving %d%%", shown_save_progress);
+    if (static_cast<int>(save_progress.size()) * 2 < name_width) {
+      name_width -= save_progress.size();
+    } else {
+      save_progress.clear();
+    }
+  }
 
   info_window.set_paint(0, 0);
   info_window.set_default_attrs(get_attribute(attribute_t::MENUBAR));
@@ -73,12 +83,15 @@ void file_edit_window_t::draw_info_window() {
 
   name_line->paint_line(&info_window, paint_info);
   info_window.clrtoeol();
+  if (!save_progress.empty()) {
+    info_window.set_paint(0, name_width);
+    info_window.addstr(save_progress.c_str(), 0);
+  }
 }
 
 void file_edit_window_t::set_text(file_buffer_t *_text) {
-  file_buffer_t *old_text = static_cast<file_buffer_t *>(edit_window_t::get_text());
-  old_text->set_has_window(false);
-  save_behavior_parameters(old_text->behavior_parameters.get());
+  save_behavior_parameters_in_buffer();
+  get_text()->set_has_window(false);
   rewrap_connection.disconnect();
   _text->set_has_window(true);
   rewrap_connection = _text->connect_rewrap_required(
@@ -91,6 +104,13 @@ file_buffer_t *file_edit_window_t::get_text() const {
 }
 
 bool file_edit_window_t::process_key(t3widget::key_t key) {
+  /* While a file is loading in the background, Ctrl-C without a selection cancels the load. */
+  if (key == (EKEY_CTRL | 'c') && get_text()->is_loading() &&
+      get_text()->get_selection_mode() == selection_mode_t::NONE) {
+    get_text()->cancel_load();
+    return true;
+  }
+
   bool result = edit_window_t::process_key(key);
 
   if (!result) {
@@ -136,7 +156,23 @@ void file_edit_window_t::update_contents() {
   if (get_text()->update_matching_brace()) {
     update_repaint_lines(0, std::numeric_limits<text_pos_t>::max());
   }
+  // The progress of a background save is updated through the update notification.
+  if ((get_text()->is_saving() ? get_text()->get_save_progress() : -1) != shown_save_progress) {
+    draw_info_window();
+  }
+  // Lines painted without highlighting are repainted once the highlighting has reached them.
+  if (shown_highlight_pending && !get_text()->is_highlight_pending()) {
+    update_repaint_lines(0, std::numeric_limits<text_pos_t>::max());
+  }
+  // A top-left position set while shown, such as a restored position reached by the loader.
+  file_buffer_t *_text = get_text();
+  if (_text->pending_top_left.is_valid()) {
+    save_behavior_parameters_in_buffer();
+    _text->behavior_parameters->apply_parameters(this);
+    _text->pending_top_left = nullopt;
+  }
   edit_window_t::update_contents();
+  shown_highlight_pending = get_text()->is_highlight_pending();
 }
 
 void file_edit_window_t::force_repaint_to_bottom(rewrap_type_t type, text_pos_t line,
@@ -156,6 +192,10 @@ void file_edit_window_t::show_character_details() {
 }
 
 void file_edit_window_t::save_behavior_parameters_in_buffer() {
-  save_behavior_parameters(
-      static_cast<file_buffer_t *>(edit_window_t::get_text())->behavior_parameters.get());
+  file_buffer_t *_text = get_text();
+  save_behavior_parameters(_text->behavior_parameters.get());
+  // A top-left position that has not been applied yet replaces that of the window.
+  if (_text->pending_top_left.is_valid()) {
+    _text->behavior_parameters->set_top_left(_text->pending_top_left.value());
+  }
 }
@@ -22,6 +22,10 @@ using namespace t3widget;
 class file_edit_window_t : public edit_window_t {
  private:
   connection_t rewrap_connection;
+  // Save progress shown in the info window, or -1 if no save is in progress.
+  int shown_save_progress = -1;
+  // Set if lines were painted while waiting for the highlighting to reach them.
+  bool shown_highlight_pending = false;
   void force_repaint_to_bottom(rewrap_type_t type, text_pos_t line, text_pos_t pos);
 
  public:
@@ -11,6 +11,8 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+
 #include "tilde/fileline.h"
 #include "tilde/option.h"
 
@@ -18,37 +20,64 @@ static file_line_factory_t default_file_line_factory(nullptr);
 
 file_line_t::file_line_t(int buffersize, file_line_factory_t *_factory)
     : text_line_t(buffersize, _factory == nullptr ? &default_file_line_factory : _factory),
-      highlight_start_state(0) {}
+      highlight_start_state(0),
+      highlight_end_dirty(true),
+      highlight_span_entry(-1) {}
 
 file_line_t::file_line_t(string_view _buffer, file_line_factory_t *_factory)
     : text_line_t(_buffer, _factory == nullptr ? &default_file_line_factory : _factory),
-      highlight_start_state(0) {}
+      highlight_start_state(0),
+      highlight_end_dirty(true),
+      highlight_span_entry(-1) {}
 
 int file_line_t::get_highlight_idx(text_pos_t i) const {
   file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
 
-  if (file == nullptr || file->highlight_info == nullptr) {
+  if (file == nullptr || file->highlight_info == nullptr || file->paint_without_highlight) {
     return -1;
   }
 
-  const std::string &str = get_data();
-  if (static_cast<size_t>(i) >= str.size()) {
+  if (i < 0 || static_cast<size_t>(i) >= get_data().size()) {
     return -1;
   }
 
-  if (file->match_line != this ||
-      static_cast<size_t>(i) < t3_highlight_get_start(file->last_match)) {
-    file->match_line = this;
-    t3_highlight_reset(file->last_match, highlight_start_state);
+  if (highlight_span_entry < 0 || file->highlight_span_cache[highlight_span_entry].line != this) {
+    update_highlight_spans();
   }
+  file_buffer_t::highlight_span_entry_t &entry = file->highlight_span_cache[highlight_span_entry];
+  entry.last_use = ++file->highlight_span_clock;
+  using span_t = file_buffer_t::highlight_span_t;
+  auto span = std::upper_bound(
+      entry.spans.begin(), entry.spans.end(), i,
+      [](text_pos_t pos, const span_t &candidate) { return pos < candidate.start; });
+  return span == entry.spans.begin() ? -1 : (span - 1)->attribute_idx;
+}
 
-  while (t3_highlight_get_end(file->last_match) <= static_cast<size_t>(i)) {
-    t3_highlight_match(file->last_match, str.data(), str.size());
-  }
+void file_line_t::update_highlight_spans() const {
+  file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
+  const std::string &str = get_data();
 
-  return static_cast<size_t>(i) < t3_highlight_get_match_start(file->last_match)
-             ? t3_highlight_get_begin_attr(file->last_match)
-             : t3_highlight_get_match_attr(file->last_match);
+  highlight_span_entry = file->allocate_highlight_spans(this);
+  std::vector<file_buffer_t::highlight_span_t> &spans =
+      file->highlight_span_cache[highlight_span_entry].spans;
+  auto add_span = [&spans](size_t start, size_t end, int attribute_idx) {
+    if (start < end && (spans.empty() || spans.back().attribute_idx != attribute_idx)) {
+      spans.push_back({static_cast<text_pos_t>(start), attribute_idx});
+    }
+  };
+
+  // Leave the match at the end of the line, such that get_highlight_end can use it.
+  file->match_line = this;
+  t3_highlight_reset(file->last_match, highlight_start_state);
+  bool more;
+  do {
+    more = t3_highlight_match(file->last_match, str.data(), str.size());
+    size_t match_start = t3_highlight_get_match_start(file->last_match);
+    add_span(t3_highlight_get_start(file->last_match), match_start,
+             t3_highlight_get_begin_attr(file->last_match));
+    add_span(match_start, t3_highlight_get_end(file->last_match),
+             t3_highlight_get_match_attr(file->last_match));
+  } while (more);
 }
 
 t3_attr_t file_line_t::get_base_attr(text_pos_t i, const paint_info_t &info) const {
@@ -65,7 +94,24 @@ t3_attr_t file_line_t::get_base_attr(text_pos_t i, const paint_info_t &info) con
   return result;
 }
 
-void file_line_t::set_highlight_start(int state) { highlight_start_state = state; }
+void file_line_t::set_highlight_start(int state) {
+  if (state != highlight_start_state) {
+    highlight_start_state = state;
+    invalidate_highlight();
+  }
+}
+
+void file_line_t::invalidate_highlight() {
+  highlight_end_dirty = true;
+  if (highlight_span_entry >= 0) {
+    file_buffer_t *file =
+        static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
+    if (file != nullptr && file->highlight_span_cache[highlight_span_entry].line == this) {
+      file->highlight_span_cache[highlight_span_entry].line = nullptr;
+    }
+    highlight_span_entry = -1;
+  }
+}
 
 int file_line_t::get_highlight_end() {
   file_buffer_t *file = static_cast<file_line_factory_t *>(get_line_factory())->get_file_buffer();
@@ -23,13 +23,30 @@ class file_line_factory_t;
 class file_line_t : public text_line_t {
  protected:
   int highlight_start_state;
+  // Set if the highlight state at the end of this line may differ from the start state stored in
+  // the next line, i.e. if this line or its start state changed since the next line was updated.
+  bool highlight_end_dirty;
+  // Entry of the highlight span cache of the file_buffer_t that may hold the spans of this line,
+  // or -1. The entry only holds them if it refers to this line.
+  mutable int highlight_span_entry;
+
+  /** Compute the highlight spans of the line into an entry of the highlight span cache. */
+  void update_highlight_spans() const;
 
  public:
   file_line_t(int buffersize = BUFFERSIZE, file_line_factory_t *_factory = nullptr);
   file_line_t(string_view _buffer, file_line_factory_t *_factory = nullptr);
 
+  /** Set the highlight state at the start of the line. If it differs from the current state, the
+      end state is marked dirty. */
   void set_highlight_start(int state);
+  int get_highlight_start() const { return highlight_start_state; }
   int get_highlight_end();
+  bool is_highlight_end_dirty() const { return highlight_end_dirty; }
+  void clear_highlight_end_dirty() { highlight_end_dirty = false; }
+  /** Discard the highlighting information of the line, after its text or the highlighting
+      language changed. */
+  void invalidate_highlight();
   int get_highlight_idx(text_pos_t i) const;
 
  protected:
@@ -15,17 +15,23 @@
 
 #include "tilde/filebuffer.h"
 #include "tilde/filestate.h"
+#include "tilde/highlightcache.h"
 #include "tilde/log.h"
 #include "tilde/main.h"
 #include "tilde/openfiles.h"
 #include "tilde/option.h"
 
+/* Maximum number of files written at the same time by save_all_process_t. */
+#define MAX_CONCURRENT_SAVES 8
+
 load_process_t::load_process_t(const callback_t &cb)
     : stepped_process_t(cb),
       state(SELECT_FILE),
       bom_state(UNKNOWN),
       file(nullptr),
       wrapper(nullptr),
+      map(nullptr),
+      map_offset(0),
       encoding("UTF-8"),
       fd(-1),
       buffer_used(true) {
@@ -39,6 +45,8 @@ load_process_t::load_process_t(const callback_t &cb, const char *name, const cha
       bom_state(UNKNOWN),
       file(new file_buffer_t(name, _encoding == nullptr ? "UTF-8" : _encoding)),
       wrapper(nullptr),
+      map(nullptr),
+      map_offset(0),
       encoding(_encoding == nullptr ? "UTF-8" : _encoding),
       fd(-1),
       buffer_used(true) {
@@ -133,8 +141,8 @@ bool load_process_t::step() {
   if (recent_files_iter != recent_files.end()) {
     if (option.restore_cursor_position) {
       text_coordinate_t position = (*recent_files_iter)->get_position();
-      open_files.back()->goto_pos(position.line + 1, position.pos + 1);
-      open_files.back()->set_top_left_in_behavior_parameters((*recent_files_iter)->get_top_left());
+      open_files.back()->goto_pos_when_loaded(position.line + 1, position.pos + 1,
+                                              (*recent_files_iter)->get_top_left());
     }
     recent_files.erase(recent_files_iter);
   }
@@ -168,6 +176,7 @@ void load_process_t::cleanup() {
   ASSERT(result || file == nullptr);
 #endif
   delete wrapper;
+  delete map;
   if (fd >= 0) {
     close(fd);
   }
@@ -248,7 +257,9 @@ bool save_as_process_t::step() {
       } else if (backup_saved) {
         message.append("\n\nThe original contents of the file can still be retrieved from ");
         // FIXME: the file names probably needs to be converted from some other character set.
-        if (!temp_name.empty()) {
+        if (backup_in_store) {
+          message.append("the backup store through File > Restore Backup");
+        } else if (!temp_name.empty()) {
           message.append(temp_name);
         } else {
           message.append(name);
@@ -309,6 +320,31 @@ bool save_as_process_t::step() {
                   name.c_str());
       abort();
       break;
+    case rw_result_t::LOAD_IN_PROGRESS:
+      printf_into(&message, "File '%s' is still being loaded. It can not be saved until loading is "
+                  "complete.", file->get_name().c_str());
+      error_dialog->set_message(message);
+      error_dialog->show();
+      abort();
+      break;
+    case rw_result_t::SAVE_IN_BACKGROUND:
+      // The save will be continued once the file has been written.
+      return false;
+    case rw_result_t::SAVE_IN_PROGRESS:
+      printf_into(&message, "File '%s' is still being saved.", file->get_name().c_str());
+      error_dialog->set_message(message);
+      error_dialog->show();
+      abort();
+      break;
+    case rw_result_t::LOAD_INCOMPLETE:
+      printf_into(&message,
+                  "File '%s' was not loaded completely. Saving it under the same name would "
+                  "truncate it. Save the buffer to another location instead.",
+                  save_name);
+      error_dialog->set_message(message);
+      error_dialog->show();
+      abort();
+      break;
     default:
       printf_into(&message,
                   "An unknown error occurred during saving. The file has not been saved and may be "
@@ -326,8 +362,13 @@ void save_as_process_t::file_selected(const std::string &_name) {
   state = INITIAL;
   if (allow_highlight_change) {
     highlight_changed = true;
-    file->set_highlight(t3_highlight_load_by_filename(name.c_str(), map_highlight, nullptr,
-                                                      T3_HIGHLIGHT_UTF8, nullptr));
+    t3_highlight_lang_t lang;
+    if (t3_highlight_lang_by_filename(name.c_str(), T3_HIGHLIGHT_UTF8, &lang, nullptr)) {
+      file->set_highlight(load_highlight(lang.lang_file));
+      t3_highlight_free_lang(lang);
+    } else {
+      file->set_highlight(nullptr);
+    }
   }
   run();
 }
@@ -338,6 +379,12 @@ void save_as_process_t::cleanup() {
   if (backup_fd >= 0) {
     close(backup_fd);
   }
+  if (spill_fd >= 0) {
+    close(spill_fd);
+  }
+  if (!spill_name.empty()) {
+    unlink(spill_name.c_str());
+  }
   if (readonly_fd >= 0) {
     if (original_mode.is_valid()) {
       fchmod(fd, original_mode.value());
@@ -376,6 +423,114 @@ void save_process_t::execute(const callback_t &cb, file_buffer_t *_file) {
   (new save_process_t(cb, _file))->run();
 }
 
+quiet_save_process_t::quiet_save_process_t(const callback_t &cb, file_buffer_t *_file)
+    : save_process_t(cb, _file) {
+  // Several of these run at the same time, so they must not respond to the dialogs.
+  for (connection_t &connection : connections) {
+    connection.disconnect();
+  }
+  connections.clear();
+  background = true;
+}
+
+bool quiet_save_process_t::step() {
+  if (state == SELECT_FILE) {
+    result = false;
+    return true;
+  }
+  rw_result_t rw_result = file->save(this);
+  if (rw_result == rw_result_t::SAVE_IN_BACKGROUND) {
+    return false;
+  }
+  if (rw_result != rw_result_t::SUCCESS) {
+    lprintf("Quiet save of %s stopped with result %d\n", file->get_name().c_str(),
+            static_cast<int>(rw_result));
+  }
+  result = rw_result == rw_result_t::SUCCESS;
+  return true;
+}
+
+void quiet_save_process_t::execute(const callback_t &cb, file_buffer_t *_file) {
+  (new quiet_save_process_t(cb, _file))->run();
+}
+
+save_all_process_t::save_all_process_t(const callback_t &cb, std::list<file_buffer_t *> buffers)
+    : stepped_process_t(cb) {
+  for (file_buffer_t *buffer : buffers) {
+    // Untitled files need a name, which has to be asked from the user.
+    if (buffer->get_name().empty()) {
+      interactive.push_back(buffer);
+    } else {
+      pending.push_back(buffer);
+    }
+  }
+}
+
+bool save_all_process_t::step() {
+  while (!pending.empty() && running < MAX_CONCURRENT_SAVES) {
+    file_buffer_t *buffer = pending.front();
+    pending.pop_front();
+    ++running;
+    quiet_save_process_t::execute(bind_front(&save_all_process_t::quiet_save_done, this), buffer);
+  }
+  if (running > 0) {
+    return false;
+  }
+
+  while (!interactive.empty()) {
+    file_buffer_t *buffer = interactive.front();
+    interactive.pop_front();
+    if (!buffer->is_modified()) {
+      continue;
+    }
+    waiting = true;
+    save_process_t::execute(bind_front(&save_all_process_t::save_done, this), buffer);
+    if (waiting) {
+      return false;
+    }
+    if (!result) {
+      return true;
+    }
+  }
+  return true;
+}
+
+void save_all_process_t::quiet_save_done(stepped_process_t *process) {
+  --running;
+  if (!process->get_result()) {
+    interactive.push_back(static_cast<quiet_save_process_t *>(process)->get_file());
+  }
+  if (!in_step) {
+    run();
+  }
+}
+
+void save_all_process_t::save_done(stepped_process_t *process) {
+  waiting = false;
+  if (!process->get_result()) {
+    abort();
+  } else if (!in_step) {
+    run();
+  }
+}
+
+void save_all_process_t::execute(const callback_t &cb) {
+  std::list<file_buffer_t *> buffers;
+  for (file_buffer_t *buffer : open_files) {
+    /* A file that is still being written in the background would be refused by the quiet save,
+       after which the interactive save reports an error and aborts the whole process. It is
+       skipped instead, as it is already being saved. */
+    if (buffer->is_modified() && !buffer->is_saving()) {
+      buffers.push_back(buffer);
+    }
+  }
+  execute(cb, std::move(buffers));
+}
+
+void save_all_process_t::execute(const callback_t &cb, std::list<file_buffer_t *> buffers) {
+  (new save_all_process_t(cb, std::move(buffers)))->run();
+}
+
 close_process_t::close_process_t(const callback_t &cb, file_buffer_t *_file)
     : save_process_t(cb, _file) {
   state = file->is_modified() ? CONFIRM_CLOSE : CLOSE;
@@ -389,6 +544,16 @@ close_process_t::close_process_t(const callback_t &cb, file_buffer_t *_file)
 }
 
 bool close_process_t::step() {
+  if (state >= CONFIRM_CLOSE && file->is_saving()) {
+    std::string message;
+    printf_into(&message, "File '%s' is still being saved. It can not be closed until saving is "
+                "complete.", file->get_name().c_str());
+    error_dialog->set_message(message);
+    error_dialog->show();
+    abort();
+    return true;
+  }
+
   if (state < CONFIRM_CLOSE) {
     if (save_process_t::step()) {
       if (!result) {
@@ -445,6 +610,17 @@ exit_process_t::exit_process_t(const callback_t &cb)
 }
 
 bool exit_process_t::step() {
+  for (file_buffer_t *buffer : open_files) {
+    if (buffer->is_saving()) {
+      std::string message;
+      printf_into(&message, "File '%s' is still being saved. Wait for saving to complete before "
+                  "exiting.", buffer->get_name().c_str());
+      error_dialog->set_message(message);
+      error_dialog->show();
+      abort();
+      return true;
+    }
+  }
   for (; iter != open_files.end(); iter++) {
     if ((*iter)->is_modified()) {
       std::string message;
@@ -455,6 +631,19 @@ bool exit_process_t::step() {
       return false;
     }
   }
+  // The files are only saved once all questions have been answered, such that they can be written
+  // at the same time.
+  if (!to_save.empty()) {
+    saving = true;
+    save_all_process_t::execute(bind_front(&exit_process_t::save_done, this), std::move(to_save));
+    to_save.clear();
+    if (saving) {
+      return false;
+    }
+    if (!result) {
+      return true;
+    }
+  }
   for (file_buffer_t *buffer : open_files) {
     recent_files.push_front(buffer);
   }
@@ -462,7 +651,9 @@ bool exit_process_t::step() {
 }
 
 void exit_process_t::do_save() {
-  save_process_t::execute(bind_front(&exit_process_t::save_done, this), *iter);
+  to_save.push_back(*iter);
+  ++iter;
+  run();
 }
 
 void exit_process_t::dont_save() {
@@ -471,11 +662,11 @@ void exit_process_t::dont_save() {
 }
 
 void exit_process_t::save_done(stepped_process_t *process) {
-  if (process->get_result()) {
-    ++iter;
-    run();
-  } else {
+  saving = false;
+  if (!process->get_result()) {
     abort();
+  } else if (!in_step) {
+    run();
   }
 }
 
@@ -520,6 +711,65 @@ void open_recent_process_t::execute(const callback_t &cb) {
   (new open_recent_process_t(cb))->run();
 }
 
+restore_backup_process_t::restore_backup_process_t(const callback_t &cb,
+                                                   const file_buffer_t *original)
+    : load_process_t(cb), original_name(original->get_name()) {
+  encoding = original->get_encoding();
+  connections.push_back(restore_backup_dialog->connect_version_selected(
+      bind_front(&restore_backup_process_t::version_selected, this)));
+  connections.push_back(restore_backup_dialog->connect_closed([this] { abort(); }));
+}
+
+bool restore_backup_process_t::step() {
+  if (state == SELECT_FILE) {
+    std::vector<backup_version_t> versions;
+    std::string store_dir = backup_store_t::default_dir();
+    if (!original_name.empty() && !store_dir.empty()) {
+      versions = backup_store_t(store_dir).list(original_name);
+    }
+    if (versions.empty()) {
+      error_dialog->set_message(
+          "No backups of this file are stored. Backups are stored when the make_backup option is "
+          "set, and backup_versions is larger than 0.");
+      error_dialog->show();
+      result = false;
+      return true;
+    }
+    restore_backup_dialog->set_versions(std::move(versions));
+    restore_backup_dialog->show();
+    return false;
+  }
+  return load_process_t::step();
+}
+
+void restore_backup_process_t::version_selected(const backup_version_t *version) {
+  std::string copy_name;
+  int error = backup_store_t(backup_store_t::default_dir())
+                  .restore_copy(original_name, *version, &copy_name);
+  if (error != 0) {
+    std::string message;
+    printf_into(&message, "Could not restore backup: %s", strerror(error));
+    error_dialog->set_message(message);
+    error_dialog->show();
+    abort();
+    return;
+  }
+
+  open_files_t::iterator iter;
+  if ((iter = open_files.contains(copy_name.c_str())) != open_files.end()) {
+    file = *iter;
+    done();
+    return;
+  }
+  file = new file_buffer_t(copy_name, encoding);
+  state = INITIAL;
+  run();
+}
+
+void restore_backup_process_t::execute(const callback_t &cb, const file_buffer_t *original) {
+  (new restore_backup_process_t(cb, original))->run();
+}
+
 load_cli_file_process_t::load_cli_file_process_t(const callback_t &cb)
     : stepped_process_t(cb),
       iter(cli_option.files.begin()),
@@ -557,7 +807,7 @@ bool load_cli_file_process_t::step() {
     if (in_load) {
       return false;
     }
-    open_files.back()->goto_pos(line, pos);
+    open_files.back()->goto_pos_when_loaded(line, pos);
   }
   result = true;
   return true;
@@ -14,6 +14,8 @@
 #ifndef FILESTATE_H
 #define FILESTATE_H
 #include <cerrno>
+#include <chrono>
+#include <list>
 #include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -22,6 +24,7 @@
 #include <t3widget/widget.h>
 #include <transcript/transcript.h>
 
+#include "tilde/backupstore.h"
 #include "tilde/filewrapper.h"
 #include "tilde/openfiles.h"
 #include "tilde/util.h"
@@ -48,6 +51,11 @@ class rw_result_t {
     MODE_RESET_FAILED,
     INTERNAL_ERROR,
     RACE_ON_FILE,
+    LOAD_IN_PROGRESS,
+    LOAD_INCOMPLETE,
+    LOAD_MEMORY_LIMIT,
+    SAVE_IN_BACKGROUND,
+    SAVE_IN_PROGRESS,
   };
 
  private:
@@ -83,9 +91,12 @@ class load_process_t : public stepped_process_t {
 
   file_buffer_t *file;
   file_read_wrapper_t *wrapper;
+  file_map_t *map;
+  size_t map_offset;
   std::string encoding;
   int fd;
   bool buffer_used;
+  std::chrono::steady_clock::time_point start_time;
 
   explicit load_process_t(const callback_t &cb);
   load_process_t(const callback_t &cb, const char *name, const char *_encoding, bool missing_ok);
@@ -110,7 +121,15 @@ class save_as_process_t : public stepped_process_t {
   friend class file_buffer_t;
 
  protected:
-  enum { SELECT_FILE, INITIAL, OPEN_FILE, CHANGE_MODE, CREATE_BACKUP, WRITING };
+  enum {
+    SELECT_FILE,
+    INITIAL,
+    OPEN_FILE,
+    CHANGE_MODE,
+    CREATE_BACKUP,
+    WRITING,
+    BACKGROUND_WRITING,
+  };
   int state = SELECT_FILE;
 
   file_buffer_t *file;
@@ -129,10 +148,29 @@ class save_as_process_t : public stepped_process_t {
   dev_t readonly_dev;
   ino_t readonly_ino;
   bool backup_saved = false;
+  // Whether the backup was stored in the backup store, rather than in a file next to the original.
+  bool backup_in_store = false;
+  // Backup store in which the original contents are stored right before the spill file is written,
+  // if that has not been done yet.
+  std::string backup_dir;
   off_t computed_length = 0;
+  // Unlinked file holding the converted text, such that it only needs to be converted once.
+  int spill_fd = -1;
+  // Name of the spill file, if it is linked into the target directory to replace the target.
+  std::string spill_name;
+  bool replace_file = false;
+  // Whether only the lines from start_line are written, starting at write_offset in the file.
+  bool incremental = false;
+  text_pos_t start_line = 0;
+  off_t write_offset = 0;
+  // Value of the modification count of the file when the written text was converted.
+  unsigned long modification_count = 0;
+  // Whether the file is written in the background, even if the background_save option is not set.
+  bool background = false;
   optional<mode_t> original_mode;
   text_pos_t i;
   transcript_t *conversion_handle = nullptr;
+  const single_byte_converter_t *converter = nullptr;
   std::unique_ptr<file_write_wrapper_t> wrapper = nullptr;
 
   save_as_process_t(const callback_t &cb, file_buffer_t *_file,
@@ -156,9 +194,42 @@ class save_process_t : public save_as_process_t {
   static void execute(const callback_t &cb, file_buffer_t *_file);
 };
 
+/** Saves a file without asking the user anything. If saving requires a decision from the user or
+    fails, the save is aborted and the result is false. */
+class quiet_save_process_t : public save_process_t {
+ protected:
+  quiet_save_process_t(const callback_t &cb, file_buffer_t *_file);
+  bool step() override;
+
+ public:
+  static void execute(const callback_t &cb, file_buffer_t *_file);
+  file_buffer_t *get_file() const { return file; }
+};
+
+/** Saves a list of files. The files are first saved without asking the user anything, with several
+    files being written at the same time. Files which require a decision from the user, or could not
+    be saved, are then saved one by one in the normal way. */
+class save_all_process_t : public stepped_process_t {
+ protected:
+  std::list<file_buffer_t *> pending;
+  std::list<file_buffer_t *> interactive;
+  int running = 0;
+  bool waiting = false;
+
+  save_all_process_t(const callback_t &cb, std::list<file_buffer_t *> buffers);
+  bool step() override;
+  virtual void quiet_save_done(stepped_process_t *process);
+  virtual void save_done(stepped_process_t *process);
+
+ public:
+  /** Save all modified files, except those that are still being written in the background. */
+  static void execute(const callback_t &cb);
+  static void execute(const callback_t &cb, std::list<file_buffer_t *> buffers);
+};
+
 class close_process_t : public save_process_t {
  protected:
-  enum { CONFIRM_CLOSE = WRITING + 1, CLOSE };
+  enum { CONFIRM_CLOSE = BACKGROUND_WRITING + 1, CLOSE };
 
   close_process_t(const callback_t &cb, file_buffer_t *_file);
   bool step() override;
@@ -173,6 +244,8 @@ class close_process_t : public save_process_t {
 class exit_process_t : public stepped_process_t {
  protected:
   open_files_t::iterator iter;
+  std::list<file_buffer_t *> to_save;
+  bool saving = false;
 
   explicit exit_process_t(const callback_t &cb);
   bool step() override;
@@ -197,6 +270,18 @@ class open_recent_process_t : public load_process_t {
   static void execute(const callback_t &cb);
 };
 
+class restore_backup_process_t : public load_process_t {
+ protected:
+  std::string original_name;
+
+  restore_backup_process_t(const callback_t &cb, const file_buffer_t *original);
+  bool step() override;
+  virtual void version_selected(const backup_version_t *version);
+
+ public:
+  static void execute(const callback_t &cb, const file_buffer_t *original);
+};
+
 class load_cli_file_process_t : public stepped_process_t {
  private:
   void attempt_file_position_parse(std::string *filename, text_pos_t *line, text_pos_t *pos);
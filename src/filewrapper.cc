@@ -11,8 +11,17 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
+#include <csetjmp>
+#include <csignal>
+#include <cstdint>
 #include <cstring>
+#include <limits>
+#include <mutex>
 #include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <t3widget/widget.h>
 #include <uninorm.h>
@@ -21,36 +30,41 @@ using namespace t3widget;
 
 #include "tilde/filestate.h"
 #include "tilde/filewrapper.h"
+#include "tilde/log.h"
+#include "tilde/nfccheck.h"
+#include "tilde/workerpool.h"
+
+size_t buffer_t::consume(size_t used) {
+  start += used;
+  if (start >= fill) {
+    start = fill = 0;
+  } else if (buffer.size() - fill < buffer.size() / 2) {
+    memmove(buffer.data(), buffer.data() + start, fill - start);
+    fill -= start;
+    start = 0;
+  }
+  return buffer.size() - fill;
+}
 
-bool read_buffer_t::fill_buffer(int used) {
+bool read_buffer_t::fill_buffer(size_t used) {
   ssize_t retval;
+  size_t available = consume(used);
 
-  if (used < fill) {
-    memmove(buffer, buffer + used, fill - used);
-    fill -= used;
-  } else {
-    fill = 0;
-  }
-
-  if ((retval = nosig_read(fd, buffer + fill, FILE_BUFFER_SIZE - fill)) < 0) {
+  if ((retval = nosig_read(fd, buffer.data() + fill, available)) < 0) {
     throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
   }
 
   fill += retval;
-  return fill > 0;
+  bytes_read += retval;
+  return get_fill() > 0;
 }
 
-bool transcript_buffer_t::fill_buffer(int used) {
+bool transcript_buffer_t::fill_buffer(size_t used) {
   const char *inbuf;
   char *outbuf;
   transcript_error_t retval;
 
-  if (used < fill) {
-    memmove(buffer, buffer + used, fill - used);
-    fill -= used;
-  } else {
-    fill = 0;
-  }
+  consume(used);
 
   if (!at_eof) {  // Don't try to read more bytes when we have already hit EOF
     if (!wrapped_buffer->fill_buffer(buffer_index)) {
@@ -64,14 +78,17 @@ bool transcript_buffer_t::fill_buffer(int used) {
     return false;
   }
 
+  if (parallel_output.size() > 1 && convert_parallel()) {
+    return get_fill() > 0;
+  }
+
   inbuf = wrapped_buffer->get_buffer() + buffer_index;
-  outbuf = buffer + fill;
+  outbuf = buffer.data() + fill;
 
-  retval = transcript_to_unicode(handle, &inbuf,
-                                 wrapped_buffer->get_buffer() + wrapped_buffer->get_fill(), &outbuf,
-                                 buffer + FILE_BUFFER_SIZE, conversion_flags);
+  retval = convert(&inbuf, wrapped_buffer->get_buffer() + wrapped_buffer->get_fill(), &outbuf,
+                   buffer.data() + buffer.size(), conversion_flags);
   buffer_index = inbuf - wrapped_buffer->get_buffer();
-  fill = outbuf - buffer;
+  fill = outbuf - buffer.data();
 
   if (buffer_index > 0) {
     conversion_flags &= ~TRANSCRIPT_FILE_START;
@@ -100,62 +117,341 @@ bool transcript_buffer_t::fill_buffer(int used) {
     default:
       throw rw_result_t(rw_result_t::CONVERSION_ERROR);
   }
-  return fill > 0;
+  return get_fill() > 0;
+}
+
+transcript_error_t transcript_buffer_t::convert(const char **inbuf, const char *inbuflimit,
+                                                char **outbuf, const char *outbuflimit,
+                                                int flags) {
+  if (converter != nullptr) {
+    return converter->to_unicode(inbuf, inbuflimit, outbuf, outbuflimit, flags);
+  }
+  return transcript_to_unicode(handle, inbuf, inbuflimit, outbuf, outbuflimit, flags);
+}
+
+bool transcript_buffer_t::convert_parallel() {
+  const char *input = wrapped_buffer->get_buffer() + buffer_index;
+  size_t input_size = wrapped_buffer->get_fill() - buffer_index;
+  bool converts_to_end = at_eof;
+
+  if (input_size > (buffer.size() - fill) / MAX_SINGLE_BYTE_EXPANSION) {
+    input_size = (buffer.size() - fill) / MAX_SINGLE_BYTE_EXPANSION;
+    converts_to_end = false;
+  }
+  size_t parts = std::min(parallel_output.size(), input_size / MIN_PARALLEL_CONVERSION_SIZE);
+  if (parts < 2) {
+    return false;
+  }
+
+  size_t part_size = input_size / parts;
+  std::vector<transcript_error_t> results(parts, TRANSCRIPT_INTERNAL_ERROR);
+  auto convert_part = [&](size_t part) {
+    const char *part_start = input + part * part_size;
+    const char *part_end = part + 1 == parts ? input + input_size : part_start + part_size;
+    std::vector<char> &output = parallel_output[part];
+    try {
+      output.resize((part_end - part_start) * MAX_SINGLE_BYTE_EXPANSION);
+    } catch (std::bad_alloc &) {
+      return;
+    }
+    char *outbuf = output.data();
+    int flags = conversion_flags & ~TRANSCRIPT_FILE_START;
+    if (part + 1 == parts && converts_to_end) {
+      flags |= TRANSCRIPT_END_OF_TEXT;
+    }
+    results[part] =
+        converter->to_unicode(&part_start, part_end, &outbuf, output.data() + output.size(), flags);
+    if (results[part] == TRANSCRIPT_SUCCESS && part_start != part_end) {
+      results[part] = TRANSCRIPT_NO_SPACE;
+    }
+    output.resize(outbuf - output.data());
+  };
+
+  std::vector<std::future<void>> pending;
+  try {
+    for (size_t part = 1; part < parts; ++part) {
+      pending.push_back(get_worker_pool()->submit([&convert_part, part] { convert_part(part); }));
+    }
+  } catch (std::exception &) {
+    for (std::future<void> &result : pending) {
+      result.wait();
+    }
+    return false;
+  }
+  convert_part(0);
+  for (std::future<void> &result : pending) {
+    result.wait();
+  }
+
+  /* On any problem, let the regular conversion redo the input, such that problems are reported at
+     the correct position. */
+  for (transcript_error_t result : results) {
+    if (result != TRANSCRIPT_SUCCESS) {
+      return false;
+    }
+  }
+
+  for (size_t part = 0; part < parts; ++part) {
+    const std::vector<char> &output = parallel_output[part];
+    memcpy(buffer.data() + fill, output.data(), output.size());
+    fill += output.size();
+  }
+  buffer_index += input_size;
+  conversion_flags &= ~TRANSCRIPT_FILE_START;
+  return true;
 }
 
 transcript_buffer_t::~transcript_buffer_t() {
-  transcript_close_converter(handle);
+  if (handle != nullptr) {
+    transcript_close_converter(handle);
+  }
   delete wrapped_buffer;
 }
 
-file_read_wrapper_t::file_read_wrapper_t(int fd, transcript_t *handle) {
-  buffer = new read_buffer_t(fd);
+file_read_wrapper_t::file_read_wrapper_t(int fd, transcript_t *handle, size_t block_size) {
+  block_size = std::max<size_t>(block_size, MIN_READ_BLOCK_SIZE);
+  buffer = read_buffer = new read_buffer_t(fd, block_size);
   if (handle != nullptr) {
-    buffer_t *transcript_buffer = new transcript_buffer_t(buffer, handle);
+    buffer_t *transcript_buffer = new transcript_buffer_t(buffer, handle, block_size);
     buffer = transcript_buffer;
   }
 }
 
+file_read_wrapper_t::file_read_wrapper_t(int fd, const single_byte_converter_t *converter,
+                                         size_t block_size, size_t parallel_parts) {
+  block_size = std::max<size_t>(block_size, MIN_READ_BLOCK_SIZE);
+  buffer = read_buffer = new read_buffer_t(fd, block_size);
+  /* Parallel conversion only pays off if each conversion round has enough input. As single byte
+     encodings expand to at most three bytes, use a correspondingly larger output block. */
+  buffer_t *transcript_buffer = new transcript_buffer_t(
+      buffer, converter, parallel_parts > 1 ? block_size * MAX_SINGLE_BYTE_EXPANSION : block_size,
+      parallel_parts);
+  buffer = transcript_buffer;
+}
+
 file_read_wrapper_t::~file_read_wrapper_t() { delete buffer; }
 
+file_read_wrapper_t *file_read_wrapper_t::open_validating(int fd, off_t offset,
+                                                          size_t block_size) {
+  transcript_error_t error;
+  transcript_t *handle;
+
+  if (lseek(fd, offset, SEEK_SET) < 0) {
+    throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+  }
+  if ((handle = transcript_open_converter("UTF-8", TRANSCRIPT_UTF8, 0, &error)) == nullptr) {
+    throw rw_result_t(rw_result_t::CONVERSION_OPEN_ERROR, error);
+  }
+  try {
+    return new file_read_wrapper_t(fd, handle, block_size);
+  } catch (std::bad_alloc &) {
+    transcript_close_converter(handle);
+    throw rw_result_t(rw_result_t::ERRNO_ERROR, ENOMEM);
+  }
+}
+
 const char *file_read_wrapper_t::get_buffer() { return buffer->get_buffer(); }
 
-int file_read_wrapper_t::get_fill() { return buffer->get_fill(); }
+size_t file_read_wrapper_t::get_fill() { return buffer->get_fill(); }
+
+bool file_read_wrapper_t::fill_buffer(size_t used) { return buffer->fill_buffer(used); }
+
+off_t file_read_wrapper_t::get_bytes_read() const { return read_buffer->get_bytes_read(); }
 
-bool file_read_wrapper_t::fill_buffer(int used) { return buffer->fill_buffer(used); }
+/* Jump target for the SIGBUS handler, set while a file_map_t is being read. */
+static thread_local sigjmp_buf *volatile map_read_jump;
+static struct sigaction previous_sigbus_action;
+
+static void map_sigbus_handler(int sig, siginfo_t *info, void *context) {
+  if (map_read_jump != nullptr) {
+    siglongjmp(*map_read_jump, 1);
+  }
+  /* The signal was not caused by reading a map, so it is passed to the previous action. The handler
+     stays installed, such that maps read later are still protected. */
+  if (previous_sigbus_action.sa_flags & SA_SIGINFO) {
+    previous_sigbus_action.sa_sigaction(sig, info, context);
+  } else if (previous_sigbus_action.sa_handler != SIG_DFL &&
+             previous_sigbus_action.sa_handler != SIG_IGN) {
+    previous_sigbus_action.sa_handler(sig);
+  } else {
+    // A SIGBUS caused by a fault can not be ignored, so the default action terminates the process.
+    signal(SIGBUS, SIG_DFL);
+    raise(SIGBUS);
+  }
+}
+
+file_map_t::~file_map_t() { munmap(const_cast<char *>(data_), size_); }
+
+bool file_map_t::access(size_t offset, size_t size,
+                        const std::function<void(const char *, size_t)> &process) const {
+  static std::once_flag handler_installed;
+  std::call_once(handler_installed, [] {
+    struct sigaction sa;
+    sa.sa_sigaction = map_sigbus_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGBUS, &sa, &previous_sigbus_action);
+  });
+
+  sigjmp_buf jump;
+  if (sigsetjmp(jump, 1) != 0) {
+    map_read_jump = nullptr;
+    return false;
+  }
+  map_read_jump = &jump;
+  try {
+    process(data_ + offset, size);
+  } catch (...) {
+    map_read_jump = nullptr;
+    throw;
+  }
+  map_read_jump = nullptr;
+  return true;
+}
+
+bool file_map_t::read(size_t offset, size_t size, char *buffer) const {
+  return access(offset, size, [buffer](const char *data, size_t data_size) {
+    memcpy(buffer, data, data_size);
+  });
+}
+
+file_map_t *file_map_t::map(int fd) {
+  struct stat file_info;
+  void *data;
+
+  if (fstat(fd, &file_info) < 0 || !S_ISREG(file_info.st_mode) || file_info.st_size == 0 ||
+      static_cast<uintmax_t>(file_info.st_size) > std::numeric_limits<size_t>::max()) {
+    return nullptr;
+  }
+
+  size_t size = file_info.st_size;
+  if ((data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+    return nullptr;
+  }
+  posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+
+  file_map_t *result = new (std::nothrow) file_map_t(static_cast<const char *>(data), size);
+  if (result == nullptr) {
+    munmap(data, size);
+  }
+  return result;
+}
+
+file_write_wrapper_t::~file_write_wrapper_t() {
+  if (write_calls_ > 0) {
+    lprintf("Wrote %jd bytes in %zd calls (%jd bytes per call)\n",
+            static_cast<intmax_t>(written_size_), write_calls_,
+            static_cast<intmax_t>(written_size_ / write_calls_));
+  }
+}
+
+void file_write_wrapper_t::write_out(const char *data, size_t size) {
+  struct iovec iov[2];
+  int count = 0;
+
+  if (output_fill_ > 0) {
+    iov[count].iov_base = output_.data();
+    iov[count].iov_len = output_fill_;
+    ++count;
+  }
+  if (size > 0) {
+    iov[count].iov_base = const_cast<char *>(data);
+    iov[count].iov_len = size;
+    ++count;
+  }
+
+  struct iovec *next = iov;
+  while (count > 0) {
+    ssize_t result = writev(fd_, next, count);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
+    }
+    ++write_calls_;
+    size_t done = result;
+    while (count > 0 && done >= next->iov_len) {
+      done -= next->iov_len;
+      ++next;
+      --count;
+    }
+    if (count > 0) {
+      next->iov_base = static_cast<char *>(next->iov_base) + done;
+      next->iov_len -= done;
+    }
+  }
+  output_fill_ = 0;
+}
+
+void file_write_wrapper_t::append(const char *data, size_t size) {
+  written_size_ += size;
+  if (fd_ < 0) {
+    return;
+  }
+  if (output_.size() - output_fill_ >= size) {
+    memcpy(output_.data() + output_fill_, data, size);
+    output_fill_ += size;
+    return;
+  }
+  // Pass large blocks to writev directly, rather than copying them through the buffer.
+  write_out(data, size);
+}
+
+void file_write_wrapper_t::flush() {
+  if (fd_ >= 0 && output_fill_ > 0) {
+    write_out(nullptr, 0);
+  }
+}
 
 void file_write_wrapper_t::write(const char *buffer, size_t bytes) {
   std::unique_ptr<char, free_deleter> nfc_output;
   size_t nfc_output_len;
 
-  char transcript_buffer[FILE_BUFFER_SIZE], *transcript_buffer_ptr;
-  const char *buffer_end, *transcript_buffer_end;
+  const char *buffer_end;
   bool imprecise = false;
 
-  // Convert to NFC before writing
-  // FIXME: check return value
-  nfc_output.reset(reinterpret_cast<char *>(u8_normalize(
-      UNINORM_NFC, reinterpret_cast<const uint8_t *>(buffer), bytes, nullptr, &nfc_output_len)));
-  if (handle_ == nullptr) {
-    if (fd_ >= 0 && nosig_write(fd_, nfc_output.get(), nfc_output_len) < 0) {
-      throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
-    }
-    written_size_ += nfc_output_len;
+  // Convert to NFC before writing, unless the text is known to be in NFC already.
+  if (is_nfc_quick(buffer, bytes)) {
+    nfc_output_len = bytes;
+  } else {
+    // FIXME: check return value
+    nfc_output.reset(reinterpret_cast<char *>(u8_normalize(
+        UNINORM_NFC, reinterpret_cast<const uint8_t *>(buffer), bytes, nullptr, &nfc_output_len)));
+    buffer = nfc_output.get();
+  }
+  if (handle_ == nullptr && converter_ == nullptr) {
+    append(buffer, nfc_output_len);
     return;
   }
 
-  transcript_buffer_end = transcript_buffer + FILE_BUFFER_SIZE;
-  buffer = nfc_output.get();
-  buffer_end = nfc_output.get() + nfc_output_len;
+  buffer_end = buffer + nfc_output_len;
 
+  bool need_space = false;
   while (buffer < buffer_end) {
-    transcript_buffer_ptr = transcript_buffer;
-    switch (transcript_from_unicode(handle_, &buffer, buffer_end, &transcript_buffer_ptr,
-                                    transcript_buffer_end, conversion_flags_)) {
+    // Make sure there is room for at least a few characters.
+    if (need_space || output_.size() - output_fill_ < MIN_WRITE_SPACE) {
+      if (fd_ >= 0) {
+        write_out(nullptr, 0);
+      } else {
+        output_fill_ = 0;
+      }
+      need_space = false;
+    }
+    char *output_ptr = output_.data() + output_fill_;
+    const char *output_end = output_.data() + output_.size();
+    transcript_error_t result =
+        converter_ != nullptr
+            ? converter_->from_unicode(&buffer, buffer_end, &output_ptr, output_end,
+                                       conversion_flags_)
+            : transcript_from_unicode(handle_, &buffer, buffer_end, &output_ptr, output_end,
+                                      conversion_flags_);
+    switch (result) {
       case TRANSCRIPT_SUCCESS:
         ASSERT(buffer == buffer_end);
         break;
       case TRANSCRIPT_NO_SPACE:
+        need_space = true;
         break;
       case TRANSCRIPT_FALLBACK:
       case TRANSCRIPT_UNASSIGNED:
@@ -167,13 +463,11 @@ void file_write_wrapper_t::write(const char *buffer, size_t bytes) {
       default:
         throw rw_result_t(rw_result_t::CONVERSION_ERROR);
     }
-    if (transcript_buffer_ptr > transcript_buffer) {
+    size_t produced = output_ptr - (output_.data() + output_fill_);
+    if (produced > 0) {
       conversion_flags_ &= ~TRANSCRIPT_FILE_START;
-      if (fd_ >= 0 &&
-          nosig_write(fd_, transcript_buffer, transcript_buffer_ptr - transcript_buffer) < 0) {
-        throw rw_result_t(rw_result_t::ERRNO_ERROR, errno);
-      }
-      written_size_ += transcript_buffer_ptr - transcript_buffer;
+      output_fill_ += produced;
+      written_size_ += produced;
     }
   }
 
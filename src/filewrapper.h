@@ -15,82 +15,211 @@
 #define FILEWRAPPER_H
 
 #include <cerrno>
+#include <functional>
 #include <string>
+#include <sys/types.h>
 #include <transcript/transcript.h>
 #include <unistd.h>
+#include <vector>
+
+#include "tilde/singlebyte.h"
 
 #define FILE_BUFFER_SIZE 1024
 //~ #define FILE_BUFFER_SIZE 102
-
+/* Size of the output buffer used for writing files. */
+#define WRITE_BUFFER_SIZE (256 * 1024)
+/* Minimum free space in the output buffer before converting more text into it. */
+#define MIN_WRITE_SPACE 64
+/* Minimum block size for reading files. */
+#define MIN_READ_BLOCK_SIZE 4096
+/* Minimum number of input bytes per part when converting in parallel. */
+#define MIN_PARALLEL_CONVERSION_SIZE (64 * 1024)
+/* Maximum number of bytes of UTF-8 produced per byte of input by a single byte encoding. */
+#define MAX_SINGLE_BYTE_EXPANSION 3
+/* Maximum number of bytes passed to append_text at once when loading a mapped file. */
+#define MAP_CHUNK_SIZE (1024 * 1024)
+
+/** Block buffer used for reading files.
+
+    The valid data is the range [start, fill) of the block. Consumed data is skipped by advancing
+    start rather than by moving the remaining data, which is only done once the free space at the
+    end of the block gets small. As the consumers use all but an incomplete character at the end,
+    this means only a few bytes are ever moved.
+*/
 class buffer_t {
  protected:
-  int fill = 0;
-  char buffer[FILE_BUFFER_SIZE];
+  std::vector<char> buffer;
+  size_t start = 0, fill = 0;
+
+  /** Mark @p used bytes as consumed, and make room at the end of the block.
+      @return The number of bytes that can be added at the end of the block. */
+  size_t consume(size_t used);
 
  public:
-  buffer_t() = default;
+  explicit buffer_t(size_t block_size) : buffer(block_size) {}
   virtual ~buffer_t() = default;
-  const char *get_buffer() { return buffer; }
-  virtual int get_fill() const { return fill; }
-  virtual char operator[](int idx) const { return buffer[idx]; }
-  virtual bool fill_buffer(int used) = 0;
+  const char *get_buffer() const { return buffer.data() + start; }
+  size_t get_fill() const { return fill - start; }
+  virtual bool fill_buffer(size_t used) = 0;
 };
 
 class read_buffer_t : public buffer_t {
  private:
   int fd;
+  off_t bytes_read = 0;
 
  public:
-  explicit read_buffer_t(int _fd) : fd(_fd) {}
-  bool fill_buffer(int used) override;
+  read_buffer_t(int _fd, size_t block_size) : buffer_t(block_size), fd(_fd) {}
+  bool fill_buffer(size_t used) override;
+  off_t get_bytes_read() const { return bytes_read; }
 };
 
 class transcript_buffer_t : public buffer_t {
  private:
   buffer_t *wrapped_buffer;
-  int buffer_index, conversion_flags;
+  size_t buffer_index;
+  int conversion_flags;
   transcript_t *handle;
+  /* Built-in converter, used instead of handle if available. As the built-in converters are
+     stateless, the input can be split at any point and converted in parallel. */
+  const single_byte_converter_t *converter;
   bool at_eof;
+  std::vector<std::vector<char>> parallel_output;
 
- public:
-  transcript_buffer_t(buffer_t *_buffer, transcript_t *_handle)
-      : wrapped_buffer(_buffer),
+  transcript_error_t convert(const char **inbuf, const char *inbuflimit, char **outbuf,
+                             const char *outbuflimit, int flags);
+  bool convert_parallel();
+
+  transcript_buffer_t(buffer_t *_buffer, transcript_t *_handle,
+                      const single_byte_converter_t *_converter, size_t block_size,
+                      size_t parallel_parts)
+      : buffer_t(block_size),
+        wrapped_buffer(_buffer),
         buffer_index(0),
         conversion_flags(TRANSCRIPT_FILE_START | TRANSCRIPT_ALLOW_PRIVATE_USE),
         handle(_handle),
-        at_eof(false) {}
+        converter(_converter),
+        at_eof(false),
+        parallel_output(parallel_parts) {}
+
+ public:
+  transcript_buffer_t(buffer_t *_buffer, transcript_t *_handle, size_t block_size)
+      : transcript_buffer_t(_buffer, _handle, nullptr, block_size, 1) {}
+  transcript_buffer_t(buffer_t *_buffer, const single_byte_converter_t *_converter,
+                      size_t block_size, size_t parallel_parts)
+      : transcript_buffer_t(_buffer, nullptr, _converter, block_size, parallel_parts) {}
   ~transcript_buffer_t() override;
-  bool fill_buffer(int used) override;
+  bool fill_buffer(size_t used) override;
 };
 
 class file_read_wrapper_t {
  private:
   buffer_t *buffer;
+  read_buffer_t *read_buffer;
 
  public:
-  explicit file_read_wrapper_t(int fd, transcript_t *handle = nullptr);
+  /** Create a new file_read_wrapper_t.
+      @param fd The file descriptor to read from.
+      @param handle The converter to use, or @c nullptr if the input is UTF-8.
+      @param block_size The size of the blocks used for reading and conversion.
+  */
+  file_read_wrapper_t(int fd, transcript_t *handle, size_t block_size);
+  /** Create a new file_read_wrapper_t which uses a built-in converter.
+      @param parallel_parts The maximum number of parts the input is split into for converting in
+          parallel.
+  */
+  file_read_wrapper_t(int fd, const single_byte_converter_t *converter, size_t block_size,
+                      size_t parallel_parts);
   ~file_read_wrapper_t();
+  /** Create a file_read_wrapper_t which reads UTF-8 from @p fd starting at @p offset, and reports
+      invalid sequences. Throws an rw_result_t on failure. */
+  static file_read_wrapper_t *open_validating(int fd, off_t offset, size_t block_size);
   const char *get_buffer();
-  int get_fill();
-  bool fill_buffer(int used);
+  size_t get_fill();
+  bool fill_buffer(size_t used);
+  /** Get the number of bytes read from the file so far. */
+  off_t get_bytes_read() const;
+};
+
+/** Read-only mapping of a complete regular file.
+
+    Used to load UTF-8 files without copying them through the buffer_t chain. The data is
+    validated while it is read; see file_buffer_t::process_map_block.
+
+    If the file is truncated while it is mapped, accessing the pages beyond its new end raises
+    SIGBUS. The data must therefore only be accessed through access or read, which catch this.
+*/
+class file_map_t {
+ private:
+  const char *data_;
+  size_t size_;
+
+  file_map_t(const char *data, size_t size) : data_(data), size_(size) {}
+
+ public:
+  ~file_map_t();
+  size_t size() const { return size_; }
+  /** Call @p process with the @p size bytes at @p offset, directly from the map. If the file was
+      truncated, @p process is interrupted when it accesses the missing data, without unwinding its
+      stack. It must therefore only copy the data into objects that remain consistent at any
+      point, and may leak memory it allocated when interrupted.
+      @return @c false if @p process was interrupted, because the file was truncated. */
+  bool access(size_t offset, size_t size,
+              const std::function<void(const char *, size_t)> &process) const;
+  /** Copy @p size bytes at @p offset into @p buffer.
+      @return @c false if the data is no longer available, because the file was truncated. */
+  bool read(size_t offset, size_t size, char *buffer) const;
+
+  /** Map the file opened as @p fd.
+      @return @c nullptr if the file can not be mapped, in which case the caller should fall back to
+          reading through file_read_wrapper_t. */
+  static file_map_t *map(int fd);
 };
 
+/** Writer which normalizes text to NFC and optionally converts it.
+
+    The output is collected in a buffer, which is written with writev together with any data that
+    does not fit in it. This avoids a system call per line. The buffer must be written with flush
+    before the file is truncated or closed.
+*/
 class file_write_wrapper_t {
  private:
   int fd_, conversion_flags_;
   transcript_t *handle_;
+  const single_byte_converter_t *converter_;
   off_t written_size_ = 0;
+  std::vector<char> output_;
+  size_t output_fill_ = 0;
+  // Number of write system calls made, for the statistics in the debug log.
+  size_t write_calls_ = 0;
+
+  /** Write the output buffer, followed by @p size bytes from @p data. */
+  void write_out(const char *data, size_t size);
+  /** Add @p size bytes of converted data to the output. */
+  void append(const char *data, size_t size);
 
  public:
-  explicit file_write_wrapper_t(int fd, transcript_t *handle = nullptr)
+  /** Create a new file_write_wrapper_t.
+      @param fd The file descriptor to write to, or -1 to only convert and count the output.
+      @param handle The converter to use.
+      @param converter The built-in converter to use instead of @p handle. If both are @c nullptr,
+          the output is UTF-8.
+  */
+  explicit file_write_wrapper_t(int fd, transcript_t *handle = nullptr,
+                                const single_byte_converter_t *converter = nullptr)
       : fd_(fd),
         conversion_flags_(TRANSCRIPT_FILE_START | TRANSCRIPT_ALLOW_PRIVATE_USE),
-        handle_(handle) {
+        handle_(handle),
+        converter_(converter),
+        output_(fd >= 0 ? WRITE_BUFFER_SIZE : FILE_BUFFER_SIZE) {
     if (handle_) {
       transcript_from_unicode_reset(handle_);
     }
   }
+  ~file_write_wrapper_t();
   void write(const char *buffer, size_t bytes);
+  /** Write any buffered output to the file. Throws an rw_result_t on failure. */
+  void flush();
 
   // Get the state of the conversion flags. This may have changed from the initial setting by
   // imprecise conversions.
@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "tilde/highlightcache.h"
+#include "tilde/log.h"
+#include "tilde/util.h"
+
+namespace {
+
+struct cached_highlight_t {
+  std::string lang_file;
+  t3_highlight_t *highlight;
+  int references;
+};
+
+// Only a handful of languages is in use at any time, so a linear search is fast enough.
+std::vector<cached_highlight_t> cached_highlights;
+
+}  // namespace
+
+t3_highlight_t *load_highlight(const char *lang_file, t3_highlight_error_t *error) {
+  for (cached_highlight_t &cached : cached_highlights) {
+    if (cached.lang_file == lang_file) {
+      ++cached.references;
+      return cached.highlight;
+    }
+  }
+
+  t3_highlight_t *highlight =
+      t3_highlight_load(lang_file, map_highlight, nullptr,
+                        T3_HIGHLIGHT_UTF8 | T3_HIGHLIGHT_USE_PATH |
+/* If T3_HIGHLIGHT_USE_SCOPE is not available, all the other code is still compatible, so we simply
+   omit the flag here. */
+#ifdef T3_HIGHLIGHT_USE_SCOPE
+                            T3_HIGHLIGHT_USE_SCOPE |
+#endif
+                            (error != nullptr ? T3_HIGHLIGHT_VERBOSE_ERROR : 0),
+                        error);
+  if (highlight == nullptr) {
+    return nullptr;
+  }
+  lprintf("Loaded highlighting definition %s\n", lang_file);
+  cached_highlights.push_back({lang_file, highlight, 1});
+  return highlight;
+}
+
+void release_highlight(t3_highlight_t *highlight) {
+  if (highlight == nullptr) {
+    return;
+  }
+  auto iter = std::find_if(
+      cached_highlights.begin(), cached_highlights.end(),
+      [highlight](const cached_highlight_t &cached) { return cached.highlight == highlight; });
+  if (iter == cached_highlights.end()) {
+    t3_highlight_free(highlight);
+    return;
+  }
+  if (--iter->references == 0) {
+    lprintf("Freeing highlighting definition %s\n", iter->lang_file.c_str());
+    t3_highlight_free(iter->highlight);
+    cached_highlights.erase(iter);
+  }
+}
@@ -0,0 +1,17 @@
+#ifndef HIGHLIGHTCACHE_H
+#define HIGHLIGHTCACHE_H
+
+#include <t3highlight/highlight.h>
+
+/** Returns the highlighting definition in @p lang_file, which is only loaded if it is not already
+    in use. The definition is shared by all its users, which each need their own
+    t3_highlight_match_t, and must be released with release_highlight instead of
+    t3_highlight_free.
+    @param error Set to the error if loading fails. May be @c nullptr.
+    @return The definition, or @c nullptr if loading failed. */
+t3_highlight_t *load_highlight(const char *lang_file, t3_highlight_error_t *error = nullptr);
+
+/** Release a definition returned by load_highlight. It is freed once all users released it. */
+void release_highlight(t3_highlight_t *highlight);
+
+#endif
@@ -0,0 +1,221 @@
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <memory>
+#include <t3config/config.h>
+#include <unistd.h>
+#include <utility>
+
+#include "tilde/backupstore.h"
+#include "tilde/highlightcheckpoints.h"
+#include "tilde/log.h"
+#include "tilde/util.h"
+
+#define CHECKPOINT_MAGIC "tilde-highlight 2"
+
+/** Read a line from @p file into @p line, without the trailing newline. */
+static bool read_line(FILE *file, std::string *line) {
+  char *buffer = nullptr;
+  size_t size = 0;
+  ssize_t length = getline(&buffer, &size, file);
+  if (length < 0) {
+    free(buffer);
+    return false;
+  }
+  if (length > 0 && buffer[length - 1] == '\n') {
+    --length;
+  }
+  line->assign(buffer, length);
+  free(buffer);
+  return true;
+}
+
+/** Read the size and modification time written by write_version from @p file, and check that they
+    match @p file_info. */
+static bool read_version(FILE *file, const char *prefix, const struct stat &file_info) {
+  std::string format = std::string(prefix) + "size %jd\n" + prefix + "mtime %jd %ld\n";
+  intmax_t size, mtime_sec;
+  long mtime_nsec;
+  return fscanf(file, format.c_str(), &size, &mtime_sec, &mtime_nsec) == 3 &&
+         size == file_info.st_size && mtime_sec == file_info.st_mtim.tv_sec &&
+         mtime_nsec == file_info.st_mtim.tv_nsec;
+}
+
+/** Write the size and modification time in @p file_info to @p file. */
+static void write_version(FILE *file, const char *prefix, const struct stat &file_info) {
+  fprintf(file, "%ssize %jd\n%smtime %jd %ld\n", prefix, static_cast<intmax_t>(file_info.st_size),
+          prefix, static_cast<intmax_t>(file_info.st_mtim.tv_sec),
+          static_cast<long>(file_info.st_mtim.tv_nsec));
+}
+
+/** Parse a stored state, which must be HIGHLIGHT_CHECKPOINT_NONE or the initial state. */
+static bool parse_state(const std::string &line, int *state) {
+  char *end;
+  errno = 0;
+  long value = strtol(line.c_str(), &end, 10);
+  if (line.empty() || *end != 0 || errno != 0 || value < HIGHLIGHT_CHECKPOINT_NONE ||
+      value > 0) {
+    return false;
+  }
+  *state = value;
+  return true;
+}
+
+/** Find the language file @p name the same way t3highlight does when loading it with
+    T3_HIGHLIGHT_USE_PATH, and store its information in @p info. Names without a slash are looked
+    up in the libt3highlight directory in the XDG data home, and then in the system data
+    directories, one of which contains the files installed with t3highlight. */
+static bool stat_lang_file(const std::string &name, struct stat *info) {
+  if (name.find('/') != std::string::npos) {
+    return stat(name.c_str(), info) == 0;
+  }
+
+  std::vector<std::string> dirs;
+  std::unique_ptr<char, decltype(&free)> xdg_path(
+      t3_config_xdg_get_path(T3_CONFIG_XDG_DATA_HOME, "libt3highlight", 0), free);
+  if (xdg_path != nullptr) {
+    dirs.push_back(xdg_path.get());
+  }
+  const char *data_dirs = getenv("XDG_DATA_DIRS");
+  if (data_dirs == nullptr || *data_dirs == 0) {
+    data_dirs = "/usr/local/share:/usr/share";
+  }
+  for (const char *dir = data_dirs; *dir != 0;) {
+    const char *end = strchrnul(dir, ':');
+    if (end != dir) {
+      dirs.push_back(std::string(dir, end - dir) + "/libt3highlight");
+    }
+    dir = *end == ':' ? end + 1 : end;
+  }
+
+  for (const std::string &dir : dirs) {
+    if (stat((dir + "/" + name).c_str(), info) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Remove the oldest files from @p dir, until at most @p max_files remain. */
+static void remove_old_files(const std::string &dir, size_t max_files) {
+  std::unique_ptr<DIR, int (*)(DIR *)> dir_handle(opendir(dir.c_str()), closedir);
+  if (dir_handle == nullptr) {
+    return;
+  }
+  std::vector<std::pair<int64_t, std::string>> files;
+  while (struct dirent *entry = readdir(dir_handle.get())) {
+    struct stat file_info;
+    std::string path = dir + "/" + entry->d_name;
+    if (entry->d_name[0] != '.' && stat(path.c_str(), &file_info) == 0 &&
+        S_ISREG(file_info.st_mode)) {
+      files.emplace_back(static_cast<int64_t>(file_info.st_mtim.tv_sec) * 1000000000 +
+                             file_info.st_mtim.tv_nsec,
+                         std::move(path));
+    }
+  }
+  if (files.size() <= max_files) {
+    return;
+  }
+  std::sort(files.begin(), files.end());
+  for (size_t i = 0; i < files.size() - max_files; ++i) {
+    unlink(files[i].second.c_str());
+  }
+}
+
+std::string highlight_checkpoint_dir() {
+  std::unique_ptr<char, decltype(&free)> xdg_path(
+      t3_config_xdg_get_path(T3_CONFIG_XDG_CACHE_HOME, "tilde", 0), free);
+  if (xdg_path == nullptr) {
+    return std::string();
+  }
+  return std::string(xdg_path.get()) + "/highlight";
+}
+
+bool read_highlight_checkpoints(const std::string &dir, const std::string &name,
+                                const struct stat &file_info,
+                                highlight_checkpoints_t *checkpoints) {
+  std::string path = dir + "/" + sha256_hex(name.data(), name.size());
+  std::unique_ptr<FILE, fclose_deleter> file(fopen(path.c_str(), "r"));
+  if (file == nullptr) {
+    return false;
+  }
+
+  std::string line, stored_name;
+  intmax_t interval;
+  struct stat lang_info;
+  // The state numbers are only meaningful for the version of the language file they were computed
+  // with.
+  if (!read_line(file.get(), &line) || line != CHECKPOINT_MAGIC ||
+      !read_line(file.get(), &stored_name) || stored_name != name ||
+      !read_version(file.get(), "", file_info) ||
+      !read_line(file.get(), &checkpoints->lang_file) ||
+      !stat_lang_file(checkpoints->lang_file, &lang_info) ||
+      !read_version(file.get(), "lang ", lang_info) ||
+      fscanf(file.get(), "interval %jd\n", &interval) != 1 || interval <= 0) {
+    return false;
+  }
+  checkpoints->interval = interval;
+  checkpoints->states.clear();
+  while (read_line(file.get(), &line)) {
+    int state;
+    if (!parse_state(line, &state)) {
+      lprintf("Invalid highlight checkpoint state '%s' for %s\n", line.c_str(), name.c_str());
+      checkpoints->states.clear();
+      return false;
+    }
+    checkpoints->states.push_back(state);
+  }
+  lprintf("Read %zd highlight checkpoints for %s\n", checkpoints->states.size(), name.c_str());
+  return true;
+}
+
+bool write_highlight_checkpoints(const std::string &dir, const std::string &name,
+                                 const struct stat &file_info,
+                                 const highlight_checkpoints_t &checkpoints, size_t max_files) {
+  struct stat lang_info;
+  if (!stat_lang_file(checkpoints.lang_file, &lang_info)) {
+    return false;
+  }
+  for (size_t slash = dir.find('/', 1); slash != std::string::npos;
+       slash = dir.find('/', slash + 1)) {
+    mkdir(dir.substr(0, slash).c_str(), 0700);
+  }
+  if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST) {
+    return false;
+  }
+
+  // The file is written under a temporary name and renamed, such that concurrent readers never see
+  // a partially written file.
+  std::string path = dir + "/" + sha256_hex(name.data(), name.size());
+  std::string temp_path = path + ".XXXXXX";
+  int fd = mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    return false;
+  }
+  std::unique_ptr<FILE, fclose_deleter> file(fdopen(fd, "w"));
+  if (file == nullptr) {
+    close(fd);
+    unlink(temp_path.c_str());
+    return false;
+  }
+
+  fprintf(file.get(), "%s\n%s\n", CHECKPOINT_MAGIC, name.c_str());
+  write_version(file.get(), "", file_info);
+  fprintf(file.get(), "%s\n", checkpoints.lang_file.c_str());
+  write_version(file.get(), "lang ", lang_info);
+  fprintf(file.get(), "interval %jd\n", static_cast<intmax_t>(checkpoints.interval));
+  for (int state : checkpoints.states) {
+    fprintf(file.get(), "%d\n", state);
+  }
+  if (fflush(file.get()) != 0 || ferror(file.get()) ||
+      rename(temp_path.c_str(), path.c_str()) < 0) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  remove_old_files(dir, max_files);
+  return true;
+}
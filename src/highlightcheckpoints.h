@@ -0,0 +1,43 @@
+#ifndef HIGHLIGHTCHECKPOINTS_H
+#define HIGHLIGHTCHECKPOINTS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+/* Stored instead of a state for a checkpoint of which the state is not known. */
+#define HIGHLIGHT_CHECKPOINT_NONE (-1)
+
+/** Highlighting states at regularly spaced lines of a file. */
+struct highlight_checkpoints_t {
+  // Language file of the highlighting the states belong to, as returned by
+  // t3_highlight_get_langfile. Names without a slash are found in the t3highlight search path.
+  std::string lang_file;
+  // Number of lines between checkpoints.
+  int64_t interval = 0;
+  // The highlighting state at the start of line k * interval, for each k. Only the initial state 0
+  // is stored, other states are written as HIGHLIGHT_CHECKPOINT_NONE: t3highlight does not report
+  // which states are static, and numbers dynamically created states in the order it encounters
+  // them, so other state numbers may mean something else when the file is opened again.
+  std::vector<int> states;
+};
+
+/** Returns the default directory for the checkpoint files, in the XDG cache directory. */
+std::string highlight_checkpoint_dir();
+
+/** Read the checkpoints stored in @p dir for the file @p name. The checkpoints are only used if
+    they were stored when the file had the size and modification time in @p file_info, and the
+    language file has the same size and modification time as when they were stored. Returns
+    @c false if any of the states is invalid. */
+bool read_highlight_checkpoints(const std::string &dir, const std::string &name,
+                                const struct stat &file_info, highlight_checkpoints_t *checkpoints);
+
+/** Store @p checkpoints in @p dir for the file @p name, which has the size and modification time
+    in @p file_info. Only the @p max_files most recently written checkpoint files are kept. */
+bool write_highlight_checkpoints(const std::string &dir, const std::string &name,
+                                 const struct stat &file_info,
+                                 const highlight_checkpoints_t &checkpoints, size_t max_files);
+
+#endif
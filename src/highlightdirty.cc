@@ -0,0 +1,71 @@
+#include <algorithm>
+
+#include "tilde/highlightdirty.h"
+
+/* Number of lines highlighted between checks of the time. */
+#define HIGHLIGHT_CLOCK_INTERVAL 16
+
+void highlight_dirty_range_t::mark(text_pos_t _first, text_pos_t _last) {
+  // The end state of the last line does not matter, as no line follows it.
+  _last = std::min(_last, lines - 2);
+  if (_first > _last) {
+    return;
+  } else if (empty()) {
+    first = _first;
+    last = _last;
+  } else {
+    first = std::min(first, _first);
+    last = std::max(last, _last);
+  }
+}
+
+void highlight_dirty_range_t::lines_changed(text_pos_t line, text_pos_t new_lines) {
+  text_pos_t delta = new_lines - lines;
+  lines = new_lines;
+  if (delta == 0) {
+    return;
+  }
+  if (!empty()) {
+    if (first > line) {
+      first = std::max(line, first + delta);
+    }
+    if (last >= line) {
+      last = std::min(std::max(line, last + delta), lines - 2);
+    }
+  }
+  if (delta > 0) {
+    // Whether line is the first inserted line or the line before it depends on the change.
+    mark(line, std::min(line + delta, new_lines - 1));
+  }
+}
+
+bool highlight_dirty_range_t::propagate(text_pos_t line,
+                                        std::chrono::steady_clock::time_point deadline,
+                                        text_pos_t *valid,
+                                        const std::function<bool(text_pos_t)> &update_line) {
+  text_pos_t i = *valid >= 0 ? *valid + 1 : 1;
+  while (i <= line) {
+    if (i - 1 > last) {
+      // None of the remaining lines is dirty, so their start states are correct.
+      i = line + 1;
+      break;
+    } else if (i - 1 < first) {
+      i = std::min(first + 1, line + 1);
+      continue;
+    }
+    if (i % HIGHLIGHT_CLOCK_INTERVAL == 0 && std::chrono::steady_clock::now() >= deadline) {
+      break;
+    }
+    bool next_dirty = update_line(i);
+    // All lines before i are clean now, if the range was processed from its start.
+    if (i - 1 == first) {
+      first = i;
+    }
+    if (next_dirty && i > last && i < lines - 1) {
+      last = i;
+    }
+    ++i;
+  }
+  *valid = i - 1;
+  return i > line;
+}
@@ -0,0 +1,40 @@
+#ifndef HIGHLIGHTDIRTY_H
+#define HIGHLIGHTDIRTY_H
+
+#include <chrono>
+#include <functional>
+#include <t3widget/util.h>
+
+using t3widget::text_pos_t;
+
+/** Tracks the range of lines of which the highlighting state at the end may differ from the start
+    state stored in the next line. The start states of the lines outside this range are correct,
+    such that propagating the highlighting can skip them.
+*/
+class highlight_dirty_range_t {
+ private:
+  // The dirty lines lie between first and last, inclusive. The range is empty if first > last.
+  text_pos_t first = 0, last = -1;
+  // Number of lines of the text, to determine the number of lines inserted or deleted by a change.
+  text_pos_t lines = 1;
+
+ public:
+  /** Mark the lines from @p first to @p last as possibly dirty. The last line of the text is never
+      included, as no line follows it. */
+  void mark(text_pos_t first, text_pos_t last);
+  /** Move the range after lines were inserted or deleted at @p line, such that the text now has
+      @p new_lines lines. The inserted lines are marked. */
+  void lines_changed(text_pos_t line, text_pos_t new_lines);
+  bool empty() const { return first > last; }
+
+  /** Compute the start states of the lines after @p *valid up to @p line, stopping early when
+      @p deadline has passed. @p valid is updated to the last line that was computed.
+      @param update_line Called for each line i in the range of which line i - 1 may be dirty. It
+          must store the end state of line i - 1 as the start state of line i if line i - 1 is
+          dirty, mark line i - 1 clean, and return whether line i is dirty.
+      @return @c true if the start states up to @p line are valid. */
+  bool propagate(text_pos_t line, std::chrono::steady_clock::time_point deadline,
+                 text_pos_t *valid, const std::function<bool(text_pos_t)> &update_line);
+};
+
+#endif
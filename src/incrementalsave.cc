@@ -0,0 +1,27 @@
+#include "tilde/incrementalsave.h"
+#include "tilde/nfccheck.h"
+
+text_pos_t first_changed_line(rewrap_type_t type, text_pos_t line) {
+  switch (type) {
+    case rewrap_type_t::REWRAP_ALL:
+      return 0;
+    case rewrap_type_t::INSERT_LINES:
+    case rewrap_type_t::DELETE_LINES:
+      return line > 0 ? line - 1 : 0;
+    default:
+      return line;
+  }
+}
+
+bool incremental_save_offset(const std::function<const std::string &(text_pos_t)> &line_data,
+                             text_pos_t unmodified_lines, off_t file_size, off_t *offset) {
+  *offset = 0;
+  for (text_pos_t i = 0; i < unmodified_lines; i++) {
+    const std::string &data = line_data(i);
+    if (!is_nfc_quick(data.data(), data.size())) {
+      return false;
+    }
+    *offset += data.size() + (i == 0 ? 0 : 1);
+  }
+  return *offset <= file_size;
+}
@@ -0,0 +1,27 @@
+#ifndef INCREMENTALSAVE_H
+#define INCREMENTALSAVE_H
+
+#include <functional>
+#include <string>
+#include <sys/types.h>
+#include <t3widget/widget.h>
+
+using t3widget::rewrap_type_t;
+using t3widget::text_pos_t;
+
+/** Returns the first line changed by the change reported through rewrap_required as @p type and
+    @p line. Lines are inserted or deleted at @p line by splitting or joining the line before it,
+    which therefore changes as well. */
+text_pos_t first_changed_line(rewrap_type_t type, text_pos_t line);
+
+/** Computes the offset in the file at which an incremental save starts writing, if the first
+    @p unmodified_lines lines are kept as they are. The offset is the start of the newline preceding
+    the first line that is written, as that is written with the line.
+    @param line_data Returns the data of the line with the given index.
+    @param file_size The size of the file on disk.
+    @return @c false if the lines can not be kept, because they are not in NFC and would be
+        normalized when saving, or because they do not fit in the file. */
+bool incremental_save_offset(const std::function<const std::string &(text_pos_t)> &line_data,
+                             text_pos_t unmodified_lines, off_t file_size, off_t *offset);
+
+#endif
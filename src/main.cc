@@ -47,6 +47,7 @@ save_as_dialog_t *save_as_dialog;
 message_dialog_t *close_confirm_dialog;
 message_dialog_t *error_dialog;
 open_recent_dialog_t *open_recent_dialog;
+restore_backup_dialog_t *restore_backup_dialog;
 encoding_dialog_t *encoding_dialog;
 message_dialog_t *preserve_bom_dialog;
 character_details_dialog_t *character_details_dialog;
@@ -123,6 +124,8 @@ main_t::main_t() {
   panel->insert_item(nullptr, "_Close", "^W", action_id_t::FILE_CLOSE);
   panel->insert_item(nullptr, "_Save", "^S", action_id_t::FILE_SAVE);
   panel->insert_item(nullptr, "Save _As...", "", action_id_t::FILE_SAVE_AS);
+  panel->insert_item(nullptr, "Save A_ll", "", action_id_t::FILE_SAVE_ALL);
+  panel->insert_item(nullptr, "Restore _Backup...", "", action_id_t::FILE_RESTORE_BACKUP);
   panel->insert_separator();
   panel->insert_item(nullptr, "Re_draw Screen", "", action_id_t::FILE_REPAINT);
   panel->insert_item(nullptr, "S_uspend", "", action_id_t::FILE_SUSPEND);
@@ -233,6 +236,9 @@ main_t::main_t() {
   open_recent_dialog = new open_recent_dialog_t(11, window.get_width() - 4);
   open_recent_dialog->center_over(this);
 
+  restore_backup_dialog = new restore_backup_dialog_t(11, window.get_width() - 4);
+  restore_backup_dialog->center_over(this);
+
   about_dialog = t3widget::make_unique<message_dialog_t>(
       45, std::string("About"), std::initializer_list<string_view>{"Close"});
   about_dialog->center_over(this);
@@ -296,6 +302,7 @@ bool main_t::set_size(optint height, optint width) {
   result &= open_file_dialog->set_size(height.value() - 4, width.value() - 4);
   result &= save_as_dialog->set_size(height.value() - 4, width.value() - 4);
   result &= open_recent_dialog->set_size(11, width.value() - 4);
+  result &= restore_backup_dialog->set_size(11, width.value() - 4);
   result &=
       encoding_dialog->set_size(std::min(height.value() - 8, 16), std::min(width.value() - 8, 72));
   result &= highlight_dialog->set_size(height.value() - 4, None);
@@ -355,9 +362,16 @@ void main_t::menu_activated(int id) {
       save_as_process_t::execute(bind_front(&main_t::save_as_done, this),
                                  get_current()->get_text());
       break;
+    case action_id_t::FILE_SAVE_ALL:
+      save_all_process_t::execute(stepped_process_t::ignore_result);
+      break;
     case action_id_t::FILE_OPEN_RECENT:
       open_recent_process_t::execute(bind_front(&main_t::switch_to_new_buffer, this));
       break;
+    case action_id_t::FILE_RESTORE_BACKUP:
+      restore_backup_process_t::execute(bind_front(&main_t::switch_to_new_buffer, this),
+                                        get_current()->get_text());
+      break;
     case action_id_t::FILE_REPAINT:
       t3widget::redraw();
       break;
@@ -468,7 +482,7 @@ void main_t::menu_activated(int id) {
         file_buffer_t *text = widget->get_text();
         edit_windows.erase(widget.get());
         widget.reset();
-        if (text->get_name().empty() && !text->is_modified()) {
+        if (text->get_name().empty() && !text->is_modified() && !text->is_saving()) {
           delete text;
         }
       }
@@ -553,7 +567,7 @@ void main_t::switch_to_new_buffer(stepped_process_t *process) {
   get_current()->set_text(buffer);
   // FIXME: buffer should not be closed if the user specifically created it by asking for a new
   // file!
-  if (text->get_name().empty() && !text->is_modified()) {
+  if (text->get_name().empty() && !text->is_modified() && !text->is_saving()) {
     delete text;
   }
 }
@@ -600,17 +614,7 @@ void main_t::set_misc_options() {
 }
 
 void main_t::set_highlight(t3_highlight_t *highlight, const char *name) {
-  get_current()->get_text()->set_highlight(highlight);
-  if (name == nullptr) {
-    get_current()->get_text()->set_line_comment(nullptr);
-  } else {
-    std::map<std::string, std::string>::iterator iter = option.line_comment_map.find(name);
-    if (iter == option.line_comment_map.end()) {
-      get_current()->get_text()->set_line_comment(nullptr);
-    } else {
-      get_current()->get_text()->set_line_comment(iter->second.c_str());
-    }
-  }
+  get_current()->get_text()->set_highlight(highlight, name);
   get_current()->force_redraw();
 }
 
@@ -894,6 +898,7 @@ int main(int argc, char *argv[]) {
   delete close_confirm_dialog;
   delete error_dialog;
   delete open_recent_dialog;
+  delete restore_backup_dialog;
   delete encoding_dialog;
   delete main_window;
   delete preserve_bom_dialog;
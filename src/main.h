@@ -20,6 +20,7 @@ using namespace t3widget;
 #include "tilde/dialogs/characterdetailsdialog.h"
 #include "tilde/dialogs/encodingdialog.h"
 #include "tilde/dialogs/openrecentdialog.h"
+#include "tilde/dialogs/restorebackupdialog.h"
 
 extern message_dialog_t *continue_abort_dialog;
 extern open_file_dialog_t *open_file_dialog;
@@ -27,6 +28,7 @@ extern save_as_dialog_t *save_as_dialog;
 extern message_dialog_t *close_confirm_dialog;
 extern message_dialog_t *error_dialog;
 extern open_recent_dialog_t *open_recent_dialog;
+extern restore_backup_dialog_t *restore_backup_dialog;
 extern encoding_dialog_t *encoding_dialog;
 extern message_dialog_t *preserve_bom_dialog;
 extern character_details_dialog_t *character_details_dialog;
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+
+#include "tilde/nfccheck.h"
+#include "tilde/utf8scan.h"
+
+struct nfc_check_range_t {
+  uint32_t first, last;
+  uint8_t combining_class;
+  // Whether the NFC_Quick_Check value is Yes.
+  bool quick_check_yes;
+};
+
+#include "tilde/nfcchecktables.h"
+
+bool is_nfc_quick(const char *data, size_t size) {
+  const uint8_t *text = reinterpret_cast<const uint8_t *>(data);
+  uint8_t last_combining_class = 0;
+  size_t pos = 0;
+
+  while (pos < size) {
+    if (text[pos] < 0x80) {
+      pos += ascii_prefix_length(data + pos, size - pos);
+      last_combining_class = 0;
+      continue;
+    }
+
+    uint8_t lead = text[pos];
+    uint32_t codepoint;
+    size_t length;
+    if (lead >= 0xC2 && lead < 0xE0) {
+      codepoint = lead & 0x1F;
+      length = 2;
+    } else if (lead >= 0xE0 && lead < 0xF0) {
+      codepoint = lead & 0x0F;
+      length = 3;
+    } else if (lead >= 0xF0 && lead < 0xF5) {
+      codepoint = lead & 0x07;
+      length = 4;
+    } else {
+      return false;
+    }
+    if (size - pos < length) {
+      return false;
+    }
+    // Reject overlong forms, surrogates and code points above U+10FFFF.
+    uint8_t next = text[pos + 1];
+    if ((lead == 0xE0 && next < 0xA0) || (lead == 0xED && next >= 0xA0) ||
+        (lead == 0xF0 && next < 0x90) || (lead == 0xF4 && next >= 0x90)) {
+      return false;
+    }
+    for (size_t i = 1; i < length; ++i) {
+      if ((text[pos + i] & 0xC0) != 0x80) {
+        return false;
+      }
+      codepoint = (codepoint << 6) | (text[pos + i] & 0x3F);
+    }
+    pos += length;
+
+    if (codepoint < 0x300) {
+      last_combining_class = 0;
+      continue;
+    }
+    const nfc_check_range_t *range = std::upper_bound(
+        std::begin(nfc_check_ranges), std::end(nfc_check_ranges), codepoint,
+        [](uint32_t value, const nfc_check_range_t &item) { return value < item.first; });
+    if (range == nfc_check_ranges || (--range)->last < codepoint) {
+      last_combining_class = 0;
+      continue;
+    }
+    if (!range->quick_check_yes ||
+        (range->combining_class != 0 && last_combining_class > range->combining_class)) {
+      return false;
+    }
+    last_combining_class = range->combining_class;
+  }
+  return true;
+}
@@ -0,0 +1,14 @@
+#ifndef NFCCHECK_H
+#define NFCCHECK_H
+
+#include <cstddef>
+
+/** Check whether UTF-8 text is known to be in Normalization Form C, without normalizing it.
+
+    This implements the NFC_Quick_Check algorithm from UAX #15, with a vectorized test for runs of
+    ASCII. A result of @c false means the text may need normalization, which includes the cases
+    where the quick check answers Maybe, and text that is not valid UTF-8.
+*/
+bool is_nfc_quick(const char *data, size_t size);
+
+#endif
@@ -15,6 +15,7 @@
 #include <chrono>
 #include <cstring>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "tilde/filebuffer.h"
@@ -122,7 +123,14 @@ file_buffer_t *open_files_t::previous_buffer(file_buffer_t *start) {
 recent_file_info_t::recent_file_info_t(const file_buffer_t *file)
     : recent_file_info_t(file->get_name(), file->get_encoding(), file->get_cursor(),
                          file->get_behavior_parameters()->get_top_left(),
-                         static_cast<int64_t>(std::time(nullptr))) {}
+                         static_cast<int64_t>(std::time(nullptr))) {
+  struct stat file_info;
+  const char *lang_file = file->get_highlight_lang_file();
+  if (lang_file != nullptr && !file->get_highlight_name().empty() &&
+      stat(name.c_str(), &file_info) == 0) {
+    set_highlight(lang_file, file->get_highlight_name(), file_info.st_size, file_info.st_mtime);
+  }
+}
 
 recent_file_info_t::recent_file_info_t(string_view _name, string_view _encoding,
                                        text_coordinate_t _position, text_coordinate_t _top_left,
@@ -138,6 +146,20 @@ const std::string &recent_file_info_t::get_encoding() const { return encoding; }
 text_coordinate_t recent_file_info_t::get_position() const { return position; }
 text_coordinate_t recent_file_info_t::get_top_left() const { return top_left; }
 int64_t recent_file_info_t::get_close_time() const { return close_time; }
+const std::string &recent_file_info_t::get_highlight_lang_file() const {
+  return highlight_lang_file;
+}
+const std::string &recent_file_info_t::get_highlight_name() const { return highlight_name; }
+int64_t recent_file_info_t::get_file_size() const { return file_size; }
+int64_t recent_file_info_t::get_file_mtime() const { return file_mtime; }
+
+void recent_file_info_t::set_highlight(string_view _lang_file, string_view _name,
+                                       int64_t _file_size, int64_t _file_mtime) {
+  highlight_lang_file = std::string(_lang_file);
+  highlight_name = std::string(_name);
+  file_size = _file_size;
+  file_mtime = _file_mtime;
+}
 
 void recent_files_t::push_front(const file_buffer_t *text) {
   if (text->get_name().empty()) {
@@ -268,6 +290,15 @@ void recent_files_t::load_from_disk() {
     int64_t close_time = t3_config_get_int64(t3_config_get(recent_file, "close-time"));
     recent_file_infos.push_back(
         make_unique<recent_file_info_t>(name, encoding, position, top_left, close_time));
+
+    t3_config_t *highlight = t3_config_get(recent_file, "highlight");
+    if (highlight != nullptr) {
+      recent_file_infos.back()->set_highlight(
+          t3_config_get_string(t3_config_get(highlight, "lang-file")),
+          t3_config_get_string(t3_config_get(highlight, "name")),
+          t3_config_get_int64(t3_config_get(highlight, "file-size")),
+          t3_config_get_int64(t3_config_get(highlight, "file-mtime")));
+    }
   }
   std::sort(recent_file_infos.begin(), recent_file_infos.end(),
             [](const std::unique_ptr<recent_file_info_t> &a,
@@ -278,6 +309,26 @@ void recent_files_t::load_from_disk() {
   lprintf("Loaded %zd recent files\n", recent_file_infos.size());
 }
 
+/* Store the highlighting information of @p recent_file in @p config. Returns 0 on success. */
+static int set_highlight_config(t3_config_t *config, const recent_file_info_t *recent_file) {
+  t3_config_erase(config, "highlight");
+  if (recent_file->get_highlight_lang_file().empty()) {
+    return 0;
+  }
+  t3_config_t *highlight = t3_config_add_section(config, "highlight", nullptr);
+  if (highlight == nullptr) {
+    return -1;
+  }
+  int combined_result = 0;
+  combined_result |=
+      t3_config_add_string(highlight, "lang-file", recent_file->get_highlight_lang_file().c_str());
+  combined_result |=
+      t3_config_add_string(highlight, "name", recent_file->get_highlight_name().c_str());
+  combined_result |= t3_config_add_int64(highlight, "file-size", recent_file->get_file_size());
+  combined_result |= t3_config_add_int64(highlight, "file-mtime", recent_file->get_file_mtime());
+  return combined_result;
+}
+
 static bool make_dirs(char *dir) {
   char *slash = strchr(dir + (dir[0] == '/'), '/');
 
@@ -401,6 +452,7 @@ void recent_files_t::write_to_disk() {
           t3_config_add_int64(position_list, nullptr, recent_file->get_top_left().pos);
       combined_result |=
           t3_config_add_int64(new_recent_file, "close-time", recent_file->get_close_time());
+      combined_result |= set_highlight_config(new_recent_file, recent_file.get());
       if (combined_result != 0) {
         lprintf("Error in adding a new item to the recent-files list");
         return;
@@ -416,6 +468,7 @@ void recent_files_t::write_to_disk() {
         t3_config_add_int64(position_list, nullptr, recent_file->get_position().pos);
         t3_config_add_int64(position_list, nullptr, recent_file->get_top_left().line);
         t3_config_add_int64(position_list, nullptr, recent_file->get_top_left().pos);
+        set_highlight_config(existing_iter->second, recent_file.get());
       }
     }
   }
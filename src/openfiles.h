@@ -58,17 +58,29 @@ class recent_file_info_t {
   text_coordinate_t position;
   text_coordinate_t top_left;
   int64_t close_time;
+  // Highlighting language used for the file, and the size and modification time of the file on
+  // disk, which determine whether the language can be reused without detecting it again.
+  std::string highlight_lang_file;
+  std::string highlight_name;
+  int64_t file_size = -1;
+  int64_t file_mtime = -1;
 
  public:
   explicit recent_file_info_t(const file_buffer_t *file);
   recent_file_info_t(string_view name, string_view encoding, text_coordinate_t position,
                      text_coordinate_t top_left, int64_t close_time);
+  void set_highlight(string_view lang_file, string_view name, int64_t file_size,
+                     int64_t file_mtime);
 
   const std::string &get_name() const;
   const std::string &get_encoding() const;
   text_coordinate_t get_position() const;
   text_coordinate_t get_top_left() const;
   int64_t get_close_time() const;
+  const std::string &get_highlight_lang_file() const;
+  const std::string &get_highlight_name() const;
+  int64_t get_file_size() const;
+  int64_t get_file_mtime() const;
 };
 
 class recent_files_t {
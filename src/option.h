@@ -91,9 +91,17 @@ struct options_t {
   optional<bool> disable_primary_selection_over_ssh;
   optional<bool> save_recent_files;
   optional<bool> restore_cursor_position;
+  optional<bool> background_load;
+  optional<bool> atomic_save;
+  optional<bool> incremental_save;
+  optional<bool> background_save;
 
   optional<int> tabsize;
   optional<size_t> max_recent_files;
+  optional<size_t> read_block_size;
+  optional<size_t> max_load_memory;
+  optional<size_t> backup_versions;
+  optional<size_t> highlight_checkpoints;
 };
 
 struct runtime_options_t {
@@ -109,7 +117,15 @@ struct runtime_options_t {
   bool hide_menubar;
   bool save_recent_files;
   bool restore_cursor_position;
+  bool background_load;
+  bool atomic_save;
+  bool incremental_save;
+  bool background_save;
   size_t max_recent_files;
+  size_t read_block_size;
+  size_t max_load_memory;
+  size_t backup_versions;
+  size_t highlight_checkpoints;
   optional<int> key_timeout;
   attribute_map_t highlights;
   t3_attr_t brace_highlight;
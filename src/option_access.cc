@@ -61,9 +61,25 @@ option_access_t option_access[] = {
                     &options_t::save_recent_files, true),
     option_access_t("restore_cursor_position", &runtime_options_t::restore_cursor_position,
                     &options_t::restore_cursor_position, true),
+    option_access_t("background_load", &runtime_options_t::background_load,
+                    &options_t::background_load, true),
+    option_access_t("atomic_save", &runtime_options_t::atomic_save, &options_t::atomic_save,
+                    false),
+    option_access_t("incremental_save", &runtime_options_t::incremental_save,
+                    &options_t::incremental_save, false),
+    option_access_t("background_save", &runtime_options_t::background_save,
+                    &options_t::background_save, true),
     option_access_t("tabsize", &runtime_options_t::tabsize, &options_t::tabsize, 8),
     option_access_t("max_recent_files", &runtime_options_t::max_recent_files,
                     &options_t::max_recent_files, 16),
+    option_access_t("read_block_size", &runtime_options_t::read_block_size,
+                    &options_t::read_block_size, 1024 * 1024),
+    option_access_t("max_load_memory", &runtime_options_t::max_load_memory,
+                    &options_t::max_load_memory, 0),
+    option_access_t("backup_versions", &runtime_options_t::backup_versions,
+                    &options_t::backup_versions, 0),
+    option_access_t("highlight_checkpoints", &runtime_options_t::highlight_checkpoints,
+                    &options_t::highlight_checkpoints, 4096),
     option_access_t("key_timeout", &runtime_options_t::key_timeout, &term_options_t::key_timeout),
 
     option_access_t("brace_highlight", &runtime_options_t::brace_highlight,
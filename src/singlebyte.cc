@@ -0,0 +1,217 @@
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "tilde/singlebyte.h"
+
+struct single_byte_table_t {
+  const char *name;
+  const uint16_t *table;
+};
+
+#include "tilde/singlebytetables.h"
+
+/* Byte used for characters that can not be represented, as in the libtranscript converters. */
+#define SUBSTITUTE_BYTE 0x1A
+
+/** Copy the run of ASCII bytes at the start of @p in, in blocks of 16 or 32 bytes.
+    @return The number of bytes copied, which may be less than the length of the run. */
+static size_t copy_ascii_run(const char *in, size_t in_size, char *out, size_t out_size) {
+  size_t limit = std::min(in_size, out_size);
+  size_t copied = 0;
+#ifdef __AVX2__
+  while (limit - copied >= 32) {
+    __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in + copied));
+    if (_mm256_movemask_epi8(data) != 0) {
+      break;
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + copied), data);
+    copied += 32;
+  }
+#endif
+#ifdef __SSE2__
+  while (limit - copied >= 16) {
+    __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + copied));
+    if (_mm_movemask_epi8(data) != 0) {
+      break;
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + copied), data);
+    copied += 16;
+  }
+#else
+  (void)in;
+  (void)out;
+  (void)limit;
+#endif
+  return copied;
+}
+
+single_byte_converter_t::single_byte_converter_t(const char *name, const uint16_t *table)
+    : name_(name), table_(table) {
+  if (table_ == nullptr) {
+    return;
+  }
+  for (int i = 0; i < 128; ++i) {
+    if (table_[i] != 0) {
+      reverse_table_.emplace_back(table_[i], static_cast<uint8_t>(i + 0x80));
+    }
+  }
+  std::sort(reverse_table_.begin(), reverse_table_.end());
+}
+
+bool single_byte_converter_t::lookup(uint32_t codepoint, uint8_t *byte) const {
+  if (codepoint < 0x80 || table_ == nullptr) {
+    *byte = static_cast<uint8_t>(codepoint);
+    return codepoint < 0x100;
+  }
+  auto iter =
+      std::lower_bound(reverse_table_.begin(), reverse_table_.end(),
+                       std::make_pair(static_cast<uint16_t>(codepoint), static_cast<uint8_t>(0)));
+  if (codepoint > 0xFFFF || iter == reverse_table_.end() || iter->first != codepoint) {
+    return false;
+  }
+  *byte = iter->second;
+  return true;
+}
+
+transcript_error_t single_byte_converter_t::to_unicode(const char **inbuf, const char *inbuflimit,
+                                                       char **outbuf, const char *outbuflimit,
+                                                       int flags) const {
+  const char *in = *inbuf;
+  char *out = *outbuf;
+  transcript_error_t result = TRANSCRIPT_SUCCESS;
+
+  while (in < inbuflimit) {
+    size_t copied = copy_ascii_run(in, inbuflimit - in, out, outbuflimit - out);
+    in += copied;
+    out += copied;
+    if (in == inbuflimit) {
+      break;
+    }
+
+    uint8_t byte = static_cast<uint8_t>(*in);
+    uint32_t codepoint = byte < 0x80 || table_ == nullptr ? byte : table_[byte - 0x80];
+    if (codepoint == 0 && byte != 0) {
+      if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) {
+        result = TRANSCRIPT_UNASSIGNED;
+        break;
+      }
+      codepoint = 0xFFFD;
+    }
+
+    size_t length = codepoint < 0x80 ? 1 : codepoint < 0x800 ? 2 : 3;
+    if (static_cast<size_t>(outbuflimit - out) < length) {
+      result = TRANSCRIPT_NO_SPACE;
+      break;
+    }
+    switch (length) {
+      case 1:
+        *out++ = static_cast<char>(codepoint);
+        break;
+      case 2:
+        *out++ = static_cast<char>(0xC0 | (codepoint >> 6));
+        *out++ = static_cast<char>(0x80 | (codepoint & 0x3F));
+        break;
+      default:
+        *out++ = static_cast<char>(0xE0 | (codepoint >> 12));
+        *out++ = static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+        *out++ = static_cast<char>(0x80 | (codepoint & 0x3F));
+        break;
+    }
+    ++in;
+  }
+
+  *inbuf = in;
+  *outbuf = out;
+  return result;
+}
+
+transcript_error_t single_byte_converter_t::from_unicode(const char **inbuf,
+                                                         const char *inbuflimit, char **outbuf,
+                                                         const char *outbuflimit,
+                                                         int flags) const {
+  const char *in = *inbuf;
+  char *out = *outbuf;
+  transcript_error_t result = TRANSCRIPT_SUCCESS;
+
+  while (in < inbuflimit) {
+    size_t copied = copy_ascii_run(in, inbuflimit - in, out, outbuflimit - out);
+    in += copied;
+    out += copied;
+    if (in == inbuflimit) {
+      break;
+    }
+    if (out == outbuflimit) {
+      result = TRANSCRIPT_NO_SPACE;
+      break;
+    }
+
+    uint8_t lead = static_cast<uint8_t>(*in);
+    size_t length;
+    uint32_t codepoint;
+    if (lead < 0x80) {
+      length = 1;
+      codepoint = lead;
+    } else if (lead >= 0xC2 && lead < 0xE0) {
+      length = 2;
+      codepoint = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead < 0xF0) {
+      length = 3;
+      codepoint = lead & 0x0F;
+    } else if (lead >= 0xF0 && lead < 0xF5) {
+      length = 4;
+      codepoint = lead & 0x07;
+    } else {
+      result = TRANSCRIPT_ILLEGAL;
+      break;
+    }
+    if (static_cast<size_t>(inbuflimit - in) < length) {
+      result = flags & TRANSCRIPT_END_OF_TEXT ? TRANSCRIPT_ILLEGAL_END : TRANSCRIPT_INCOMPLETE;
+      break;
+    }
+    size_t i;
+    for (i = 1; i < length && (static_cast<uint8_t>(in[i]) & 0xC0) == 0x80; ++i) {
+      codepoint = (codepoint << 6) | (in[i] & 0x3F);
+    }
+    if (i < length) {
+      result = TRANSCRIPT_ILLEGAL;
+      break;
+    }
+
+    uint8_t byte;
+    if (!lookup(codepoint, &byte)) {
+      if (!(flags & TRANSCRIPT_SUBST_UNASSIGNED)) {
+        result = TRANSCRIPT_UNASSIGNED;
+        break;
+      }
+      byte = SUBSTITUTE_BYTE;
+    }
+    *out++ = static_cast<char>(byte);
+    in += length;
+  }
+
+  *inbuf = in;
+  *outbuf = out;
+  return result;
+}
+
+const single_byte_converter_t *single_byte_converter_t::get(const char *encoding) {
+  static const std::vector<single_byte_converter_t> converters = [] {
+    std::vector<single_byte_converter_t> result;
+    for (const single_byte_table_t &table : single_byte_tables) {
+      result.push_back(single_byte_converter_t(table.name, table.table));
+    }
+    return result;
+  }();
+
+  for (const single_byte_converter_t &converter : converters) {
+    if (transcript_equal(encoding, converter.name())) {
+      return &converter;
+    }
+  }
+  return nullptr;
+}
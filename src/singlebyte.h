@@ -0,0 +1,40 @@
+#ifndef SINGLEBYTE_H
+#define SINGLEBYTE_H
+
+#include <cstdint>
+#include <transcript/transcript.h>
+#include <utility>
+#include <vector>
+
+/** Built-in converter between UTF-8 and a stateless single byte encoding.
+
+    The bytes below 0x80 are ASCII in all supported encodings, and the other bytes are converted
+    through a table. The interface mirrors transcript_to_unicode and transcript_from_unicode, such
+    that it can be used as a replacement for a libtranscript converter. As the converters have no
+    state, they can be used from multiple threads at once.
+*/
+class single_byte_converter_t {
+ private:
+  const char *name_;
+  // Unicode code points for the bytes 0x80-0xFF, or nullptr for ISO-8859-1.
+  const uint16_t *table_;
+  // Sorted mapping from code points to bytes, for the bytes 0x80-0xFF.
+  std::vector<std::pair<uint16_t, uint8_t>> reverse_table_;
+
+  single_byte_converter_t(const char *name, const uint16_t *table);
+  bool lookup(uint32_t codepoint, uint8_t *byte) const;
+
+ public:
+  const char *name() const { return name_; }
+
+  transcript_error_t to_unicode(const char **inbuf, const char *inbuflimit, char **outbuf,
+                                const char *outbuflimit, int flags) const;
+  transcript_error_t from_unicode(const char **inbuf, const char *inbuflimit, char **outbuf,
+                                  const char *outbuflimit, int flags) const;
+
+  /** Get the built-in converter for @p encoding.
+      @return @c nullptr if there is no built-in converter for @p encoding. */
+  static const single_byte_converter_t *get(const char *encoding);
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <cstdint>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "tilde/utf8scan.h"
+
+size_t ascii_prefix_length(const char *data, size_t size) {
+  size_t result = 0;
+#ifdef __AVX2__
+  while (size - result >= 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + result));
+    if (_mm256_movemask_epi8(block) != 0) {
+      break;
+    }
+    result += 32;
+  }
+#endif
+#ifdef __SSE2__
+  while (size - result >= 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + result));
+    if (_mm_movemask_epi8(block) != 0) {
+      break;
+    }
+    result += 16;
+  }
+#endif
+  while (result < size && static_cast<uint8_t>(data[result]) < 0x80) {
+    ++result;
+  }
+  return result;
+}
+
+/** Returns the length of the UTF-8 sequence starting with the non-ASCII byte at @p data, or 0 if
+    the sequence is invalid or incomplete. */
+static size_t utf8_sequence_length(const char *data, size_t size) {
+  const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+  size_t length;
+  uint8_t min_second = 0x80, max_second = 0xBF;
+
+  if (bytes[0] >= 0xC2 && bytes[0] <= 0xDF) {
+    length = 2;
+  } else if (bytes[0] >= 0xE0 && bytes[0] <= 0xEF) {
+    length = 3;
+    // Exclude overlong sequences and surrogates.
+    if (bytes[0] == 0xE0) {
+      min_second = 0xA0;
+    } else if (bytes[0] == 0xED) {
+      max_second = 0x9F;
+    }
+  } else if (bytes[0] >= 0xF0 && bytes[0] <= 0xF4) {
+    length = 4;
+    // Exclude overlong sequences and code points beyond U+10FFFF.
+    if (bytes[0] == 0xF0) {
+      min_second = 0x90;
+    } else if (bytes[0] == 0xF4) {
+      max_second = 0x8F;
+    }
+  } else {
+    return 0;
+  }
+
+  if (size < length || bytes[1] < min_second || bytes[1] > max_second) {
+    return 0;
+  }
+  for (size_t i = 2; i < length; ++i) {
+    if ((bytes[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+  }
+  return length;
+}
+
+size_t utf8_block_size(const char *data, size_t size, size_t max_size, bool *valid) {
+  size_t limit = std::min(size, max_size);
+  size_t pos = 0;
+
+  *valid = true;
+  while (pos < limit) {
+    pos += ascii_prefix_length(data + pos, limit - pos);
+    if (pos == limit) {
+      break;
+    }
+    // The sequence is checked against all of the data, such that a character crossing the end of
+    // the block is not mistaken for an incomplete sequence.
+    size_t length = utf8_sequence_length(data + pos, size - pos);
+    if (length == 0) {
+      *valid = false;
+      return pos;
+    }
+    if (pos + length > limit && pos > 0) {
+      break;
+    }
+    pos += length;
+  }
+
+  if (pos == size) {
+    return pos;
+  }
+  size_t line_end = pos;
+  while (line_end > 0 && data[line_end - 1] != '\n') {
+    line_end--;
+  }
+  return line_end > 0 ? line_end : pos;
+}
@@ -0,0 +1,19 @@
+#ifndef UTF8SCAN_H
+#define UTF8SCAN_H
+
+#include <cstddef>
+
+/** Returns the number of ASCII bytes at the start of @p data. */
+size_t ascii_prefix_length(const char *data, size_t size);
+
+/** Find the end of the next block of UTF-8 text to append to a buffer, validating the text.
+
+    The block is at most @p max_size bytes. Unless it extends to the end of @p data, it ends after
+    the last newline in the block, or after the last complete character if there is no newline.
+    @param valid Set to @c false if the text contains an invalid UTF-8 sequence. The block then ends
+        at the start of the invalid sequence.
+    @return The size of the block.
+*/
+size_t utf8_block_size(const char *data, size_t size, size_t max_size, bool *valid);
+
+#endif
@@ -0,0 +1,66 @@
+#include <algorithm>
+#include <memory>
+
+#include "tilde/workerpool.h"
+
+/* Upper limit on the number of threads in the shared pool. */
+#define MAX_WORKER_THREADS 8
+
+worker_pool_t::worker_pool_t(size_t thread_count) {
+  try {
+    for (size_t i = 0; i < thread_count; ++i) {
+      threads.emplace_back(&worker_pool_t::run, this);
+    }
+  } catch (...) {
+    stop();
+    throw;
+  }
+}
+
+worker_pool_t::~worker_pool_t() { stop(); }
+
+void worker_pool_t::stop() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  task_available.notify_all();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+}
+
+void worker_pool_t::run() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      task_available.wait(lock, [this] { return stopping || !tasks.empty(); });
+      if (tasks.empty()) {
+        return;
+      }
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    task();
+  }
+}
+
+std::future<void> worker_pool_t::submit(std::function<void()> task) {
+  std::shared_ptr<std::packaged_task<void()>> packaged_task =
+      std::make_shared<std::packaged_task<void()>>(std::move(task));
+  std::future<void> result = packaged_task->get_future();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    tasks.emplace_back([packaged_task] { (*packaged_task)(); });
+  }
+  task_available.notify_one();
+  return result;
+}
+
+worker_pool_t *get_worker_pool() {
+  /* The pool is never destroyed, as background threads may still use it while the program exits. */
+  static worker_pool_t *pool = new worker_pool_t(std::min<size_t>(
+      std::max<unsigned>(std::thread::hardware_concurrency(), 2) - 1, MAX_WORKER_THREADS));
+  return pool;
+}
@@ -0,0 +1,38 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** A fixed set of threads executing tasks in the order in which they were submitted. */
+class worker_pool_t {
+ private:
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable task_available;
+  std::deque<std::function<void()>> tasks;
+  bool stopping = false;
+
+  void run();
+  void stop();
+
+ public:
+  explicit worker_pool_t(size_t thread_count);
+  ~worker_pool_t();
+
+  /** Queue @p task for execution on one of the threads.
+      @return A future which becomes ready when @p task has been executed. */
+  std::future<void> submit(std::function<void()> task);
+  size_t size() const { return threads.size(); }
+};
+
+/** Get the worker pool shared by the whole program. It has one thread less than the number of
+    available processors, as the submitting thread usually does part of the work itself. */
+worker_pool_t *get_worker_pool();
+
+#endif
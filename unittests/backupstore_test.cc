@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <ftw.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "tilde/backupstore.h"
+
+namespace {
+
+std::string RandomData(size_t size, unsigned seed) {
+  std::string result;
+  result.reserve(size);
+  for (size_t i = 0; i < size; ++i) {
+    seed = seed * 1103515245 + 12345;
+    result.push_back(static_cast<char>(seed >> 16));
+  }
+  return result;
+}
+
+std::vector<std::string> Chunks(const std::string &data) {
+  std::vector<std::string> result;
+  for (size_t offset = 0; offset < data.size();) {
+    size_t length = find_chunk_boundary(data.data() + offset, data.size() - offset);
+    result.push_back(data.substr(offset, length));
+    offset += length;
+  }
+  return result;
+}
+
+int file_count;
+
+int CountFiles(const char *, const struct stat *, int type, struct FTW *) {
+  if (type == FTW_F) {
+    ++file_count;
+  }
+  return 0;
+}
+
+std::string first_chunk;
+
+int FindChunk(const char *path, const struct stat *, int type, struct FTW *) {
+  if (type == FTW_F) {
+    first_chunk = path;
+    return 1;
+  }
+  return 0;
+}
+
+int RemoveEntry(const char *path, const struct stat *, int, struct FTW *) { return remove(path); }
+
+class BackupStoreTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char dir_template[] = "/tmp/tilde_backup_test_XXXXXX";
+    ASSERT_NE(mkdtemp(dir_template), nullptr);
+    dir_ = dir_template;
+    file_name_ = dir_ + "/file.txt";
+  }
+
+  void TearDown() override { nftw(dir_.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS); }
+
+  void WriteFile(const std::string &contents) {
+    int fd = open(file_name_.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(write(fd, contents.data(), contents.size()), static_cast<ssize_t>(contents.size()));
+    close(fd);
+  }
+
+  void Store(backup_store_t *store, const std::string &contents, int max_versions) {
+    WriteFile(contents);
+    int fd = open(file_name_.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(store->store(file_name_, fd, max_versions), 0);
+    close(fd);
+  }
+
+  std::string Restore(const backup_store_t &store, const backup_version_t &version) {
+    std::string name = dir_ + "/restored";
+    int fd = open(name.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+    EXPECT_GE(fd, 0);
+    EXPECT_EQ(store.restore(version, fd), 0);
+    std::string result;
+    char buffer[4096];
+    ssize_t bytes;
+    lseek(fd, 0, SEEK_SET);
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+      result.append(buffer, bytes);
+    }
+    close(fd);
+    return result;
+  }
+
+  int CountChunks() {
+    file_count = 0;
+    nftw((dir_ + "/store/chunks").c_str(), CountFiles, 16, FTW_PHYS);
+    return file_count;
+  }
+
+  std::string dir_;
+  std::string file_name_;
+};
+
+TEST(BackupChunkTest, Sha256) {
+  EXPECT_EQ(sha256_hex("", 0), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  EXPECT_EQ(sha256_hex("abc", 3),
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  std::string data(1000, 'a');
+  EXPECT_EQ(sha256_hex(data.data(), data.size()),
+            "41edece42d63e8d9bf515a9ba6932e1c20cbc9f5a5d134645adb5db1b9737ea3");
+}
+
+TEST(BackupChunkTest, ChunkSizeLimits) {
+  std::string data = RandomData(1024 * 1024, 1);
+  std::vector<std::string> chunks = Chunks(data);
+  for (size_t i = 0; i + 1 < chunks.size(); ++i) {
+    EXPECT_GT(chunks[i].size(), static_cast<size_t>(BACKUP_MIN_CHUNK_SIZE));
+    EXPECT_LE(chunks[i].size(), static_cast<size_t>(BACKUP_MAX_CHUNK_SIZE));
+  }
+  // Repeated data has no boundaries.
+  std::string zeros(200000, '\0');
+  EXPECT_EQ(find_chunk_boundary(zeros.data(), zeros.size()),
+            static_cast<size_t>(BACKUP_MAX_CHUNK_SIZE));
+}
+
+TEST(BackupChunkTest, InsertionOnlyChangesNearbyChunks) {
+  std::string data = RandomData(1024 * 1024, 2);
+  std::vector<std::string> before = Chunks(data);
+  data.insert(500000, "inserted text");
+  std::vector<std::string> after = Chunks(data);
+
+  size_t changed = 0;
+  for (const std::string &chunk : after) {
+    if (std::find(before.begin(), before.end(), chunk) == before.end()) {
+      ++changed;
+    }
+  }
+  EXPECT_GE(before.size(), 50u);
+  EXPECT_LE(changed, 2u);
+}
+
+TEST_F(BackupStoreTest, StoreAndRestore) {
+  backup_store_t store(dir_ + "/store");
+  std::string first = RandomData(300000, 3);
+  std::string second = first;
+  second.replace(150000, 10, "0123456789");
+
+  Store(&store, first, 5);
+  Store(&store, second, 5);
+  std::vector<backup_version_t> versions = store.list(file_name_);
+  ASSERT_EQ(versions.size(), 2u);
+  EXPECT_GT(versions[0].time, versions[1].time);
+  EXPECT_EQ(versions[0].size, static_cast<off_t>(second.size()));
+  EXPECT_EQ(Restore(store, versions[0]), second);
+  EXPECT_EQ(Restore(store, versions[1]), first);
+  EXPECT_TRUE(store.list(dir_ + "/other.txt").empty());
+}
+
+TEST_F(BackupStoreTest, OnlyChangedChunksAreStored) {
+  backup_store_t store(dir_ + "/store");
+  std::string data = RandomData(1024 * 1024, 4);
+  Store(&store, data, 5);
+  int chunks = CountChunks();
+  if (chunks == 0) {
+    // The store is on a file system with reflinks, so the data is shared through clones instead.
+    return;
+  }
+  data.replace(600000, 5, "abcde");
+  Store(&store, data, 5);
+  EXPECT_LE(CountChunks(), chunks + 2);
+}
+
+TEST_F(BackupStoreTest, IncompleteChunkIsWrittenAgain) {
+  backup_store_t store(dir_ + "/store");
+  std::string data = RandomData(100000, 5);
+  Store(&store, data, 5);
+  if (CountChunks() == 0) {
+    return;
+  }
+  // Chunks are not synced individually, so after a crash a chunk may be empty.
+  nftw((dir_ + "/store/chunks").c_str(), FindChunk, 16, FTW_PHYS);
+  ASSERT_EQ(truncate(first_chunk.c_str(), 0), 0);
+
+  Store(&store, data, 5);
+  std::vector<backup_version_t> versions = store.list(file_name_);
+  ASSERT_EQ(versions.size(), 2u);
+  EXPECT_EQ(Restore(store, versions[0]), data);
+}
+
+TEST_F(BackupStoreTest, KeepsNewestVersions) {
+  backup_store_t store(dir_ + "/store");
+  for (int i = 0; i < 4; ++i) {
+    Store(&store, RandomData(10000, 10 + i), 2);
+  }
+  std::vector<backup_version_t> versions = store.list(file_name_);
+  ASSERT_EQ(versions.size(), 2u);
+  EXPECT_EQ(Restore(store, versions[0]), RandomData(10000, 13));
+  EXPECT_EQ(Restore(store, versions[1]), RandomData(10000, 12));
+}
+
+TEST_F(BackupStoreTest, EmptyFileIsNotStored) {
+  backup_store_t store(dir_ + "/store");
+  Store(&store, "", 5);
+  EXPECT_TRUE(store.list(file_name_).empty());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
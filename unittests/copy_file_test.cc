@@ -1,14 +1,28 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
 #include <fcntl.h>
+#include <functional>
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <sys/stat.h>
 #include <t3widget/util.h>
 #include <unistd.h>
+#include <vector>
 
 #include "tilde/copy_file.h"
 
 DEFINE_string(reflink_fs_dir, "", "Directory on a file system that supports reflinks.");
 DEFINE_string(non_reflink_fs_dir, "", "Directory on a file system that does not support reflinks.");
+DEFINE_bool(benchmark, false, "Report the throughput of each copy method instead of running tests.");
+DEFINE_string(benchmark_dirs, "",
+              "Comma separated list of directories to benchmark in. Defaults to the reflink and "
+              "non-reflink directories.");
+DEFINE_string(benchmark_sizes, "4096,1048576,67108864",
+              "Comma separated list of file sizes to benchmark.");
+DEFINE_int32(benchmark_repetitions, 3, "Number of copies per measurement, of which the fastest "
+             "is reported.");
 
 namespace {
 
@@ -277,6 +291,164 @@ TEST_F(CopyFileTest, FicloneWithContentNonReflinkFs) {
   EXPECT_EQ(copy_file_by_ficlone(src_name_and_fd_.second, dest_name_and_fd_.second), ENOTSUP);
 }
 
+// ======================= io_uring ==========================================
+// These tests only check the result if io_uring is available, as it is optional.
+TEST_F(CopyFileTest, IoUringWithLargeContent) {
+  src_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  FillWithRandomData(src_name_and_fd_, 3 * 1024 * 1024 + 37456);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  size_t last_progress = 0;
+  int result = copy_file_by_io_uring(src_name_and_fd_.second, dest_name_and_fd_.second,
+                                     3 * 1024 * 1024 + 37456, false,
+                                     [&last_progress](size_t copied) { last_progress = copied; });
+  if (result == ENOTSUP) {
+    return;
+  }
+  EXPECT_EQ(result, 0);
+  EXPECT_EQ(last_progress, 3u * 1024 * 1024 + 37456);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+TEST_F(CopyFileTest, IoUringSyncTruncates) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFileWithContent("longer content", FLAGS_non_reflink_fs_dir);
+
+  int result = copy_file_by_io_uring(src_name_and_fd_.second, dest_name_and_fd_.second, 4, true);
+  if (result == ENOTSUP) {
+    return;
+  }
+  EXPECT_EQ(result, 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+// ======================= copy_file_and_sync ================================
+TEST_F(CopyFileTest, CopyFileAndSyncWithContent) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file_and_sync(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+}
+
+// ======================= method cache ======================================
+TEST_F(CopyFileTest, UnsupportedFicloneIsCached) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_STREQ(copy_file_first_method(src_name_and_fd_.second, dest_name_and_fd_.second),
+               "copy_file_range");
+}
+
+TEST_F(CopyFileTest, InvalidArgumentIsNotCached) {
+  src_name_and_fd_ = CreateFileWithContent("abcd", FLAGS_non_reflink_fs_dir);
+  dest_name_and_fd_ = CreateFile(FLAGS_non_reflink_fs_dir);
+  // copy_file_range and sendfile fail for a destination opened with O_APPEND.
+  close(dest_name_and_fd_.second);
+  dest_name_and_fd_.second = open(dest_name_and_fd_.first.c_str(), O_WRONLY | O_APPEND);
+  ASSERT_GE(dest_name_and_fd_.second, 0);
+
+  EXPECT_EQ(copy_file(src_name_and_fd_.second, dest_name_and_fd_.second), 0);
+  EXPECT_TRUE(FileCopied(src_name_and_fd_.first, dest_name_and_fd_.first));
+  EXPECT_STREQ(copy_file_first_method(src_name_and_fd_.second, dest_name_and_fd_.second),
+               "copy_file_range");
+}
+
+// ======================= benchmark =========================================
+std::vector<std::string> SplitList(const std::string &list) {
+  std::vector<std::string> result;
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = std::min(list.find(',', start), list.size());
+    if (end > start) {
+      result.push_back(list.substr(start, end - start));
+    }
+    start = end + 1;
+  }
+  return result;
+}
+
+struct BenchmarkMethod {
+  const char *name;
+  std::function<int(int, int, size_t)> copy;
+};
+
+const BenchmarkMethod kBenchmarkMethods[] = {
+    {"ficlone", [](int src, int dest, size_t) { return copy_file_by_ficlone(src, dest); }},
+    {"copy_file_range", copy_file_by_copy_file_range},
+    {"sendfile", copy_file_by_sendfile},
+    {"read_write", [](int src, int dest, size_t) { return copy_file_by_read_write(src, dest); }},
+    {"io_uring",
+     [](int src, int dest, size_t size) { return copy_file_by_io_uring(src, dest, size, false); }},
+    {"copy_file", [](int src, int dest, size_t) { return copy_file(src, dest); }},
+};
+
+/* Copy a file of the given size with every method, and print the throughput including the fsync
+   of the copy. For copy_file, the first method it tries after the copy is printed as well. */
+void RunBenchmark(const std::string &dir, size_t size, bool *first) {
+  auto src = CreateFile(dir);
+  FillWithRandomData(src, size);
+  QCHECK(fsync(src.second) == 0);
+
+  for (const BenchmarkMethod &method : kBenchmarkMethods) {
+    double best_seconds = -1;
+    int error = 0;
+    std::string first_method;
+    for (int i = 0; i < FLAGS_benchmark_repetitions && error == 0; ++i) {
+      auto dest = CreateFile(dir);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      error = method.copy(src.second, dest.second, size);
+      if (error == 0 && fsync(dest.second) < 0) {
+        error = errno;
+      }
+      double seconds =
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      if (error == 0 && (best_seconds < 0 || seconds < best_seconds)) {
+        best_seconds = seconds;
+      }
+      first_method = copy_file_first_method(src.second, dest.second);
+      close(dest.second);
+      unlink(dest.first.c_str());
+    }
+
+    printf("%s  {\"dir\": \"%s\", \"size\": %zd, \"method\": \"%s\", ", *first ? "" : ",\n",
+           dir.c_str(), size, method.name);
+    if (error != 0) {
+      printf("\"error\": \"%s\"}", strerror(error));
+    } else {
+      printf("\"mb_per_s\": %.1f", size / (1024.0 * 1024.0) / best_seconds);
+      if (strcmp(method.name, "copy_file") == 0) {
+        printf(", \"first_method\": \"%s\"", first_method.c_str());
+      }
+      printf("}");
+    }
+    *first = false;
+    fflush(stdout);
+  }
+  close(src.second);
+  unlink(src.first.c_str());
+}
+
+void RunBenchmarks() {
+  std::vector<std::string> dirs = SplitList(FLAGS_benchmark_dirs);
+  if (dirs.empty()) {
+    dirs = {FLAGS_reflink_fs_dir, FLAGS_non_reflink_fs_dir};
+  }
+  bool first = true;
+  printf("[\n");
+  for (const std::string &dir : dirs) {
+    if (dir.empty()) {
+      continue;
+    }
+    for (const std::string &size : SplitList(FLAGS_benchmark_sizes)) {
+      RunBenchmark(dir, std::strtoull(size.c_str(), nullptr, 10), &first);
+    }
+  }
+  printf("\n]\n");
+}
+
 }
 
 int main(int argc, char **argv) {
@@ -291,6 +463,11 @@ int main(int argc, char **argv) {
     if (env) FLAGS_non_reflink_fs_dir = env;
   }
 
+  if (FLAGS_benchmark) {
+    RunBenchmarks();
+    return EXIT_SUCCESS;
+  }
+
   QCHECK(!FLAGS_reflink_fs_dir.empty()) << "--reflink_fs_dir or BTRFS_MOUNT must be set";
   QCHECK(!FLAGS_non_reflink_fs_dir.empty()) << "--non_reflink_fs_dir or EXT3_MOUNT must be set";
 
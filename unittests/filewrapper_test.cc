@@ -0,0 +1,111 @@
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "tilde/filewrapper.h"
+
+/* The sources under test call fatal through PANIC and ASSERT. */
+void fatal(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  abort();
+}
+
+namespace {
+
+volatile sig_atomic_t sigbus_count;
+
+void CountSigbus(int) { ++sigbus_count; }
+
+class FileMapTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char name[] = "/tmp/tilde_map_test_XXXXXX";
+    fd_ = mkstemp(name);
+    ASSERT_GE(fd_, 0);
+    unlink(name);
+  }
+
+  void TearDown() override { close(fd_); }
+
+  int fd_;
+};
+
+TEST_F(FileMapTest, Read) {
+  std::string contents(3 * 65536, 'x');
+  contents[70000] = 'y';
+  ASSERT_EQ(write(fd_, contents.data(), contents.size()), static_cast<ssize_t>(contents.size()));
+  std::unique_ptr<file_map_t> map(file_map_t::map(fd_));
+  ASSERT_NE(map, nullptr);
+  ASSERT_EQ(map->size(), contents.size());
+
+  char buffer[10];
+  ASSERT_TRUE(map->read(69995, sizeof(buffer), buffer));
+  EXPECT_EQ(std::string(buffer, sizeof(buffer)), contents.substr(69995, sizeof(buffer)));
+}
+
+TEST_F(FileMapTest, TruncatedFileIsDetected) {
+  std::string contents(3 * 65536, 'x');
+  ASSERT_EQ(write(fd_, contents.data(), contents.size()), static_cast<ssize_t>(contents.size()));
+  std::unique_ptr<file_map_t> map(file_map_t::map(fd_));
+  ASSERT_NE(map, nullptr);
+  ASSERT_EQ(ftruncate(fd_, 100), 0);
+
+  std::vector<char> buffer(contents.size());
+  EXPECT_TRUE(map->read(0, 100, buffer.data()));
+  EXPECT_FALSE(map->read(0, contents.size(), buffer.data()));
+  // Reading remains possible after a failed read.
+  EXPECT_FALSE(map->read(2 * 65536, 10, buffer.data()));
+  EXPECT_TRUE(map->read(10, 10, buffer.data()));
+}
+
+TEST_F(FileMapTest, AccessIsInterruptedByTruncation) {
+  std::string contents(3 * 65536, 'x');
+  ASSERT_EQ(write(fd_, contents.data(), contents.size()), static_cast<ssize_t>(contents.size()));
+  std::unique_ptr<file_map_t> map(file_map_t::map(fd_));
+  ASSERT_NE(map, nullptr);
+  std::string copy;
+  auto append = [&copy](const char *data, size_t size) { copy.append(data, size); };
+  ASSERT_TRUE(map->access(65536, 100, append));
+  EXPECT_EQ(copy, contents.substr(65536, 100));
+
+  ASSERT_EQ(ftruncate(fd_, 100), 0);
+  EXPECT_FALSE(map->access(0, contents.size(), append));
+}
+
+TEST_F(FileMapTest, OtherSigbusIsPassedOn) {
+  std::string contents(3 * 65536, 'x');
+  ASSERT_EQ(write(fd_, contents.data(), contents.size()), static_cast<ssize_t>(contents.size()));
+  std::unique_ptr<file_map_t> map(file_map_t::map(fd_));
+  ASSERT_NE(map, nullptr);
+  char buffer[10];
+  ASSERT_TRUE(map->read(0, sizeof(buffer), buffer));
+
+  sigbus_count = 0;
+  raise(SIGBUS);
+  EXPECT_EQ(sigbus_count, 1);
+  raise(SIGBUS);
+  EXPECT_EQ(sigbus_count, 2);
+
+  // The map is still protected after a SIGBUS that was passed on.
+  ASSERT_EQ(ftruncate(fd_, 100), 0);
+  EXPECT_FALSE(map->read(2 * 65536, sizeof(buffer), buffer));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  // Installed before the map handler, which passes other SIGBUS signals to it.
+  signal(SIGBUS, CountSigbus);
+  return RUN_ALL_TESTS();
+}
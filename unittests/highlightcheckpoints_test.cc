@@ -0,0 +1,156 @@
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <ftw.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/stat.h>
+
+#include "tilde/highlightcheckpoints.h"
+
+namespace {
+
+int RemoveEntry(const char *path, const struct stat *, int, struct FTW *) { return remove(path); }
+
+class HighlightCheckpointsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    char dir_template[] = "/tmp/tilde_checkpoint_test_XXXXXX";
+    ASSERT_NE(mkdtemp(dir_template), nullptr);
+    dir_ = dir_template;
+    file_info_ = {};
+    file_info_.st_size = 123456;
+    file_info_.st_mtim.tv_sec = 1500000000;
+    file_info_.st_mtim.tv_nsec = 42;
+    checkpoints_.lang_file = dir_ + "/c.lang";
+    WriteLangFile("format = 1\n");
+    checkpoints_.interval = 1000;
+    checkpoints_.states = {0, HIGHLIGHT_CHECKPOINT_NONE, HIGHLIGHT_CHECKPOINT_NONE, 0};
+  }
+
+  void WriteLangFile(const char *contents) {
+    FILE *file = fopen(checkpoints_.lang_file.c_str(), "w");
+    ASSERT_NE(file, nullptr);
+    fputs(contents, file);
+    fclose(file);
+  }
+
+  // Append @p text to the single checkpoint file in the cache directory.
+  void AppendToCheckpointFile(const char *text) {
+    DIR *dir = opendir((dir_ + "/cache").c_str());
+    ASSERT_NE(dir, nullptr);
+    std::string path;
+    while (struct dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        path = dir_ + "/cache/" + entry->d_name;
+      }
+    }
+    closedir(dir);
+    FILE *file = fopen(path.c_str(), "a");
+    ASSERT_NE(file, nullptr);
+    fputs(text, file);
+    fclose(file);
+  }
+
+  void TearDown() override {
+    nftw(dir_.c_str(), RemoveEntry, 16, FTW_DEPTH | FTW_PHYS);
+    unsetenv("XDG_DATA_HOME");
+  }
+
+  int CountFiles() {
+    int count = 0;
+    DIR *dir = opendir((dir_ + "/cache").c_str());
+    while (struct dirent *entry = readdir(dir)) {
+      if (entry->d_name[0] != '.') {
+        ++count;
+      }
+    }
+    closedir(dir);
+    return count;
+  }
+
+  std::string dir_;
+  struct stat file_info_;
+  highlight_checkpoints_t checkpoints_;
+};
+
+TEST_F(HighlightCheckpointsTest, WriteAndRead) {
+  ASSERT_TRUE(
+      write_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, checkpoints_, 10));
+  highlight_checkpoints_t read;
+  ASSERT_TRUE(read_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, &read));
+  EXPECT_EQ(read.lang_file, checkpoints_.lang_file);
+  EXPECT_EQ(read.interval, checkpoints_.interval);
+  EXPECT_EQ(read.states, checkpoints_.states);
+
+  EXPECT_FALSE(read_highlight_checkpoints(dir_ + "/cache", "/other/file.c", file_info_, &read));
+}
+
+TEST_F(HighlightCheckpointsTest, ChangedFileIsIgnored) {
+  ASSERT_TRUE(
+      write_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, checkpoints_, 10));
+  highlight_checkpoints_t read;
+  struct stat changed = file_info_;
+  changed.st_mtim.tv_nsec++;
+  EXPECT_FALSE(read_highlight_checkpoints(dir_ + "/cache", "/some/file.c", changed, &read));
+  changed = file_info_;
+  changed.st_size--;
+  EXPECT_FALSE(read_highlight_checkpoints(dir_ + "/cache", "/some/file.c", changed, &read));
+}
+
+TEST_F(HighlightCheckpointsTest, ChangedLangFileIsIgnored) {
+  ASSERT_TRUE(
+      write_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, checkpoints_, 10));
+  WriteLangFile("format = 1\n# Changed\n");
+  highlight_checkpoints_t read;
+  EXPECT_FALSE(read_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, &read));
+
+  remove(checkpoints_.lang_file.c_str());
+  EXPECT_FALSE(read_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, &read));
+}
+
+TEST_F(HighlightCheckpointsTest, LangFileIsFoundInSearchPath) {
+  ASSERT_EQ(mkdir((dir_ + "/data").c_str(), 0700), 0);
+  ASSERT_EQ(mkdir((dir_ + "/data/libt3highlight").c_str(), 0700), 0);
+  ASSERT_EQ(rename(checkpoints_.lang_file.c_str(), (dir_ + "/data/libt3highlight/c.lang").c_str()),
+            0);
+  ASSERT_EQ(setenv("XDG_DATA_HOME", (dir_ + "/data").c_str(), 1), 0);
+  checkpoints_.lang_file = "c.lang";
+
+  ASSERT_TRUE(
+      write_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, checkpoints_, 10));
+  highlight_checkpoints_t read;
+  ASSERT_TRUE(read_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, &read));
+  EXPECT_EQ(read.lang_file, "c.lang");
+  EXPECT_EQ(read.states, checkpoints_.states);
+
+  checkpoints_.lang_file = dir_ + "/data/libt3highlight/c.lang";
+  WriteLangFile("format = 1\n# Changed\n");
+  EXPECT_FALSE(read_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, &read));
+}
+
+TEST_F(HighlightCheckpointsTest, InvalidStatesAreRejected) {
+  for (const char *state : {"17\n", "-5\n", "0x\n", "99999999999999999999\n", "\n"}) {
+    ASSERT_TRUE(
+        write_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, checkpoints_, 10));
+    AppendToCheckpointFile(state);
+    highlight_checkpoints_t read;
+    EXPECT_FALSE(read_highlight_checkpoints(dir_ + "/cache", "/some/file.c", file_info_, &read))
+        << state;
+  }
+}
+
+TEST_F(HighlightCheckpointsTest, KeepsLimitedNumberOfFiles) {
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_TRUE(write_highlight_checkpoints(dir_ + "/cache", "/file" + std::to_string(i),
+                                            file_info_, checkpoints_, 3));
+  }
+  EXPECT_EQ(CountFiles(), 3);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,117 @@
+#include <chrono>
+#include <gtest/gtest.h>
+#include <vector>
+
+#include "tilde/highlightdirty.h"
+
+namespace {
+
+/* Lines of a text in which each line either keeps the state of the previous line, or opens or
+   closes a comment. */
+class HighlightDirtyTest : public ::testing::Test {
+ protected:
+  enum { KEEP, OPEN, CLOSE };
+
+  struct line_t {
+    int kind = KEEP;
+    int start = 0;
+    bool dirty = true;
+
+    int end() const { return kind == KEEP ? start : kind == OPEN ? 1 : 0; }
+  };
+
+  void SetUp() override {
+    lines_.resize(10000);
+    for (size_t i = 0; i < lines_.size(); i += 100) {
+      lines_[i].kind = CLOSE;
+    }
+    range_.lines_changed(0, lines_.size());
+    range_.mark(0, lines_.size() - 1);
+    ASSERT_TRUE(Propagate());
+    calls_ = 0;
+  }
+
+  bool Propagate() {
+    text_pos_t valid = -1;
+    return range_.propagate(
+        lines_.size() - 1, std::chrono::steady_clock::time_point::max(), &valid,
+        [this](text_pos_t i) {
+          ++calls_;
+          if (lines_[i - 1].dirty) {
+            lines_[i - 1].dirty = false;
+            int state = lines_[i - 1].end();
+            if (state != lines_[i].start) {
+              lines_[i].start = state;
+              lines_[i].dirty = true;
+            }
+          }
+          return lines_[i].dirty;
+        });
+  }
+
+  void Change(text_pos_t line, int kind) {
+    lines_[line].kind = kind;
+    lines_[line].dirty = true;
+    range_.mark(line, line);
+  }
+
+  void ExpectStatesCorrect() {
+    int state = 0;
+    for (size_t i = 0; i < lines_.size(); ++i) {
+      ASSERT_EQ(lines_[i].start, state) << "line " << i;
+      state = lines_[i].end();
+    }
+  }
+
+  std::vector<line_t> lines_;
+  highlight_dirty_range_t range_;
+  int calls_ = 0;
+};
+
+TEST_F(HighlightDirtyTest, PropagationStopsWhenEndStatesMatch) {
+  Change(5010, OPEN);
+  ASSERT_TRUE(Propagate());
+  ExpectStatesCorrect();
+  // Only the lines up to the next line closing the comment are visited.
+  EXPECT_LE(calls_, 100);
+  EXPECT_TRUE(range_.empty());
+
+  calls_ = 0;
+  ASSERT_TRUE(Propagate());
+  EXPECT_EQ(calls_, 0);
+}
+
+TEST_F(HighlightDirtyTest, SeparateChangesAreBothPropagated) {
+  Change(1050, OPEN);
+  Change(8050, OPEN);
+  ASSERT_TRUE(Propagate());
+  ExpectStatesCorrect();
+  EXPECT_TRUE(range_.empty());
+}
+
+TEST_F(HighlightDirtyTest, InsertedLinesMoveRange) {
+  Change(3000, OPEN);
+  lines_.insert(lines_.begin() + 10, 5, line_t());
+  range_.lines_changed(10, lines_.size());
+  ASSERT_TRUE(Propagate());
+  ExpectStatesCorrect();
+  EXPECT_EQ(lines_[3006].start, 1);
+}
+
+TEST_F(HighlightDirtyTest, StopsAtDeadline) {
+  Change(10, OPEN);
+  for (size_t i = 0; i < lines_.size(); i += 100) {
+    lines_[i].kind = KEEP;
+  }
+  text_pos_t valid = 9;
+  EXPECT_FALSE(range_.propagate(lines_.size() - 1, std::chrono::steady_clock::time_point::min(),
+                                &valid, [](text_pos_t) { return true; }));
+  EXPECT_LT(valid, static_cast<text_pos_t>(lines_.size() - 1));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "tilde/incrementalsave.h"
+
+namespace {
+
+/* A buffer of lines and the file it was saved to, which tracks the unmodified lines like
+   file_buffer_t does. */
+class IncrementalSaveTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    lines_ = {"first", "second", "third", "fourth", "fifth"};
+    file_ = Contents();
+    unmodified_lines_ = lines_.size();
+  }
+
+  std::string Contents() const {
+    std::string result;
+    for (size_t i = 0; i < lines_.size(); ++i) {
+      result.append(i == 0 ? "" : "\n").append(lines_[i]);
+    }
+    return result;
+  }
+
+  void Changed(rewrap_type_t type, text_pos_t line) {
+    unmodified_lines_ = std::min(unmodified_lines_, first_changed_line(type, line));
+  }
+
+  // Split line at pos, as t3widget reports it: the new line is inserted after it.
+  void SplitLine(text_pos_t line, size_t pos) {
+    lines_.insert(lines_.begin() + line + 1, lines_[line].substr(pos));
+    lines_[line].erase(pos);
+    Changed(rewrap_type_t::INSERT_LINES, line + 1);
+  }
+
+  // Join line with the line after it, which is deleted.
+  void JoinLine(text_pos_t line) {
+    lines_[line] += lines_[line + 1];
+    lines_.erase(lines_.begin() + line + 1);
+    Changed(rewrap_type_t::DELETE_LINES, line + 1);
+  }
+
+  // Write the lines from the first modified one at their offset, and truncate the file.
+  void SaveIncrementally() {
+    off_t offset;
+    ASSERT_TRUE(incremental_save_offset(
+        [this](text_pos_t i) -> const std::string & { return lines_[i]; }, unmodified_lines_,
+        file_.size(), &offset));
+    file_.resize(offset);
+    for (size_t i = unmodified_lines_; i < lines_.size(); ++i) {
+      file_.append(i == 0 ? "" : "\n").append(lines_[i]);
+    }
+    unmodified_lines_ = lines_.size();
+  }
+
+  std::vector<std::string> lines_;
+  std::string file_;
+  text_pos_t unmodified_lines_;
+};
+
+TEST_F(IncrementalSaveTest, AppendedLine) {
+  lines_.push_back("sixth");
+  Changed(rewrap_type_t::INSERT_LINES, 5);
+  SaveIncrementally();
+  EXPECT_EQ(file_, Contents());
+}
+
+TEST_F(IncrementalSaveTest, SplitLastUnmodifiedLine) {
+  lines_[3] = "changed";
+  Changed(rewrap_type_t::REWRAP_LINE, 3);
+  ASSERT_EQ(unmodified_lines_, 3);
+  // Line 2 is the last unmodified line, and is split.
+  SplitLine(2, 2);
+  EXPECT_EQ(unmodified_lines_, 2);
+  SaveIncrementally();
+  EXPECT_EQ(file_, Contents());
+}
+
+TEST_F(IncrementalSaveTest, JoinLastUnmodifiedLine) {
+  lines_[4] = "changed";
+  Changed(rewrap_type_t::REWRAP_LINE, 4);
+  JoinLine(3);
+  SaveIncrementally();
+  EXPECT_EQ(file_, Contents());
+}
+
+TEST_F(IncrementalSaveTest, SplitFirstLine) {
+  SplitLine(0, 3);
+  EXPECT_EQ(unmodified_lines_, 0);
+  SaveIncrementally();
+  EXPECT_EQ(file_, Contents());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
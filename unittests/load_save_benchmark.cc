@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <gflags/gflags.h>
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <t3widget/widget.h>
+#include <transcript/transcript.h>
+#include <unistd.h>
+#include <vector>
+
+#include "tilde/backgroundsaver.h"
+#include "tilde/filestate.h"
+#include "tilde/filewrapper.h"
+#include "tilde/singlebyte.h"
+#include "tilde/utf8scan.h"
+#include "tilde/workerpool.h"
+
+DEFINE_int32(size_mb, 64, "Size of the generated text in MB.");
+DEFINE_int32(line_length, 80, "Length of the generated lines in characters.");
+DEFINE_string(encodings, "UTF-8,X-UTF-8-BOM,ISO-8859-1,UTF-16,SHIFT_JIS",
+              "Comma separated list of encodings to benchmark.");
+DEFINE_string(dir, "/tmp", "Directory in which to create the test files.");
+DEFINE_int32(read_block_size, 1024 * 1024, "Block size used for reading files.");
+
+using namespace t3widget;
+
+/* The sources under test call fatal through PANIC and ASSERT. */
+void fatal(const char *fmt, ...) {
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stderr, fmt, args);
+  va_end(args);
+  abort();
+}
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+struct converter_t {
+  transcript_t *handle = nullptr;
+  const single_byte_converter_t *builtin = nullptr;
+};
+
+bool IsUtf8(const std::string &encoding) {
+  return transcript_equal(encoding.c_str(), "UTF-8") ||
+         transcript_equal(encoding.c_str(), "X-UTF-8-BOM");
+}
+
+/* Characters used to build the lines, which must all be representable in the encoding. */
+std::vector<std::string> Alphabet(const std::string &encoding) {
+  std::vector<std::string> result;
+  for (char c = 'a'; c <= 'z'; ++c) {
+    result.push_back(std::string(1, c));
+  }
+  result.push_back(" ");
+  result.push_back(" ");
+  if (transcript_equal(encoding.c_str(), "SHIFT_JIS")) {
+    result.push_back("\xe6\xbc\xa2");  // U+6F22
+    result.push_back("\xe3\x81\x8b");  // U+304B
+  } else if (!transcript_equal(encoding.c_str(), "ISO-8859-1")) {
+    result.push_back("\xe2\x82\xac");  // U+20AC
+  }
+  result.push_back("\xc3\xa9");  // U+00E9
+  return result;
+}
+
+std::vector<std::string> GenerateLines(const std::string &encoding, size_t *total_size) {
+  std::vector<std::string> alphabet = Alphabet(encoding);
+  std::vector<std::string> lines;
+  size_t target = static_cast<size_t>(FLAGS_size_mb) * 1024 * 1024;
+  unsigned seed = 1;
+
+  *total_size = 0;
+  while (*total_size < target) {
+    std::string line;
+    for (int i = 0; i < FLAGS_line_length; ++i) {
+      seed = seed * 1103515245 + 12345;
+      line.append(alphabet[(seed >> 16) % alphabet.size()]);
+    }
+    *total_size += line.size() + 1;
+    lines.push_back(std::move(line));
+  }
+  return lines;
+}
+
+bool OpenConverter(const std::string &encoding, converter_t *converter) {
+  if (transcript_equal(encoding.c_str(), "UTF-8")) {
+    return true;
+  }
+  if ((converter->builtin = single_byte_converter_t::get(encoding.c_str())) != nullptr) {
+    return true;
+  }
+  transcript_error_t error;
+  converter->handle = transcript_open_converter(encoding.c_str(), TRANSCRIPT_UTF8, 0, &error);
+  if (converter->handle == nullptr) {
+    fprintf(stderr, "Could not open converter for %s: %s\n", encoding.c_str(),
+            transcript_strerror(error));
+    return false;
+  }
+  return true;
+}
+
+/* Create an unlinked file in FLAGS_dir. Returns the file descriptor, or -1 on failure. */
+int CreateFile() {
+  std::string name = FLAGS_dir + "/tilde_benchmark_XXXXXX";
+  int fd = mkstemp(&name[0]);
+  if (fd < 0) {
+    fprintf(stderr, "Could not create file in %s: %s\n", FLAGS_dir.c_str(), strerror(errno));
+    return -1;
+  }
+  unlink(name.c_str());
+  return fd;
+}
+
+/* Write the lines the same way file_buffer_t::save does when saving through a spill file: the
+   text is converted into the spill file, which write_spill_file then copies over the target.
+   Returns the number of seconds taken. */
+double Save(const std::string &encoding, const std::vector<std::string> &lines, int fd) {
+  converter_t converter;
+  if (!OpenConverter(encoding, &converter)) {
+    return -1;
+  }
+  int spill_fd = CreateFile();
+  if (spill_fd < 0) {
+    return -1;
+  }
+  clock_type::time_point start = clock_type::now();
+  off_t written_size;
+  {
+    file_write_wrapper_t wrapper(spill_fd, converter.handle, converter.builtin);
+    bool first = true;
+    for (const std::string &line : lines) {
+      if (!first) {
+        wrapper.write("\n", 1);
+      }
+      first = false;
+      wrapper.write(line.data(), line.size());
+    }
+    wrapper.flush();
+    written_size = wrapper.written_size();
+  }
+  rw_result_t result = write_spill_file({spill_fd, fd, written_size, false, "", ""}, nullptr);
+  double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+  close(spill_fd);
+  if (converter.handle != nullptr) {
+    transcript_close_converter(converter.handle);
+  }
+  if (result != rw_result_t::SUCCESS) {
+    fprintf(stderr, "Could not write spill file: %d\n", static_cast<int>(result));
+    return -1;
+  }
+  return seconds;
+}
+
+/* Read the file the same way file_buffer_t::load does. Returns the number of seconds taken. */
+double Load(const std::string &encoding, int fd, text_pos_t *line_count) {
+  text_buffer_t buffer;
+  clock_type::time_point start = clock_type::now();
+
+  if (IsUtf8(encoding)) {
+    std::unique_ptr<file_map_t> map(file_map_t::map(fd));
+    if (map == nullptr) {
+      fprintf(stderr, "Could not map file\n");
+      return -1;
+    }
+    char bom[3];
+    size_t offset =
+        map->size() >= 3 && map->read(0, 3, bom) && memcmp(bom, "\xef\xbb\xbf", 3) == 0 ? 3 : 0;
+    while (offset < map->size()) {
+      bool valid = true;
+      size_t size = std::min<size_t>(map->size() - offset, MAP_CHUNK_SIZE + 4);
+      if (!map->access(offset, size, [&](const char *data, size_t data_size) {
+            size = utf8_block_size(data, data_size, MAP_CHUNK_SIZE, &valid);
+            buffer.append_text(string_view(data, size));
+          })) {
+        fprintf(stderr, "File was truncated at offset %zu\n", offset);
+        return -1;
+      }
+      if (!valid) {
+        fprintf(stderr, "Invalid UTF-8 at offset %zu\n", offset);
+        return -1;
+      }
+      offset += size;
+    }
+  } else {
+    converter_t converter;
+    if (!OpenConverter(encoding, &converter)) {
+      return -1;
+    }
+    std::unique_ptr<file_read_wrapper_t> wrapper;
+    if (converter.builtin != nullptr) {
+      wrapper.reset(new file_read_wrapper_t(fd, converter.builtin, FLAGS_read_block_size,
+                                            get_worker_pool()->size() + 1));
+    } else {
+      wrapper.reset(new file_read_wrapper_t(fd, converter.handle, FLAGS_read_block_size));
+    }
+    try {
+      size_t used = 0;
+      while (wrapper->fill_buffer(used)) {
+        buffer.append_text(string_view(wrapper->get_buffer(), wrapper->get_fill()));
+        used = wrapper->get_fill();
+      }
+    } catch (rw_result_t &error) {
+      fprintf(stderr, "Error while reading: %d\n", static_cast<int>(error));
+      return -1;
+    }
+  }
+
+  double seconds = std::chrono::duration<double>(clock_type::now() - start).count();
+  *line_count = buffer.size();
+  return seconds;
+}
+
+long PeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/* Measurements of one phase of the benchmark. */
+struct phase_result_t {
+  double seconds = -1;
+  size_t text_size = 0;
+  text_pos_t line_count = 0;
+  long peak_rss_kb = 0;
+};
+
+/* Run @p phase in a child process. The peak RSS reported by the kernel is the high-water mark of
+   the whole process, so measuring each phase in a fresh process prevents it from including the
+   memory used by earlier phases and encodings. */
+bool RunInChild(const std::function<phase_result_t()> &phase, phase_result_t *result) {
+  int pipe_fds[2];
+  if (pipe(pipe_fds) < 0) {
+    fprintf(stderr, "Could not create pipe: %s\n", strerror(errno));
+    return false;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Could not fork: %s\n", strerror(errno));
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return false;
+  } else if (pid == 0) {
+    close(pipe_fds[0]);
+    phase_result_t child_result = phase();
+    child_result.peak_rss_kb = PeakRssKb();
+    ssize_t written = write(pipe_fds[1], &child_result, sizeof(child_result));
+    _exit(written == sizeof(child_result) ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+  close(pipe_fds[1]);
+  ssize_t bytes_read;
+  while ((bytes_read = read(pipe_fds[0], result, sizeof(*result))) < 0 && errno == EINTR) {
+  }
+  close(pipe_fds[0]);
+  int status;
+  while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+  }
+  return bytes_read == sizeof(*result) && WIFEXITED(status) &&
+         WEXITSTATUS(status) == EXIT_SUCCESS && result->seconds >= 0;
+}
+
+bool RunBenchmark(const std::string &encoding, bool first) {
+  int fd = CreateFile();
+  if (fd < 0) {
+    return false;
+  }
+
+  phase_result_t save_result, load_result;
+  bool success = RunInChild(
+      [&] {
+        phase_result_t result;
+        std::vector<std::string> lines = GenerateLines(encoding, &result.text_size);
+        try {
+          result.seconds = Save(encoding, lines, fd);
+        } catch (rw_result_t &error) {
+          fprintf(stderr, "Error while writing %s: %d\n", encoding.c_str(),
+                  static_cast<int>(error));
+        }
+        return result;
+      },
+      &save_result);
+  struct stat file_info;
+  fstat(fd, &file_info);
+
+  if (success) {
+    success = RunInChild(
+        [&] {
+          phase_result_t result;
+          if (lseek(fd, 0, SEEK_SET) == 0) {
+            result.seconds = Load(encoding, fd, &result.line_count);
+          }
+          return result;
+        },
+        &load_result);
+  }
+  close(fd);
+  if (!success) {
+    return false;
+  }
+
+  double mb = save_result.text_size / (1024.0 * 1024.0);
+  printf("%s  {\"encoding\": \"%s\", \"text_bytes\": %zu, \"file_bytes\": %jd, \"lines\": %jd, "
+         "\"load_mb_per_s\": %.1f, \"save_mb_per_s\": %.1f, \"load_peak_rss_kb\": %ld, "
+         "\"save_peak_rss_kb\": %ld}",
+         first ? "" : ",\n", encoding.c_str(), save_result.text_size,
+         static_cast<intmax_t>(file_info.st_size), static_cast<intmax_t>(load_result.line_count),
+         mb / load_result.seconds, mb / save_result.seconds, load_result.peak_rss_kb,
+         save_result.peak_rss_kb);
+  fflush(stdout);
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  transcript_init();
+
+  bool success = true;
+  bool first = true;
+  printf("[\n");
+  std::string encodings = FLAGS_encodings;
+  size_t start = 0;
+  while (start <= encodings.size()) {
+    size_t end = encodings.find(',', start);
+    if (end == std::string::npos) {
+      end = encodings.size();
+    }
+    std::string encoding = encodings.substr(start, end - start);
+    if (!encoding.empty()) {
+      if (RunBenchmark(encoding, first)) {
+        first = false;
+      } else {
+        success = false;
+      }
+    }
+    start = end + 1;
+  }
+  printf("\n]\n");
+  transcript_finalize();
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "tilde/nfccheck.h"
+
+namespace {
+
+bool IsNfcQuick(const std::string &text) { return is_nfc_quick(text.data(), text.size()); }
+
+TEST(NfcCheckTest, Ascii) {
+  EXPECT_TRUE(IsNfcQuick(""));
+  EXPECT_TRUE(IsNfcQuick("abc"));
+  EXPECT_TRUE(IsNfcQuick(std::string(1000, 'x') + "\n"));
+}
+
+TEST(NfcCheckTest, Composed) {
+  // U+00E9, U+20AC and a Hangul syllable.
+  EXPECT_TRUE(IsNfcQuick("caf\xc3\xa9 \xe2\x82\xac \xea\xb0\x80"));
+}
+
+TEST(NfcCheckTest, CombiningMarks) {
+  // e followed by U+0301, which composes with the preceding character.
+  EXPECT_FALSE(IsNfcQuick("e\xcc\x81"));
+  // U+05D0 with U+05B8 and U+05B7, which have no compositions and are in canonical order.
+  EXPECT_TRUE(IsNfcQuick("\xd7\x90\xd6\xb7\xd6\xb8"));
+  // The same marks in the wrong order.
+  EXPECT_FALSE(IsNfcQuick("\xd7\x90\xd6\xb8\xd6\xb7"));
+}
+
+TEST(NfcCheckTest, NotAllowed) {
+  // U+212B ANGSTROM SIGN, which normalizes to U+00C5.
+  EXPECT_FALSE(IsNfcQuick("\xe2\x84\xab"));
+  // Hangul jamo, which compose into syllables.
+  EXPECT_FALSE(IsNfcQuick("\xe1\x84\x80\xe1\x85\xa1"));
+}
+
+TEST(NfcCheckTest, InvalidUtf8) {
+  EXPECT_FALSE(IsNfcQuick("a\xc3"));
+  EXPECT_FALSE(IsNfcQuick("a\x80"));
+  EXPECT_FALSE(IsNfcQuick("\xed\xa0\x80"));
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
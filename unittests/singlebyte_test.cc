@@ -0,0 +1,182 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "tilde/singlebyte.h"
+
+namespace {
+
+std::string ToUnicode(const single_byte_converter_t *converter, const std::string &input,
+                      int flags = TRANSCRIPT_END_OF_TEXT,
+                      transcript_error_t expected_result = TRANSCRIPT_SUCCESS) {
+  std::string output(input.size() * 3, '\0');
+  const char *inbuf = input.data();
+  char *outbuf = &output[0];
+  EXPECT_EQ(converter->to_unicode(&inbuf, input.data() + input.size(), &outbuf,
+                                  output.data() + output.size(), flags),
+            expected_result);
+  output.resize(outbuf - output.data());
+  return output;
+}
+
+std::string FromUnicode(const single_byte_converter_t *converter, const std::string &input,
+                        int flags = TRANSCRIPT_END_OF_TEXT,
+                        transcript_error_t expected_result = TRANSCRIPT_SUCCESS) {
+  std::string output(input.size(), '\0');
+  const char *inbuf = input.data();
+  char *outbuf = &output[0];
+  EXPECT_EQ(converter->from_unicode(&inbuf, input.data() + input.size(), &outbuf,
+                                    output.data() + output.size(), flags),
+            expected_result);
+  output.resize(outbuf - output.data());
+  return output;
+}
+
+// Converts with the libtranscript converter that the built-in converters replace.
+std::string TranscriptToUnicode(transcript_t *handle, const std::string &input, int flags) {
+  std::string output(input.size() * 3, '\0');
+  const char *inbuf = input.data();
+  char *outbuf = &output[0];
+  EXPECT_EQ(transcript_to_unicode(handle, &inbuf, input.data() + input.size(), &outbuf,
+                                  output.data() + output.size(), flags),
+            TRANSCRIPT_SUCCESS);
+  output.resize(outbuf - output.data());
+  return output;
+}
+
+std::string TranscriptFromUnicode(transcript_t *handle, const std::string &input, int flags) {
+  std::string output(input.size(), '\0');
+  const char *inbuf = input.data();
+  char *outbuf = &output[0];
+  EXPECT_EQ(transcript_from_unicode(handle, &inbuf, input.data() + input.size(), &outbuf,
+                                    output.data() + output.size(), flags),
+            TRANSCRIPT_SUCCESS);
+  output.resize(outbuf - output.data());
+  return output;
+}
+
+// The built-in encodings that libtranscript also provides, which excludes X-RAW.
+const char *const kTranscriptEncodings[] = {
+    "ISO-8859-1",   "ISO-8859-2",   "ISO-8859-3",   "ISO-8859-4",   "ISO-8859-5",
+    "ISO-8859-6",   "ISO-8859-7",   "ISO-8859-8",   "ISO-8859-9",   "ISO-8859-10",
+    "ISO-8859-11",  "ISO-8859-13",  "ISO-8859-14",  "ISO-8859-15",  "ISO-8859-16",
+    "WINDOWS-874",  "WINDOWS-1250", "WINDOWS-1251", "WINDOWS-1252", "WINDOWS-1253",
+    "WINDOWS-1254", "WINDOWS-1255", "WINDOWS-1256", "WINDOWS-1257", "WINDOWS-1258",
+    "IBM-437",      "IBM-850",      "IBM-852",      "IBM-855",      "IBM-857",
+    "IBM-866",      "KOI8-R",       "KOI8-U",       "TIS-620",
+};
+
+TEST(SingleByteConverterTest, UnknownEncoding) {
+  EXPECT_EQ(single_byte_converter_t::get("UTF-8"), nullptr);
+  EXPECT_EQ(single_byte_converter_t::get("SHIFT_JIS"), nullptr);
+}
+
+TEST(SingleByteConverterTest, RawRoundTrip) {
+  const single_byte_converter_t *converter = single_byte_converter_t::get("X-RAW");
+  ASSERT_NE(converter, nullptr);
+
+  std::string all_bytes;
+  for (int i = 0; i < 256; ++i) {
+    all_bytes.push_back(static_cast<char>(i));
+  }
+  std::string utf8 = ToUnicode(converter, all_bytes);
+  EXPECT_EQ(utf8.size(), 128u + 2 * 128u);
+  EXPECT_EQ(FromUnicode(converter, utf8), all_bytes);
+}
+
+TEST(SingleByteConverterTest, TableLookup) {
+  const single_byte_converter_t *converter = single_byte_converter_t::get("ISO-8859-2");
+  ASSERT_NE(converter, nullptr);
+
+  EXPECT_EQ(ToUnicode(converter, "a\xa1z"), "a\xc4\x84z");
+  EXPECT_EQ(FromUnicode(converter, "a\xc4\x84z"), "a\xa1z");
+
+  converter = single_byte_converter_t::get("WINDOWS-1252");
+  ASSERT_NE(converter, nullptr);
+  EXPECT_EQ(ToUnicode(converter, "\x80"), "\xe2\x82\xac");
+  EXPECT_EQ(FromUnicode(converter, "\xe2\x82\xac"), "\x80");
+}
+
+TEST(SingleByteConverterTest, LongAsciiRuns) {
+  const single_byte_converter_t *converter = single_byte_converter_t::get("KOI8-R");
+  ASSERT_NE(converter, nullptr);
+
+  std::string ascii(1000, 'x');
+  std::string input = ascii + "\xc1" + ascii;
+  std::string expected = ascii + "\xd0\xb0" + ascii;
+  EXPECT_EQ(ToUnicode(converter, input), expected);
+  EXPECT_EQ(FromUnicode(converter, expected), input);
+}
+
+TEST(SingleByteConverterTest, Unassigned) {
+  const single_byte_converter_t *converter = single_byte_converter_t::get("WINDOWS-1252");
+  ASSERT_NE(converter, nullptr);
+
+  EXPECT_EQ(ToUnicode(converter, "ab\x81", TRANSCRIPT_END_OF_TEXT, TRANSCRIPT_UNASSIGNED), "ab");
+  EXPECT_EQ(ToUnicode(converter, "ab\x81", TRANSCRIPT_END_OF_TEXT | TRANSCRIPT_SUBST_UNASSIGNED),
+            "ab\xef\xbf\xbd");
+  EXPECT_EQ(FromUnicode(converter, "ab\xd0\xb0", TRANSCRIPT_END_OF_TEXT, TRANSCRIPT_UNASSIGNED),
+            "ab");
+  EXPECT_EQ(
+      FromUnicode(converter, "ab\xd0\xb0", TRANSCRIPT_END_OF_TEXT | TRANSCRIPT_SUBST_UNASSIGNED),
+      "ab\x1a");
+}
+
+TEST(SingleByteConverterTest, IncompleteInput) {
+  const single_byte_converter_t *converter = single_byte_converter_t::get("ISO-8859-1");
+  ASSERT_NE(converter, nullptr);
+
+  EXPECT_EQ(FromUnicode(converter, "a\xc3", 0, TRANSCRIPT_INCOMPLETE), "a");
+  EXPECT_EQ(FromUnicode(converter, "a\xc3", TRANSCRIPT_END_OF_TEXT, TRANSCRIPT_ILLEGAL_END), "a");
+}
+
+TEST(SingleByteConverterTest, NoSpace) {
+  const single_byte_converter_t *converter = single_byte_converter_t::get("ISO-8859-1");
+  ASSERT_NE(converter, nullptr);
+
+  std::string input = "a\xe9";
+  char output[2];
+  const char *inbuf = input.data();
+  char *outbuf = output;
+  EXPECT_EQ(converter->to_unicode(&inbuf, input.data() + input.size(), &outbuf, output + 2,
+                                  TRANSCRIPT_END_OF_TEXT),
+            TRANSCRIPT_NO_SPACE);
+  EXPECT_EQ(inbuf, input.data() + 1);
+  EXPECT_EQ(outbuf, output + 1);
+}
+
+TEST(SingleByteConverterTest, MatchesTranscript) {
+  const int flags = TRANSCRIPT_END_OF_TEXT | TRANSCRIPT_SUBST_UNASSIGNED;
+  for (const char *encoding : kTranscriptEncodings) {
+    SCOPED_TRACE(encoding);
+    const single_byte_converter_t *converter = single_byte_converter_t::get(encoding);
+    ASSERT_NE(converter, nullptr);
+    transcript_error_t error;
+    transcript_t *handle = transcript_open_converter(encoding, TRANSCRIPT_UTF8, 0, &error);
+    ASSERT_NE(handle, nullptr) << transcript_strerror(error);
+
+    for (int i = 0; i < 256; ++i) {
+      SCOPED_TRACE(i);
+      std::string byte(1, static_cast<char>(i));
+      std::string utf8 = ToUnicode(converter, byte, flags);
+      transcript_to_unicode_reset(handle);
+      EXPECT_EQ(utf8, TranscriptToUnicode(handle, byte, flags));
+      // Unassigned bytes are substituted by U+FFFD, which has no byte to convert back to.
+      if (utf8 != "\xef\xbf\xbd") {
+        transcript_from_unicode_reset(handle);
+        EXPECT_EQ(FromUnicode(converter, utf8, flags), byte);
+        EXPECT_EQ(TranscriptFromUnicode(handle, utf8, flags), byte);
+      }
+    }
+    transcript_close_converter(handle);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  transcript_init();
+  int result = RUN_ALL_TESTS();
+  transcript_finalize();
+  return result;
+}
@@ -0,0 +1,59 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "tilde/utf8scan.h"
+
+namespace {
+
+size_t BlockSize(const std::string &data, size_t max_size, bool expected_valid = true) {
+  bool valid;
+  size_t result = utf8_block_size(data.data(), data.size(), max_size, &valid);
+  EXPECT_EQ(valid, expected_valid);
+  return result;
+}
+
+TEST(Utf8ScanTest, AsciiPrefixLength) {
+  std::string data(100, 'a');
+  EXPECT_EQ(ascii_prefix_length(data.data(), data.size()), 100u);
+  data[67] = '\xc3';
+  EXPECT_EQ(ascii_prefix_length(data.data(), data.size()), 67u);
+}
+
+TEST(Utf8ScanTest, EndsOnLineBoundary) {
+  EXPECT_EQ(BlockSize("abc\ndef\nghi", 100), 11u);
+  EXPECT_EQ(BlockSize("abc\ndef\nghi", 10), 8u);
+  EXPECT_EQ(BlockSize("abcdefghi", 5), 5u);
+}
+
+TEST(Utf8ScanTest, DoesNotSplitCharacters) {
+  // U+20AC takes three bytes, which cross the end of the block.
+  EXPECT_EQ(BlockSize("ab\xe2\x82\xac", 4), 2u);
+  EXPECT_EQ(BlockSize("\xe2\x82\xac" "a", 2), 3u);
+}
+
+TEST(Utf8ScanTest, InvalidSequences) {
+  EXPECT_EQ(BlockSize("abc\ndef\xff", 100, false), 7u);
+  // Overlong encoding of '/'.
+  EXPECT_EQ(BlockSize("ab\xc0\xaf", 100, false), 2u);
+  // Surrogate.
+  EXPECT_EQ(BlockSize("ab\xed\xa0\x80", 100, false), 2u);
+  // Beyond U+10FFFF.
+  EXPECT_EQ(BlockSize("ab\xf4\x90\x80\x80", 100, false), 2u);
+  // Truncated at the end of the data.
+  EXPECT_EQ(BlockSize("ab\xe2\x82", 100, false), 2u);
+  // Missing continuation byte.
+  EXPECT_EQ(BlockSize("ab\xe2\x82z", 100, false), 2u);
+}
+
+TEST(Utf8ScanTest, ValidMultibyte) {
+  std::string data = std::string(40, 'x') + "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80\n" +
+                     std::string(40, 'y');
+  EXPECT_EQ(BlockSize(data, data.size()), data.size());
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}